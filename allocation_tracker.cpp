@@ -0,0 +1,67 @@
+// Replaces the global operator new and delete to feed AllocationTracker.
+// Link this file into a binary to turn tracking on:
+//
+//   g++ -std=c++17 -O2 bench_memory.cpp allocation_tracker.cpp ast.cpp -o bench_memory
+
+#include <malloc.h>
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#include "allocation_tracker.h"
+
+[[maybe_unused]] static const bool tracking = (AllocationTracker::linked = true);
+
+static void *allocate(size_t size, size_t alignment = 0) {
+  void *pointer =
+      alignment > alignof(std::max_align_t)
+          ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)
+          : std::malloc(size ? size : 1);
+  if (pointer) {
+    AllocationTracker::allocated(malloc_usable_size(pointer));
+  }
+  return pointer;
+}
+
+static void release(void *pointer) {
+  if (pointer) {
+    AllocationTracker::freed(malloc_usable_size(pointer));
+    std::free(pointer);
+  }
+}
+
+void *operator new(size_t size) {
+  if (void *pointer = allocate(size)) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return allocate(size); }
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return allocate(size); }
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  if (void *pointer = allocate(size, size_t(alignment))) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+  return operator new(size, alignment);
+}
+
+void operator delete(void *pointer) noexcept { release(pointer); }
+void operator delete[](void *pointer) noexcept { release(pointer); }
+void operator delete(void *pointer, size_t) noexcept { release(pointer); }
+void operator delete[](void *pointer, size_t) noexcept { release(pointer); }
+void operator delete(void *pointer, const std::nothrow_t &) noexcept { release(pointer); }
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept { release(pointer); }
+void operator delete(void *pointer, std::align_val_t) noexcept { release(pointer); }
+void operator delete[](void *pointer, std::align_val_t) noexcept { release(pointer); }
+void operator delete(void *pointer, size_t, std::align_val_t) noexcept { release(pointer); }
+void operator delete[](void *pointer, size_t, std::align_val_t) noexcept { release(pointer); }
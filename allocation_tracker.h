@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+
+#include "common.h"
+#include "json_writer.h"
+
+enum class AllocationPhase : u8 {
+  Other,
+  AstBuild,
+  IrBuild,
+  Compile,
+  Execution,
+  Teardown,
+};
+
+inline const char *to_string(AllocationPhase phase) {
+  switch (phase) {
+    case AllocationPhase::Other:
+      return "other";
+    case AllocationPhase::AstBuild:
+      return "ast_build";
+    case AllocationPhase::IrBuild:
+      return "ir_build";
+    case AllocationPhase::Compile:
+      return "compile";
+    case AllocationPhase::Execution:
+      return "execution";
+    case AllocationPhase::Teardown:
+      return "teardown";
+  }
+  return "unknown";
+}
+
+// Heap allocations per phase: count, bytes, frees and the peak growth of
+// live heap memory while the phase ran. Tracking is on when
+// allocation_tracker.cpp, which replaces the global operator new and
+// delete, is linked in; otherwise every count stays zero.
+//
+//   {
+//     AllocationTracker::Scope scope(AllocationPhase::Compile);
+//     auto executable = Jit::compile(program);
+//   }
+//   AllocationTracker::dump(stderr, program.instruction_count());
+//
+// Bytes are malloc_usable_size, what the allocator actually hands out.
+// Code lives in its own mappings and is not counted here; see Stats.
+struct AllocationTracker {
+  using i64 = int64_t;
+
+  static constexpr size_t phase_count = size_t(AllocationPhase::Teardown) + 1;
+
+  struct Counters {
+    u64 allocations;
+    u64 frees;
+    u64 bytes_allocated;
+    u64 bytes_freed;
+    u64 peak_growth;
+  };
+
+  // Attributes this thread's allocations to `phase` until destroyed;
+  // scopes nest.
+  struct Scope {
+    AllocationPhase previous_phase;
+    i64 previous_base;
+
+    explicit Scope(AllocationPhase phase)
+        : previous_phase(current_phase), previous_base(phase_base) {
+      current_phase = phase;
+      phase_base    = live.load(std::memory_order_relaxed);
+    }
+
+    ~Scope() {
+      current_phase = previous_phase;
+      phase_base    = previous_base;
+    }
+  };
+
+  // Set by allocation_tracker.cpp.
+  static bool enabled() { return linked; }
+
+  static Counters counters(AllocationPhase phase) {
+    auto &phase_counters = phases[size_t(phase)];
+    return {phase_counters.allocations.load(std::memory_order_relaxed),
+            phase_counters.frees.load(std::memory_order_relaxed),
+            phase_counters.bytes_allocated.load(std::memory_order_relaxed),
+            phase_counters.bytes_freed.load(std::memory_order_relaxed),
+            phase_counters.peak_growth.load(std::memory_order_relaxed)};
+  }
+
+  static void reset() {
+    for (auto &phase_counters : phases) {
+      phase_counters.allocations.store(0, std::memory_order_relaxed);
+      phase_counters.frees.store(0, std::memory_order_relaxed);
+      phase_counters.bytes_allocated.store(0, std::memory_order_relaxed);
+      phase_counters.bytes_freed.store(0, std::memory_order_relaxed);
+      phase_counters.peak_growth.store(0, std::memory_order_relaxed);
+    }
+    phase_base = live.load(std::memory_order_relaxed);
+  }
+
+  // One row per phase that allocated, with bytes per guest instruction
+  // when `instructions` is given.
+  static void dump(FILE *out, size_t instructions = 0) {
+    if (!enabled()) {
+      std::fprintf(out, "Allocation tracking is off; link allocation_tracker.cpp\n");
+      return;
+    }
+    std::fprintf(out, "%-10s %12s %12s %14s %14s %14s %12s\n", "phase", "allocations", "frees",
+                 "bytes", "freed", "peak growth", "bytes/instr");
+    for (size_t i = 0; i < phase_count; ++i) {
+      auto phase = counters(AllocationPhase(i));
+      if (!phase.allocations && !phase.frees) {
+        continue;
+      }
+      std::fprintf(out, "%-10s %12lu %12lu %14lu %14lu %14lu %12.1f\n",
+                   to_string(AllocationPhase(i)), phase.allocations, phase.frees,
+                   phase.bytes_allocated, phase.bytes_freed, phase.peak_growth,
+                   instructions ? double(phase.bytes_allocated) / instructions : 0.0);
+    }
+  }
+
+  // "<phase>":{"allocations":N,...} for every phase, into the object
+  // being written.
+  static void write_json(JsonWriter &json, size_t instructions = 0) {
+    for (size_t i = 0; i < phase_count; ++i) {
+      auto phase = counters(AllocationPhase(i));
+      json.begin_object(to_string(AllocationPhase(i)));
+      json.field("allocations", phase.allocations);
+      json.field("frees", phase.frees);
+      json.field("bytes_allocated", phase.bytes_allocated);
+      json.field("bytes_freed", phase.bytes_freed);
+      json.field("peak_growth", phase.peak_growth);
+      if (instructions) {
+        json.field("bytes_per_instruction", double(phase.bytes_allocated) / instructions);
+      }
+      json.end_object();
+    }
+  }
+
+  // Called by the replacement operators; must not allocate.
+  static void allocated(size_t bytes) {
+    auto &phase = phases[size_t(current_phase)];
+    phase.allocations.fetch_add(1, std::memory_order_relaxed);
+    phase.bytes_allocated.fetch_add(bytes, std::memory_order_relaxed);
+    i64 now    = live.fetch_add(i64(bytes), std::memory_order_relaxed) + i64(bytes);
+    u64 growth = u64(std::max<i64>(now - phase_base, 0));
+    u64 peak   = phase.peak_growth.load(std::memory_order_relaxed);
+    while (growth > peak &&
+           !phase.peak_growth.compare_exchange_weak(peak, growth, std::memory_order_relaxed)) {
+    }
+  }
+
+  static void freed(size_t bytes) {
+    auto &phase = phases[size_t(current_phase)];
+    phase.frees.fetch_add(1, std::memory_order_relaxed);
+    phase.bytes_freed.fetch_add(bytes, std::memory_order_relaxed);
+    live.fetch_sub(i64(bytes), std::memory_order_relaxed);
+  }
+
+  static inline bool linked{};
+
+ private:
+  // Only used for statics, which start zeroed.
+  struct PhaseCounters {
+    std::atomic<u64> allocations;
+    std::atomic<u64> frees;
+    std::atomic<u64> bytes_allocated;
+    std::atomic<u64> bytes_freed;
+    std::atomic<u64> peak_growth;
+  };
+
+  static inline PhaseCounters phases[phase_count];
+  // Live heap bytes across all threads.
+  static inline std::atomic<i64> live{};
+  static inline thread_local AllocationPhase current_phase{};
+  // `live` when this thread entered its current phase.
+  static inline thread_local i64 phase_base{};
+};
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "common.h"
+
+// Monotonic allocator: objects are bumped out of chunks that are only
+// freed, all at once, when the Arena goes away. Destructors run then too,
+// newest first, and only for types that have a non-trivial one; everything
+// else costs nothing to tear down.
+//
+// Buffers that containers outgrow are kept, by power-of-two size, for the
+// next one that grows to that size, so a growing std::vector does not leave
+// its old buffers behind.
+//
+// Full-size chunks are pooled across Arenas rather than returned to the
+// OS: faulting fresh pages back in costs more than everything else a
+// large Program's Arena does.
+struct Arena {
+  static constexpr size_t first_chunk_size = 4 * 1024;
+  static constexpr size_t max_chunk_size   = 1024 * 1024;
+  static constexpr size_t pooled_chunks    = 64;
+  // Recycled buffers are aligned to this, and hold at most 2^(classes-1)
+  // bytes.
+  static constexpr size_t recycled_alignment = alignof(void *);
+  static constexpr size_t recycled_classes   = 20;
+
+  Arena() = default;
+
+  Arena(const Arena &)            = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  ~Arena() { release(); }
+
+  void *allocate(size_t bytes, size_t alignment) {
+    auto address = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~(alignment - 1);
+    if (!cursor || address + bytes > reinterpret_cast<uintptr_t>(end)) {
+      add_chunk(bytes + alignment);
+      address = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~(alignment - 1);
+    }
+    cursor = reinterpret_cast<char *>(address + bytes);
+    return reinterpret_cast<void *>(address);
+  }
+
+  // A buffer of exactly `bytes` that was recycled, or nullptr.
+  void *reuse(size_t bytes) {
+    size_t size_class = recycled_class(bytes);
+    if (size_class == recycled_classes || !recycled[size_class]) {
+      return nullptr;
+    }
+    auto *buffer         = recycled[size_class];
+    recycled[size_class] = buffer->next;
+    return buffer;
+  }
+
+  // `buffer` must be from this Arena, aligned to recycled_alignment.
+  void recycle(void *buffer, size_t bytes) {
+    size_t size_class = recycled_class(bytes);
+    if (size_class == recycled_classes) {
+      return;
+    }
+    auto *node           = static_cast<Recycled *>(buffer);
+    node->next           = recycled[size_class];
+    recycled[size_class] = node;
+  }
+
+  // Frees the pooled chunks, for instance before checking that everything
+  // allocated has been freed. Arenas in use keep their chunks.
+  static void trim_pool() { pool().trim(); }
+
+  template <typename T, typename... Args>
+  T *make(Args &&...args) {
+    if constexpr (std::is_trivially_destructible_v<T>) {
+      return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    } else {
+      // Linked only once constructed, so a throwing constructor leaves no
+      // destructor to run.
+      auto *node    = static_cast<Destructor *>(allocate(sizeof(Destructor), alignof(Destructor)));
+      T *object     = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+      node->object  = object;
+      node->destroy = [](void *object) { static_cast<T *>(object)->~T(); };
+      node->next    = destructors;
+      destructors   = node;
+      return object;
+    }
+  }
+
+  // Runs the destructors and frees every chunk; the Arena can be reused.
+  void release() {
+    for (auto *node = destructors; node; node = node->next) {
+      node->destroy(node->object);
+    }
+    destructors = nullptr;
+    std::fill(std::begin(recycled), std::end(recycled), nullptr);
+    while (chunks) {
+      Chunk *next = chunks->next;
+      if (chunks->size != max_chunk_size || !pool().put(chunks)) {
+        ::operator delete(chunks);
+      }
+      chunks = next;
+    }
+    cursor = end    = nullptr;
+    next_chunk_size = first_chunk_size;
+  }
+
+ private:
+  struct Chunk {
+    Chunk *next;
+    size_t size;
+  };
+
+  struct ChunkPool {
+    std::mutex mutex;
+    Chunk *chunks{};
+    size_t count{};
+
+    Chunk *take() {
+      std::lock_guard<std::mutex> lock(mutex);
+      Chunk *chunk = chunks;
+      if (chunk) {
+        chunks = chunk->next;
+        count--;
+      }
+      return chunk;
+    }
+
+    void trim() {
+      std::lock_guard<std::mutex> lock(mutex);
+      while (chunks) {
+        Chunk *next = chunks->next;
+        ::operator delete(chunks);
+        chunks = next;
+      }
+      count = 0;
+    }
+
+    bool put(Chunk *chunk) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (count == pooled_chunks) {
+        return false;
+      }
+      chunk->next = chunks;
+      chunks      = chunk;
+      count++;
+      return true;
+    }
+  };
+
+  // Never destroyed, Arenas in other statics may release after it.
+  static ChunkPool &pool() {
+    static auto *pool = new ChunkPool;
+    return *pool;
+  }
+
+  struct Recycled {
+    Recycled *next;
+  };
+
+  // recycled_classes when `bytes` is not a power of two that fits.
+  static size_t recycled_class(size_t bytes) {
+    if (bytes < sizeof(Recycled) || (bytes & (bytes - 1))) {
+      return recycled_classes;
+    }
+    size_t size_class = 0;
+    while (bytes >>= 1) {
+      size_class++;
+    }
+    return std::min(size_class, recycled_classes);
+  }
+
+  struct Destructor {
+    void *object;
+    void (*destroy)(void *);
+    Destructor *next;
+  };
+
+  void add_chunk(size_t minimum) {
+    size_t size  = std::max(next_chunk_size, minimum + sizeof(Chunk));
+    Chunk *chunk = size == max_chunk_size ? pool().take() : nullptr;
+    if (!chunk) {
+      // Through operator new so AllocationTracker sees the chunks.
+      chunk = static_cast<Chunk *>(::operator new(size));
+    }
+    chunk->size     = size;
+    chunk->next     = chunks;
+    chunks          = chunk;
+    cursor          = reinterpret_cast<char *>(chunk + 1);
+    end             = reinterpret_cast<char *>(chunk) + size;
+    next_chunk_size = std::min(next_chunk_size * 2, max_chunk_size);
+  }
+
+  Chunk *chunks{};
+  char *cursor{};
+  char *end{};
+  size_t next_chunk_size{first_chunk_size};
+  Destructor *destructors{};
+  Recycled *recycled[recycled_classes]{};
+};
+
+// Standard allocator over an Arena, for containers whose memory should go
+// with it. Deallocated buffers are recycled within the Arena.
+template <typename T>
+struct ArenaAllocator {
+  using value_type = T;
+
+  Arena *arena;
+
+  ArenaAllocator(Arena &arena) : arena(&arena) {}
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+  T *allocate(size_t count) {
+    if constexpr (alignof(T) <= Arena::recycled_alignment) {
+      if (void *buffer = arena->reuse(count * sizeof(T))) {
+        return static_cast<T *>(buffer);
+      }
+      return static_cast<T *>(arena->allocate(count * sizeof(T), Arena::recycled_alignment));
+    } else {
+      return static_cast<T *>(arena->allocate(count * sizeof(T), alignof(T)));
+    }
+  }
+
+  void deallocate(T *buffer, size_t count) {
+    if constexpr (alignof(T) <= Arena::recycled_alignment) {
+      arena->recycle(buffer, count * sizeof(T));
+    }
+  }
+
+  template <typename U>
+  bool operator==(const ArenaAllocator<U> &other) const {
+    return arena == other.arena;
+  }
+
+  template <typename U>
+  bool operator!=(const ArenaAllocator<U> &other) const {
+    return arena != other.arena;
+  }
+};
+
+// Points at an object the Arena owns. Dropping the pointer does nothing;
+// the object lives until the Arena is released.
+struct ArenaOwned {
+  template <typename T>
+  void operator()(T *) const {}
+};
+
+template <typename T>
+using ArenaPtr = std::unique_ptr<T, ArenaOwned>;
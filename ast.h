@@ -37,6 +37,8 @@ struct Ast {
   struct Add;
 
   AstType type;
+  // Shared between trees and owned by an AstInterner.
+  bool interned{};
 
   Ast() = default;
 
@@ -48,6 +50,24 @@ struct Ast {
   explicit Ast(AstType type) : type(type) {}
 };
 
+// Owns an expression operand unless it is interned. Converts from
+// std::default_delete, so builders can keep passing std::make_unique
+// results.
+struct AstDeleter {
+  AstDeleter() = default;
+  template <typename T>
+  AstDeleter(const std::default_delete<T> &) {}
+
+  void operator()(Ast *ast) const {
+    if (!ast->interned) {
+      delete ast;
+    }
+  }
+};
+
+template <typename T>
+using AstPtr = std::unique_ptr<T, AstDeleter>;
+
 template <typename Derived_Reference, typename Base>
 Derived_Reference derived_cast(Base &base) {
   using Derived = std::remove_reference_t<Derived_Reference>;
@@ -69,6 +89,8 @@ Derived ast_cast(const Ast &ast) {
 struct Ast::Block final : public Ast {
   std::vector<std::unique_ptr<Ast>> children;
 
+  Block() : Ast(AstType::Block) {}
+
   template <typename T, typename... Args>
   void append(Args &&...args) {
     children.emplace_back(std::make_unique<T>(std::forward<Args>(args)...));
@@ -113,9 +135,9 @@ struct Ast::FunctionDeclaration final : public Ast {
 struct Ast::VariableDeclaration final : public Ast {
   std::string name;
   ValueType type;
-  std::unique_ptr<Ast> initializer;
+  AstPtr<Ast> initializer;
 
-  VariableDeclaration(std::string name, ValueType type, std::unique_ptr<Ast> initializer)
+  VariableDeclaration(std::string name, ValueType type, AstPtr<Ast> initializer)
       : Ast(AstType::VariableDeclaration),
         name(name),
         type(type),
@@ -129,10 +151,10 @@ struct Ast::VariableDeclaration final : public Ast {
 };
 
 struct Ast::LessThan final : public Ast {
-  std::unique_ptr<Ast> left;
-  std::unique_ptr<Ast> right;
+  AstPtr<Ast> left;
+  AstPtr<Ast> right;
 
-  LessThan(std::unique_ptr<Ast> left, std::unique_ptr<Ast> right)
+  LessThan(AstPtr<Ast> left, AstPtr<Ast> right)
       : Ast(AstType::LessThan), left(std::move(left)), right(std::move(right)) {}
 
   void dump(std::ostream &os) const override {
@@ -161,19 +183,19 @@ struct Ast::Variable final : public Ast {
 };
 
 struct Ast::Increment final : public Ast {
-  std::unique_ptr<Variable> variable;
+  AstPtr<Variable> variable;
 
-  Increment(std::unique_ptr<Variable> variable)
+  Increment(AstPtr<Variable> variable)
       : Ast(AstType::Increment), variable(std::move(variable)) {}
 
   void dump(std::ostream &os) const override { os << "Increment(" << variable->name << ")"; }
 };
 
 struct Ast::While final : public Ast {
-  std::unique_ptr<LessThan> condition;
+  AstPtr<LessThan> condition;
   std::unique_ptr<Block> body;
 
-  While(std::unique_ptr<LessThan> condition, std::unique_ptr<Block> body)
+  While(AstPtr<LessThan> condition, std::unique_ptr<Block> body)
       : Ast(AstType::While), condition(std::move(condition)), body(std::move(body)) {}
 
   void dump(std::ostream &os) const override {
@@ -187,9 +209,9 @@ struct Ast::While final : public Ast {
 
 struct Ast::Assignment final : public Ast {
   std::string name;
-  std::unique_ptr<Ast> value;
+  AstPtr<Ast> value;
 
-  Assignment(std::string name, std::unique_ptr<Ast> value)
+  Assignment(std::string name, AstPtr<Ast> value)
       : Ast(AstType::Assignment), name(name), value(std::move(value)) {}
 
   void dump(std::ostream &os) const override {
@@ -200,9 +222,9 @@ struct Ast::Assignment final : public Ast {
 };
 
 struct Ast::Return final : public Ast {
-  std::unique_ptr<Ast> value;
+  AstPtr<Ast> value;
 
-  Return(std::unique_ptr<Ast> value) : Ast(AstType::Return), value(std::move(value)) {}
+  Return(AstPtr<Ast> value) : Ast(AstType::Return), value(std::move(value)) {}
 
   void dump(std::ostream &os) const override {
     os << "Return(";
@@ -212,11 +234,11 @@ struct Ast::Return final : public Ast {
 };
 
 struct Ast::IfElse final : public Ast {
-  std::unique_ptr<LessThan> condition;
+  AstPtr<LessThan> condition;
   std::unique_ptr<Block> body;
   std::unique_ptr<Block> else_body;
 
-  IfElse(std::unique_ptr<LessThan> condition, std::unique_ptr<Block> body,
+  IfElse(AstPtr<LessThan> condition, std::unique_ptr<Block> body,
          std::unique_ptr<Block> else_body)
       : Ast(AstType::IfElse),
         condition(std::move(condition)),
@@ -235,10 +257,10 @@ struct Ast::IfElse final : public Ast {
 };
 
 struct Ast::Add final : public Ast {
-  std::unique_ptr<Ast> left;
-  std::unique_ptr<Ast> right;
+  AstPtr<Ast> left;
+  AstPtr<Ast> right;
 
-  Add(std::unique_ptr<Ast> left, std::unique_ptr<Ast> right)
+  Add(AstPtr<Ast> left, AstPtr<Ast> right)
       : Ast(AstType::Add), left(std::move(left)), right(std::move(right)) {}
 
   void dump(std::ostream &os) const override {
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "ast.h"
+#include "vm.h"
+
+// A native function compiled from an Ast::FunctionDeclaration. Calling it
+// returns what AstInterpreter().interpret() returns for the declaration.
+struct CompiledFunction {
+  using Entry = int (*)();
+
+  Executable executable;
+
+  int operator()() const { return reinterpret_cast<Entry>(executable.data)(); }
+};
+
+// Baseline compiler from the AST straight to machine code: one walk over
+// the function, emitting through Assembler as it goes, with no Program or
+// other IR in between. For scripts that finish before lowering them to a
+// Program and running the Jit would pay off.
+//
+// Every variable gets a 32-bit slot in the machine frame. The frame is
+// zeroed on entry, as AstInterpreter reads undeclared variables as 0.
+// Expressions are evaluated into EAX with right operands in ECX; a right
+// operand that is neither a Literal nor a Variable is evaluated after
+// pushing the left one. A LessThan that decides a While or IfElse becomes
+// a compare and branch.
+//
+// Statements have values like in AstInterpreter: a Block has the value of
+// its last statement, and Return evaluates its value without leaving the
+// function, which returns the value of its body.
+struct AstCompiler {
+  using Reg = Assembler::Reg;
+
+  static CompiledFunction compile(const Ast::FunctionDeclaration &function) {
+    AstCompiler compiler;
+    auto &assembler = compiler.assembler;
+    auto &buf       = compiler.buf;
+
+    assembler.prologue();
+    // One push per slot; the count is patched in once the body is compiled.
+    assembler.load_immediate32(Reg::R1, 0);
+    size_t slot_count_site = buf.size() - 4;
+    size_t zero_slot       = buf.size();
+    assembler.push_immediate8(0);
+    assembler.decrement32(Reg::R1);
+    assembler.jump_backward_if(Assembler::Condition::NotEqual, zero_slot);
+
+    compiler.compile_block(*function.body, true);
+
+    assembler.mov(Assembler::Operand::Register(Reg::StackPointer),
+                  Assembler::Operand::Register(Reg::FramePointer));
+    size_t epilogue = buf.size();
+    assembler.exit();
+    buf.patch32(slot_count_site, std::max<u32>(compiler.slot_count, 1));
+
+    // Jumps are rel32.
+    if (buf.size() > INT32_MAX) {
+      throw std::runtime_error("Function too large to compile");
+    }
+
+    size_t code_size = buf.size();
+    CompiledFunction compiled{Executable(buf.release())};
+    auto &executable = compiled.executable;
+    executable.finalize();
+    executable.register_unwind_info(EhFrameBuilder::build(executable.data, code_size, {epilogue}));
+    executable.code_size = code_size;
+
+    if (PerfJit::instance().enabled()) {
+      PerfJit::instance().code_loaded(executable.data, code_size, function.name, function.name,
+                                      {});
+    }
+    return compiled;
+  }
+
+  // Frame offset of a variable's slot, made on first use.
+  int slot(const std::string &name) {
+    auto [it, inserted] = slots.try_emplace(name, 0);
+    if (inserted) {
+      it->second = temporary();
+    }
+    return it->second;
+  }
+
+  // A slot no variable is named after.
+  int temporary() { return -8 * int(++slot_count); }
+
+  void compile_block(const Ast::Block &block, bool value) {
+    if (block.children.empty()) {
+      if (value) {
+        assembler.load_immediate32(Reg::R0, 0);
+      }
+      return;
+    }
+    for (size_t i = 0; i < block.children.size(); ++i) {
+      compile_statement(*block.children[i], value && i + 1 == block.children.size());
+    }
+  }
+
+  // Leaves the value of `ast` in EAX if `value` is set.
+  void compile_statement(const Ast &ast, bool value) {
+    switch (ast.type) {
+      case AstType::FunctionDeclaration:
+        compile_block(*ast_cast<const Ast::FunctionDeclaration &>(ast).body, value);
+        return;
+      case AstType::Block:
+        compile_block(ast_cast<const Ast::Block &>(ast), value);
+        return;
+      case AstType::While:
+        compile_while(ast_cast<const Ast::While &>(ast), value);
+        return;
+      case AstType::IfElse:
+        compile_if_else(ast_cast<const Ast::IfElse &>(ast), value);
+        return;
+      case AstType::VariableDeclaration: {
+        auto &declaration = ast_cast<const Ast::VariableDeclaration &>(ast);
+        compile_expression(*declaration.initializer);
+        assembler.store32(Reg::FramePointer, slot(declaration.name), Reg::R0);
+        return;
+      }
+      case AstType::Assignment: {
+        auto &assignment = ast_cast<const Ast::Assignment &>(ast);
+        compile_expression(*assignment.value);
+        assembler.store32(Reg::FramePointer, slot(assignment.name), Reg::R0);
+        return;
+      }
+      case AstType::Increment: {
+        int variable = slot(ast_cast<const Ast::Increment &>(ast).variable->name);
+        if (value) {
+          assembler.load32(Reg::R0, Reg::FramePointer, variable);
+        }
+        assembler.increment32(Reg::FramePointer, variable);
+        return;
+      }
+      case AstType::Return:
+        compile_expression(*ast_cast<const Ast::Return &>(ast).value);
+        return;
+      case AstType::Literal:
+      case AstType::Variable:
+        if (value) {
+          compile_expression(ast);
+        }
+        return;
+      case AstType::LessThan:
+      case AstType::Add:
+        compile_expression(ast);
+        return;
+    }
+    throw std::runtime_error("Unknown AST node type");
+  }
+
+  // Leaves the value of `ast` in EAX. Clobbers ECX.
+  void compile_expression(const Ast &ast) {
+    switch (ast.type) {
+      case AstType::Literal:
+        assembler.load_immediate32(Reg::R0,
+                                   narrow_cast<u32>(ast_cast<const Ast::Literal &>(ast).value));
+        return;
+      case AstType::Variable:
+        assembler.load32(Reg::R0, Reg::FramePointer,
+                         slot(ast_cast<const Ast::Variable &>(ast).name));
+        return;
+      case AstType::Add: {
+        auto &add = ast_cast<const Ast::Add &>(ast);
+        compile_operands(*add.left, *add.right);
+        assembler.add32(Reg::R0, Reg::R1);
+        return;
+      }
+      case AstType::LessThan: {
+        auto &less_than = ast_cast<const Ast::LessThan &>(ast);
+        compile_operands(*less_than.left, *less_than.right);
+        assembler.compare32(Reg::R0, Reg::R1);
+        assembler.set_less32(Reg::R0);
+        return;
+      }
+      default:
+        compile_statement(ast, true);
+        return;
+    }
+  }
+
+  // Left in EAX, right in ECX.
+  void compile_operands(const Ast &left, const Ast &right) {
+    compile_expression(left);
+    switch (right.type) {
+      case AstType::Literal:
+        assembler.load_immediate32(Reg::R1,
+                                   narrow_cast<u32>(ast_cast<const Ast::Literal &>(right).value));
+        return;
+      case AstType::Variable:
+        assembler.load32(Reg::R1, Reg::FramePointer,
+                         slot(ast_cast<const Ast::Variable &>(right).name));
+        return;
+      default:
+        assembler.push(Reg::R0);
+        compile_expression(right);
+        assembler.mov(Assembler::Operand::Register(Reg::R1),
+                      Assembler::Operand::Register(Reg::R0));
+        assembler.pop(Reg::R0);
+        return;
+    }
+  }
+
+  // Falls through when the condition holds and returns the placeholder of
+  // the jump taken when it does not.
+  size_t compile_condition(const Ast::LessThan &condition) {
+    compile_operands(*condition.left, *condition.right);
+    assembler.compare32(Reg::R0, Reg::R1);
+    return assembler.jump_forward_if(Assembler::Condition::GreaterOrEqual);
+  }
+
+  // The value of a loop is that of the last iteration's body, or 0, and is
+  // kept in a temporary slot only when it is used.
+  void compile_while(const Ast::While &while_loop, bool value) {
+    int result = value ? temporary() : 0;
+    if (value) {
+      assembler.load_immediate32(Reg::R0, 0);
+      assembler.store32(Reg::FramePointer, result, Reg::R0);
+    }
+    size_t header = buf.size();
+    auto done     = compile_condition(*while_loop.condition);
+    compile_block(*while_loop.body, value);
+    if (value) {
+      assembler.store32(Reg::FramePointer, result, Reg::R0);
+    }
+    assembler.jump_backward(header);
+    assembler.bind(done);
+    if (value) {
+      assembler.load32(Reg::R0, Reg::FramePointer, result);
+    }
+  }
+
+  void compile_if_else(const Ast::IfElse &if_else, bool value) {
+    auto else_body = compile_condition(*if_else.condition);
+    compile_block(*if_else.body, value);
+    auto done = assembler.jump_forward();
+    assembler.bind(else_body);
+    compile_block(*if_else.else_body, value);
+    assembler.bind(done);
+  }
+
+  CodeBuffer buf;
+  // The names stay in the AST, which outlives compilation.
+  std::unordered_map<std::string_view, int> slots;
+  u32 slot_count{};
+  // Holds Assembler's block relocations, of which there are none: every
+  // jump here is either backwards or bound when its target is emitted.
+  Arena scratch;
+  Assembler assembler{buf, scratch};
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <memory>
+#include <random>
+#include <string>
+
+#include "ast.h"
+
+// Random functions of declarations, assignments of sums, if/else and
+// counted while loops over a shared set of variable names, of about
+// `statements` statements each.
+struct ScriptBuilder {
+  static constexpr int variable_count = 8;
+
+  std::mt19937_64 rng;
+  size_t statements;
+  int counters{};
+
+  std::string variable() { return "v" + std::to_string(rng() % variable_count); }
+  int literal() { return int(rng() % 100); }
+
+  std::unique_ptr<Ast> operand() {
+    if (rng() % 2) {
+      return std::make_unique<Ast::Variable>(variable());
+    }
+    return std::make_unique<Ast::Literal>(literal());
+  }
+
+  std::unique_ptr<Ast::Assignment> assignment() {
+    return std::make_unique<Ast::Assignment>(
+        variable(), std::make_unique<Ast::Add>(std::make_unique<Ast::Variable>(variable()),
+                                               std::make_unique<Ast::Literal>(literal())));
+  }
+
+  std::unique_ptr<Ast::LessThan> compare() {
+    return std::make_unique<Ast::LessThan>(std::make_unique<Ast::Variable>(variable()), operand());
+  }
+
+  // Values only ever grow by small literals, so nothing overflows.
+  void statement(Ast::Block &block) {
+    switch (rng() % 4) {
+      case 0:
+      case 1:
+        block.children.push_back(assignment());
+        break;
+      case 2: {
+        auto body      = std::make_unique<Ast::Block>();
+        auto else_body = std::make_unique<Ast::Block>();
+        body->children.push_back(assignment());
+        else_body->children.push_back(assignment());
+        block.append<Ast::IfElse>(compare(), std::move(body), std::move(else_body));
+        break;
+      }
+      case 3: {
+        std::string counter = "c" + std::to_string(counters++);
+        block.append<Ast::VariableDeclaration>(counter, ValueType::Int,
+                                               std::make_unique<Ast::Literal>(0));
+        auto body = std::make_unique<Ast::Block>();
+        body->children.push_back(assignment());
+        body->append<Ast::Increment>(std::make_unique<Ast::Variable>(counter));
+        block.append<Ast::While>(
+            std::make_unique<Ast::LessThan>(std::make_unique<Ast::Variable>(counter),
+                                            std::make_unique<Ast::Literal>(3)),
+            std::move(body));
+        break;
+      }
+    }
+  }
+
+  std::unique_ptr<Ast::FunctionDeclaration> function(size_t index) {
+    auto body = std::make_unique<Ast::Block>();
+    counters  = 0;
+    for (int i = 0; i < variable_count; ++i) {
+      body->append<Ast::VariableDeclaration>("v" + std::to_string(i), ValueType::Int,
+                                             std::make_unique<Ast::Literal>(literal()));
+    }
+    for (size_t i = 0; i < statements; ++i) {
+      statement(*body);
+    }
+    body->append<Ast::Return>(std::make_unique<Ast::Variable>("v0"));
+    return std::make_unique<Ast::FunctionDeclaration>("f" + std::to_string(index), ValueType::Int,
+                                                      std::move(body));
+  }
+};
+
+inline size_t count_nodes(const Ast &ast) {
+  switch (ast.type) {
+    case AstType::FunctionDeclaration:
+      return 1 + count_nodes(*ast_cast<const Ast::FunctionDeclaration &>(ast).body);
+    case AstType::Block: {
+      size_t count = 1;
+      for (const auto &child : ast_cast<const Ast::Block &>(ast).children) {
+        count += count_nodes(*child);
+      }
+      return count;
+    }
+    case AstType::While: {
+      auto &while_loop = ast_cast<const Ast::While &>(ast);
+      return 1 + count_nodes(*while_loop.condition) + count_nodes(*while_loop.body);
+    }
+    case AstType::VariableDeclaration:
+      return 1 + count_nodes(*ast_cast<const Ast::VariableDeclaration &>(ast).initializer);
+    case AstType::LessThan: {
+      auto &less_than = ast_cast<const Ast::LessThan &>(ast);
+      return 1 + count_nodes(*less_than.left) + count_nodes(*less_than.right);
+    }
+    case AstType::Increment:
+      return 2;
+    case AstType::Literal:
+    case AstType::Variable:
+      return 1;
+    case AstType::Assignment:
+      return 1 + count_nodes(*ast_cast<const Ast::Assignment &>(ast).value);
+    case AstType::Return:
+      return 1 + count_nodes(*ast_cast<const Ast::Return &>(ast).value);
+    case AstType::IfElse: {
+      auto &if_else = ast_cast<const Ast::IfElse &>(ast);
+      return 1 + count_nodes(*if_else.condition) + count_nodes(*if_else.body) +
+             count_nodes(*if_else.else_body);
+    }
+    case AstType::Add: {
+      auto &add = ast_cast<const Ast::Add &>(ast);
+      return 1 + count_nodes(*add.left) + count_nodes(*add.right);
+    }
+  }
+  return 0;
+}
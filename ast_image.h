@@ -0,0 +1,667 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+#include "ast_interner.h"
+#include "common.h"
+
+// Ast functions in a compact pre-order binary encoding, so large scripts
+// load without running their builders again. An image is either read back
+// into Ast nodes in one sequential pass, or run where it lies by
+// AstImageInterpreter:
+//
+//   AstWriter::write(functions, "script.asti");
+//   auto image = AstImage::map("script.asti");
+//   auto loaded = image.read();
+//   int result  = AstImageInterpreter(image).interpret(0);
+//
+// After the header:
+//
+//   functions  u32[function_count]: where each function starts in the tree
+//   strings    string_count names, each a length and its bytes, interned
+//   tree       the functions' nodes in pre-order
+//
+// A node is its AstType tag, then its fields in declaration order, child
+// nodes inline:
+//
+//   FunctionDeclaration  name, return type, body Block
+//   Block                child count, u32 byte size of the children, children
+//   While                condition LessThan, body Block
+//   VariableDeclaration  name, type, initializer
+//   LessThan, Add        left, right
+//   Increment            Variable
+//   Literal              value
+//   Variable             name
+//   Assignment           name, value
+//   Return               value
+//   IfElse               condition LessThan, body Block, else Block
+//
+// Counts, lengths and names (string indices) are LEB128 varints, literals
+// zigzag-encoded; types are one byte. The Block size lets interpreters
+// skip untaken branches and finished loops.
+//
+// Reading with an AstInterner shares the pure expressions of everything
+// read through it.
+struct AstImageHeader {
+  static constexpr char expected_magic[8] = {'V', 'M', 'A', 'S', 'T', 0, 0, 0};
+  static constexpr u32 current_version    = 1;
+
+  char magic[8];
+  u32 version;
+  u32 function_count;
+  u32 string_count;
+  u32 functions_offset;
+  u32 strings_offset;
+  u32 tree_offset;
+  u32 tree_size;
+  u32 reserved;
+};
+
+// Reads one image's bytes, throwing instead of running past `end`.
+struct AstImageCursor {
+  const u8 *position;
+  const u8 *end;
+
+  u8 byte() {
+    if (position == end) {
+      throw std::runtime_error("Truncated AST image");
+    }
+    return *position++;
+  }
+
+  u64 varint() {
+    u64 value = 0;
+    for (u32 shift = 0; shift < 64; shift += 7) {
+      u8 next = byte();
+      value |= u64(next & 0x7f) << shift;
+      if (!(next & 0x80)) {
+        return value;
+      }
+    }
+    throw std::runtime_error("Malformed varint in AST image");
+  }
+
+  int literal() {
+    u64 zigzag = varint();
+    return int(int64_t(zigzag >> 1) ^ -int64_t(zigzag & 1));
+  }
+
+  u32 u32_le() {
+    if (end - position < 4) {
+      throw std::runtime_error("Truncated AST image");
+    }
+    u32 value;
+    std::memcpy(&value, position, sizeof(value));
+    position += sizeof(value);
+    return value;
+  }
+
+  AstType tag() {
+    AstType type = peek();
+    position++;
+    return type;
+  }
+
+  AstType peek() const {
+    if (position == end) {
+      throw std::runtime_error("Truncated AST image");
+    }
+    if (*position > u8(AstType::Add)) {
+      throw std::runtime_error("Unknown node type in AST image");
+    }
+    return AstType(*position);
+  }
+
+  void expect(AstType expected) {
+    if (tag() != expected) {
+      throw std::runtime_error("Unexpected node type in AST image");
+    }
+  }
+
+  void skip(u32 bytes) {
+    if (u64(end - position) < bytes) {
+      throw std::runtime_error("Truncated AST image");
+    }
+    position += bytes;
+  }
+};
+
+struct AstImage {
+  static AstImage map(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("Cannot open AST image " + path);
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || size_t(status.st_size) < sizeof(AstImageHeader)) {
+      close(fd);
+      throw std::runtime_error("Truncated AST image " + path);
+    }
+    size_t size = status.st_size;
+    void *data  = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("Cannot map AST image " + path);
+    }
+    // Unmapped again by the destructor if validation throws.
+    AstImage image(static_cast<const u8 *>(data), size, true);
+    image.validate();
+    return image;
+  }
+
+  // An image in memory the caller keeps alive.
+  static AstImage view(const void *data, size_t size) {
+    AstImage image(static_cast<const u8 *>(data), size, false);
+    image.validate();
+    return image;
+  }
+
+  AstImage(AstImage &&other) noexcept
+      : data(other.data),
+        size(other.size),
+        mapped(other.mapped),
+        strings(std::move(other.strings)) {
+    other.mapped = false;
+  }
+  AstImage &operator=(AstImage &&) = delete;
+
+  ~AstImage() {
+    if (mapped) {
+      munmap(const_cast<u8 *>(data), size);
+    }
+  }
+
+  const AstImageHeader &header() const {
+    return *reinterpret_cast<const AstImageHeader *>(data);
+  }
+
+  u32 function_count() const { return header().function_count; }
+  u32 string_count() const { return header().string_count; }
+
+  // Names point into the image.
+  std::string_view string(u64 index) const {
+    if (index >= strings.size()) {
+      throw std::runtime_error("String index out of range in AST image");
+    }
+    return strings[index];
+  }
+
+  // Positioned at the FunctionDeclaration tag of function `index`.
+  AstImageCursor function(u32 index) const {
+    if (index >= function_count()) {
+      throw std::runtime_error("Function index out of range in AST image");
+    }
+    u32 offset;
+    std::memcpy(&offset, data + header().functions_offset + index * sizeof(u32), sizeof(offset));
+    if (offset >= header().tree_size) {
+      throw std::runtime_error("Function offset out of range in AST image");
+    }
+    return {tree() + offset, tree() + header().tree_size};
+  }
+
+  // Reads only the name, without the body.
+  std::string_view function_name(u32 index) const {
+    auto cursor = function(index);
+    cursor.expect(AstType::FunctionDeclaration);
+    return string(cursor.varint());
+  }
+
+  std::unique_ptr<Ast::FunctionDeclaration> read_function(u32 index,
+                                                          AstInterner *interner = nullptr) const {
+    auto cursor = function(index);
+    cursor.expect(AstType::FunctionDeclaration);
+    return read_function(cursor, interner);
+  }
+
+  std::vector<std::unique_ptr<Ast::FunctionDeclaration>> read(
+      AstInterner *interner = nullptr) const {
+    std::vector<std::unique_ptr<Ast::FunctionDeclaration>> functions;
+    functions.reserve(function_count());
+    AstImageCursor cursor{tree(), tree() + header().tree_size};
+    for (u32 i = 0; i < function_count(); ++i) {
+      cursor.expect(AstType::FunctionDeclaration);
+      functions.push_back(read_function(cursor, interner));
+    }
+    return functions;
+  }
+
+ private:
+  AstImage(const u8 *data, size_t size, bool mapped) : data(data), size(size), mapped(mapped) {}
+
+  const u8 *tree() const { return data + header().tree_offset; }
+
+  // Header, sections and the string table: linear in the strings only.
+  void validate() {
+    if (size < sizeof(AstImageHeader)) {
+      throw std::runtime_error("Truncated AST image");
+    }
+    auto &header = this->header();
+    if (std::memcmp(header.magic, AstImageHeader::expected_magic, sizeof(header.magic))) {
+      throw std::runtime_error("Not an AST image");
+    }
+    if (header.version != AstImageHeader::current_version) {
+      throw std::runtime_error("Unsupported AST image version " + std::to_string(header.version));
+    }
+    if (header.functions_offset < sizeof(AstImageHeader) ||
+        u64(header.functions_offset) + u64(header.function_count) * sizeof(u32) >
+            header.strings_offset ||
+        header.strings_offset > header.tree_offset ||
+        u64(header.tree_offset) + header.tree_size != size) {
+      throw std::runtime_error("Malformed AST image");
+    }
+    AstImageCursor cursor{data + header.strings_offset, data + header.tree_offset};
+    strings.reserve(header.string_count);
+    for (u32 i = 0; i < header.string_count; ++i) {
+      u64 length = cursor.varint();
+      auto *text = reinterpret_cast<const char *>(cursor.position);
+      cursor.skip(narrow_cast<u32>(std::min<u64>(length, UINT32_MAX)));
+      strings.emplace_back(text, length);
+    }
+  }
+
+  std::string name(AstImageCursor &cursor) const { return std::string(string(cursor.varint())); }
+
+  static ValueType value_type(AstImageCursor &cursor) {
+    u8 type = cursor.byte();
+    if (type > u8(ValueType::Bool)) {
+      throw std::runtime_error("Unknown value type in AST image");
+    }
+    return ValueType(type);
+  }
+
+  std::unique_ptr<Ast::FunctionDeclaration> read_function(AstImageCursor &cursor,
+                                                          AstInterner *interner) const {
+    auto name        = this->name(cursor);
+    auto return_type = value_type(cursor);
+    cursor.expect(AstType::Block);
+    return std::make_unique<Ast::FunctionDeclaration>(std::move(name), return_type,
+                                                      read_block(cursor, interner));
+  }
+
+  std::unique_ptr<Ast::Block> read_block(AstImageCursor &cursor, AstInterner *interner) const {
+    auto block = std::make_unique<Ast::Block>();
+    u64 count  = cursor.varint();
+    u32 size   = cursor.u32_le();
+    if (size > u64(cursor.end - cursor.position)) {
+      throw std::runtime_error("Truncated AST image");
+    }
+    auto *end = cursor.position + size;
+    block->children.reserve(std::min<u64>(count, size));
+    for (u64 i = 0; i < count; ++i) {
+      // Block children are plain unique_ptrs, so an expression statement is
+      // read unshared.
+      bool expression = AstInterner::interns(cursor.peek());
+      block->children.emplace_back(read_node(cursor, expression ? nullptr : interner).release());
+    }
+    if (cursor.position != end) {
+      throw std::runtime_error("Block size mismatch in AST image");
+    }
+    return block;
+  }
+
+  AstPtr<Ast::LessThan> read_less_than(AstImageCursor &cursor, AstInterner *interner) const {
+    cursor.expect(AstType::LessThan);
+    return read_operands(cursor, interner);
+  }
+
+  // The operands of a LessThan whose tag has been read.
+  AstPtr<Ast::LessThan> read_operands(AstImageCursor &cursor, AstInterner *interner) const {
+    auto left  = read_node(cursor, interner);
+    auto right = read_node(cursor, interner);
+    if (interner) {
+      return interner->less_than(std::move(left), std::move(right));
+    }
+    return std::make_unique<Ast::LessThan>(std::move(left), std::move(right));
+  }
+
+  AstPtr<Ast> read_node(AstImageCursor &cursor, AstInterner *interner) const {
+    switch (cursor.tag()) {
+      case AstType::FunctionDeclaration:
+        return read_function(cursor, interner);
+      case AstType::Block:
+        return read_block(cursor, interner);
+      case AstType::While: {
+        auto condition = read_less_than(cursor, interner);
+        cursor.expect(AstType::Block);
+        return std::make_unique<Ast::While>(std::move(condition), read_block(cursor, interner));
+      }
+      case AstType::VariableDeclaration: {
+        auto name = this->name(cursor);
+        auto type = value_type(cursor);
+        return std::make_unique<Ast::VariableDeclaration>(std::move(name), type,
+                                                          read_node(cursor, interner));
+      }
+      case AstType::LessThan:
+        return read_operands(cursor, interner);
+      case AstType::Increment:
+        cursor.expect(AstType::Variable);
+        return std::make_unique<Ast::Increment>(std::make_unique<Ast::Variable>(name(cursor)));
+      case AstType::Literal:
+        if (interner) {
+          return interner->literal(cursor.literal());
+        }
+        return std::make_unique<Ast::Literal>(cursor.literal());
+      case AstType::Variable:
+        if (interner) {
+          return interner->variable(name(cursor));
+        }
+        return std::make_unique<Ast::Variable>(name(cursor));
+      case AstType::Assignment: {
+        auto name = this->name(cursor);
+        return std::make_unique<Ast::Assignment>(std::move(name), read_node(cursor, interner));
+      }
+      case AstType::Return:
+        return std::make_unique<Ast::Return>(read_node(cursor, interner));
+      case AstType::IfElse: {
+        auto condition = read_less_than(cursor, interner);
+        cursor.expect(AstType::Block);
+        auto body = read_block(cursor, interner);
+        cursor.expect(AstType::Block);
+        return std::make_unique<Ast::IfElse>(std::move(condition), std::move(body),
+                                             read_block(cursor, interner));
+      }
+      case AstType::Add: {
+        auto left  = read_node(cursor, interner);
+        auto right = read_node(cursor, interner);
+        if (interner) {
+          return interner->add(std::move(left), std::move(right));
+        }
+        return std::make_unique<Ast::Add>(std::move(left), std::move(right));
+      }
+    }
+    throw std::runtime_error("Unknown node type in AST image");
+  }
+
+  const u8 *data;
+  size_t size;
+  bool mapped;
+  std::vector<std::string_view> strings;
+};
+
+struct AstWriter {
+  static std::vector<u8> build(
+      const std::vector<std::unique_ptr<Ast::FunctionDeclaration>> &functions) {
+    AstWriter writer;
+    std::vector<u32> offsets;
+    for (const auto &function : functions) {
+      offsets.push_back(narrow_cast<u32>(writer.tree.size()));
+      writer.node(*function);
+    }
+    return writer.assemble(offsets);
+  }
+
+  // Through a temporary file and a rename, so a half-written image is never
+  // mapped.
+  static void write(const std::vector<std::unique_ptr<Ast::FunctionDeclaration>> &functions,
+                    const std::string &path) {
+    auto image            = build(functions);
+    std::string temporary = path + ".tmp";
+    FILE *out             = std::fopen(temporary.c_str(), "wb");
+    if (!out) {
+      throw std::runtime_error("Cannot create AST image " + temporary);
+    }
+    bool written = std::fwrite(image.data(), 1, image.size(), out) == image.size();
+    written      = std::fclose(out) == 0 && written;
+    if (!written || std::rename(temporary.c_str(), path.c_str()) != 0) {
+      std::remove(temporary.c_str());
+      throw std::runtime_error("Cannot write AST image " + path);
+    }
+  }
+
+ private:
+  std::vector<u8> tree;
+  std::vector<u8> strings;
+  std::unordered_map<std::string, u32> string_indices;
+
+  static void varint(std::vector<u8> &out, u64 value) {
+    while (value >= 0x80) {
+      out.push_back(u8(value) | 0x80);
+      value >>= 7;
+    }
+    out.push_back(u8(value));
+  }
+
+  void name(const std::string &name) {
+    auto [it, inserted] = string_indices.emplace(name, narrow_cast<u32>(string_indices.size()));
+    if (inserted) {
+      varint(strings, name.size());
+      strings.insert(strings.end(), name.begin(), name.end());
+    }
+    varint(tree, it->second);
+  }
+
+  void tag(AstType type) { tree.push_back(u8(type)); }
+
+  void block(const Ast::Block &block) {
+    tag(AstType::Block);
+    varint(tree, block.children.size());
+    size_t size_at = tree.size();
+    tree.resize(size_at + sizeof(u32));
+    for (const auto &child : block.children) {
+      node(*child);
+    }
+    u32 size = narrow_cast<u32>(tree.size() - size_at - sizeof(u32));
+    std::memcpy(tree.data() + size_at, &size, sizeof(size));
+  }
+
+  void node(const Ast &ast) {
+    switch (ast.type) {
+      case AstType::FunctionDeclaration: {
+        auto &function = ast_cast<const Ast::FunctionDeclaration &>(ast);
+        tag(ast.type);
+        name(function.name);
+        tree.push_back(u8(function.return_type));
+        block(*function.body);
+        break;
+      }
+      case AstType::Block:
+        block(ast_cast<const Ast::Block &>(ast));
+        break;
+      case AstType::While: {
+        auto &while_loop = ast_cast<const Ast::While &>(ast);
+        tag(ast.type);
+        node(*while_loop.condition);
+        block(*while_loop.body);
+        break;
+      }
+      case AstType::VariableDeclaration: {
+        auto &declaration = ast_cast<const Ast::VariableDeclaration &>(ast);
+        tag(ast.type);
+        name(declaration.name);
+        tree.push_back(u8(declaration.type));
+        node(*declaration.initializer);
+        break;
+      }
+      case AstType::LessThan: {
+        auto &less_than = ast_cast<const Ast::LessThan &>(ast);
+        tag(ast.type);
+        node(*less_than.left);
+        node(*less_than.right);
+        break;
+      }
+      case AstType::Increment:
+        tag(ast.type);
+        node(*ast_cast<const Ast::Increment &>(ast).variable);
+        break;
+      case AstType::Literal: {
+        int64_t value = ast_cast<const Ast::Literal &>(ast).value;
+        tag(ast.type);
+        varint(tree, (u64(value) << 1) ^ u64(value >> 63));
+        break;
+      }
+      case AstType::Variable:
+        tag(ast.type);
+        name(ast_cast<const Ast::Variable &>(ast).name);
+        break;
+      case AstType::Assignment: {
+        auto &assignment = ast_cast<const Ast::Assignment &>(ast);
+        tag(ast.type);
+        name(assignment.name);
+        node(*assignment.value);
+        break;
+      }
+      case AstType::Return:
+        tag(ast.type);
+        node(*ast_cast<const Ast::Return &>(ast).value);
+        break;
+      case AstType::IfElse: {
+        auto &if_else = ast_cast<const Ast::IfElse &>(ast);
+        tag(ast.type);
+        node(*if_else.condition);
+        block(*if_else.body);
+        block(*if_else.else_body);
+        break;
+      }
+      case AstType::Add: {
+        auto &add = ast_cast<const Ast::Add &>(ast);
+        tag(ast.type);
+        node(*add.left);
+        node(*add.right);
+        break;
+      }
+    }
+  }
+
+  std::vector<u8> assemble(const std::vector<u32> &offsets) {
+    AstImageHeader header{};
+    std::memcpy(header.magic, AstImageHeader::expected_magic, sizeof(header.magic));
+    header.version          = AstImageHeader::current_version;
+    header.function_count   = narrow_cast<u32>(offsets.size());
+    header.string_count     = narrow_cast<u32>(string_indices.size());
+    header.functions_offset = sizeof(header);
+    header.strings_offset   = narrow_cast<u32>(sizeof(header) + offsets.size() * sizeof(u32));
+    header.tree_offset      = narrow_cast<u32>(header.strings_offset + strings.size());
+    header.tree_size        = narrow_cast<u32>(tree.size());
+
+    std::vector<u8> image(header.tree_offset + tree.size());
+    std::memcpy(image.data(), &header, sizeof(header));
+    std::memcpy(image.data() + header.functions_offset, offsets.data(),
+                offsets.size() * sizeof(u32));
+    std::memcpy(image.data() + header.strings_offset, strings.data(), strings.size());
+    std::memcpy(image.data() + header.tree_offset, tree.data(), tree.size());
+    return image;
+  }
+};
+
+// AstInterpreter over an image, without building Ast nodes. Variables are
+// indexed by their interned name instead of hashed by it.
+struct AstImageInterpreter {
+  explicit AstImageInterpreter(const AstImage &image)
+      : variables(image.string_count()), image(image) {}
+
+  int interpret(u32 function) {
+    auto cursor = image.function(function);
+    cursor.expect(AstType::FunctionDeclaration);
+    image.string(cursor.varint());
+    cursor.byte();
+    cursor.expect(AstType::Block);
+    return interpret_block(cursor);
+  }
+
+  std::vector<int> variables;
+
+ private:
+  int &variable(AstImageCursor &cursor) {
+    u64 index = cursor.varint();
+    if (index >= variables.size()) {
+      throw std::runtime_error("String index out of range in AST image");
+    }
+    return variables[index];
+  }
+
+  // After the Block tag.
+  int interpret_block(AstImageCursor &cursor) {
+    u64 count = cursor.varint();
+    cursor.u32_le();
+    int result = 0;
+    for (u64 i = 0; i < count; ++i) {
+      result = interpret(cursor);
+    }
+    return result;
+  }
+
+  void skip_block(AstImageCursor &cursor) {
+    cursor.expect(AstType::Block);
+    cursor.varint();
+    cursor.skip(cursor.u32_le());
+  }
+
+  int interpret(AstImageCursor &cursor) {
+    switch (cursor.tag()) {
+      case AstType::Variable:
+        return variable(cursor);
+      case AstType::Literal:
+        return cursor.literal();
+      case AstType::LessThan: {
+        int left = interpret(cursor);
+        return left < interpret(cursor);
+      }
+      case AstType::VariableDeclaration: {
+        int &declared = variable(cursor);
+        cursor.byte();
+        return declared = interpret(cursor);
+      }
+      case AstType::Increment:
+        cursor.expect(AstType::Variable);
+        return variable(cursor)++;
+      case AstType::While: {
+        int result     = 0;
+        auto condition = cursor;
+        for (;;) {
+          cursor = condition;
+          if (!interpret(cursor)) {
+            skip_block(cursor);
+            return result;
+          }
+          cursor.expect(AstType::Block);
+          result = interpret_block(cursor);
+        }
+      }
+      case AstType::Block:
+        return interpret_block(cursor);
+      case AstType::FunctionDeclaration:
+        image.string(cursor.varint());
+        cursor.byte();
+        cursor.expect(AstType::Block);
+        return interpret_block(cursor);
+      case AstType::Assignment: {
+        int &assigned = variable(cursor);
+        return assigned = interpret(cursor);
+      }
+      case AstType::Return:
+        return interpret(cursor);
+      case AstType::IfElse: {
+        int result;
+        if (interpret(cursor)) {
+          cursor.expect(AstType::Block);
+          result = interpret_block(cursor);
+          skip_block(cursor);
+        } else {
+          skip_block(cursor);
+          cursor.expect(AstType::Block);
+          result = interpret_block(cursor);
+        }
+        return result;
+      }
+      case AstType::Add: {
+        int left = interpret(cursor);
+        return left + interpret(cursor);
+      }
+    }
+    throw std::runtime_error("Unknown node type in AST image");
+  }
+
+  const AstImage &image;
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ast.h"
+#include "common.h"
+
+// Hash-consing of pure expressions: structurally equal Literal, Variable,
+// Add and LessThan nodes come back as one node, shared by every tree using
+// it. Machine-generated scripts that repeat the same expressions then hold
+// each of them once, and two expressions from the same interner are equal
+// exactly when they are the same node.
+//
+//   AstInterner interner;
+//   auto sum = interner.add(interner.variable("t1"), interner.variable("t2"));
+//   body.append<Ast::Assignment>("t3", std::move(sum));
+//
+// The interner owns the shared nodes and must outlive the trees using
+// them, whose AstPtrs leave interned nodes alone. Shared nodes must not be
+// modified. An Add or LessThan with an operand that is not interned (an
+// Increment, say) is built as an ordinary node owned by its tree.
+struct AstInterner {
+  struct Stats {
+    // Expressions asked for, and how many of them were already held.
+    u64 requests;
+    u64 hits;
+    // Distinct nodes held.
+    u64 nodes;
+    // What the hits would have allocated as separate nodes.
+    u64 bytes_saved;
+  };
+
+  AstInterner() = default;
+
+  AstInterner(const AstInterner &)            = delete;
+  AstInterner &operator=(const AstInterner &) = delete;
+
+  // Newest first: a node's operands were interned before it, and its
+  // AstPtrs look at them while it is destroyed.
+  ~AstInterner() {
+    while (!nodes.empty()) {
+      nodes.pop_back();
+    }
+  }
+
+  static bool interns(AstType type) {
+    return type == AstType::Literal || type == AstType::Variable || type == AstType::Add ||
+           type == AstType::LessThan;
+  }
+
+  AstPtr<Ast::Literal> literal(int value) {
+    return share(literals[value], [&] { return std::make_unique<Ast::Literal>(value); });
+  }
+
+  AstPtr<Ast::Variable> variable(const std::string &name) {
+    return share(variables[name], [&] { return std::make_unique<Ast::Variable>(name); });
+  }
+
+  AstPtr<Ast::Add> add(AstPtr<Ast> left, AstPtr<Ast> right) {
+    if (!left->interned || !right->interned) {
+      return std::make_unique<Ast::Add>(std::move(left), std::move(right));
+    }
+    return share(adds[{left.get(), right.get()}], [&] {
+      return std::make_unique<Ast::Add>(std::move(left), std::move(right));
+    });
+  }
+
+  AstPtr<Ast::LessThan> less_than(AstPtr<Ast> left, AstPtr<Ast> right) {
+    if (!left->interned || !right->interned) {
+      return std::make_unique<Ast::LessThan>(std::move(left), std::move(right));
+    }
+    return share(less_thans[{left.get(), right.get()}], [&] {
+      return std::make_unique<Ast::LessThan>(std::move(left), std::move(right));
+    });
+  }
+
+  // Structural equality of pure expressions; anything else is only equal
+  // to itself. Two interned nodes are compared by address alone.
+  static bool equal(const Ast &a, const Ast &b) {
+    if (&a == &b) {
+      return true;
+    }
+    if (a.type != b.type || (a.interned && b.interned)) {
+      return false;
+    }
+    switch (a.type) {
+      case AstType::Literal:
+        return ast_cast<const Ast::Literal &>(a).value == ast_cast<const Ast::Literal &>(b).value;
+      case AstType::Variable:
+        return ast_cast<const Ast::Variable &>(a).name == ast_cast<const Ast::Variable &>(b).name;
+      case AstType::Add: {
+        auto &left  = ast_cast<const Ast::Add &>(a);
+        auto &right = ast_cast<const Ast::Add &>(b);
+        return equal(*left.left, *right.left) && equal(*left.right, *right.right);
+      }
+      case AstType::LessThan: {
+        auto &left  = ast_cast<const Ast::LessThan &>(a);
+        auto &right = ast_cast<const Ast::LessThan &>(b);
+        return equal(*left.left, *right.left) && equal(*left.right, *right.right);
+      }
+      default:
+        return false;
+    }
+  }
+
+  const Stats &stats() const { return counters; }
+
+  void dump(FILE *out) const {
+    std::fprintf(out,
+                 "AstInterner: %lu requests, %lu hits (%.1f%%), %lu nodes, %lu bytes saved\n",
+                 counters.requests, counters.hits,
+                 counters.requests ? 100.0 * counters.hits / counters.requests : 0.0,
+                 counters.nodes, counters.bytes_saved);
+  }
+
+ private:
+  using Operands = std::pair<const Ast *, const Ast *>;
+
+  struct OperandsHash {
+    size_t operator()(const Operands &operands) const {
+      return size_t((reinterpret_cast<uintptr_t>(operands.first) >> 4) * 0x9e3779b97f4a7c15 ^
+                    (reinterpret_cast<uintptr_t>(operands.second) >> 4));
+    }
+  };
+
+  template <typename T, typename Make>
+  AstPtr<T> share(T *&slot, Make make) {
+    counters.requests++;
+    if (slot) {
+      counters.hits++;
+      counters.bytes_saved += footprint(*slot);
+    } else {
+      auto node      = make();
+      node->interned = true;
+      slot           = node.get();
+      nodes.push_back(std::move(node));
+      counters.nodes++;
+    }
+    return AstPtr<T>(slot);
+  }
+
+  template <typename T>
+  static size_t footprint(const T &node) {
+    return sizeof(node);
+  }
+
+  static size_t footprint(const Ast::Variable &node) {
+    // Names past the small string buffer have their own allocation.
+    bool heap = node.name.capacity() > std::string().capacity();
+    return sizeof(node) + (heap ? node.name.capacity() + 1 : 0);
+  }
+
+  std::vector<std::unique_ptr<Ast>> nodes;
+  std::unordered_map<int, Ast::Literal *> literals;
+  std::unordered_map<std::string, Ast::Variable *> variables;
+  std::unordered_map<Operands, Ast::Add *, OperandsHash> adds;
+  std::unordered_map<Operands, Ast::LessThan *, OperandsHash> less_thans;
+  Stats counters{};
+};
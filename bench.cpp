@@ -0,0 +1,276 @@
+// Runs the same workloads through AstInterpreter, AstCompiler, VM::interpret
+// and VM::jit and reports timing statistics per (workload, engine) as JSON.
+//
+//   g++ -std=c++17 -O2 bench.cpp ast.cpp -o bench
+//   ./bench [--warmup N] [--repetitions N] [--scale N] [--filter TEXT] [--json FILE]
+//           [--profile FILE] [--stats FILE]
+//
+// JSON goes to stdout (or FILE), a human readable table to stderr. The
+// AstCompiler and VM::jit times include compilation, as they do for callers.
+// --profile samples the whole run with Profiler and writes folded stacks
+// for flamegraph.pl to FILE. With VM_OPCODE_HISTOGRAM set, each workload
+// runs once more through VM::interpret under OpcodeHistogram::global(),
+// which is reported on stderr and as JSON to that file at exit. --stats
+// writes the runtime Stats to FILE in Prometheus text format, after
+// checking them against the calls bench made.
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+
+#include "ast_compiler.h"
+#include "benchmark.h"
+#include "opcode_histogram.h"
+#include "perf_counters.h"
+#include "profiler.h"
+#include "workloads.h"
+
+enum class Engine {
+  AstInterpreter,
+  AstCompiler,
+  Interpreter,
+  Jit,
+};
+
+static const char *to_string(Engine engine) {
+  switch (engine) {
+    case Engine::AstInterpreter:
+      return "ast_interpreter";
+    case Engine::AstCompiler:
+      return "ast_compiler";
+    case Engine::Interpreter:
+      return "vm_interpret";
+    case Engine::Jit:
+      return "vm_jit";
+  }
+  return "unknown";
+}
+
+struct Options {
+  int warmup      = 3;
+  int repetitions = 20;
+  int scale       = 1;
+  std::string filter;
+  std::string json;
+  std::string profile;
+  std::string stats;
+  bool histogram = std::getenv("VM_OPCODE_HISTOGRAM");
+};
+
+// Runs every program (or function) of the workload once and returns the sum
+// of their results. Only the engine calls are inside `elapsed`. While
+// profiling, the interpreter runs with ProfilerHooks, so its samples have
+// blocks and instructions.
+static u64 run(Engine engine, const Workload &workload, const Options &options, u64 &elapsed) {
+  u64 result = 0;
+  elapsed    = 0;
+  if (engine == Engine::AstInterpreter) {
+    for (const auto &function : workload.functions) {
+      AstInterpreter interpreter;
+      u64 start = now_ns();
+      result += interpreter.interpret(*function);
+      elapsed += now_ns() - start;
+    }
+    return result;
+  }
+  if (engine == Engine::AstCompiler) {
+    for (const auto &function : workload.functions) {
+      u64 start = now_ns();
+      result += AstCompiler::compile(*function)();
+      elapsed += now_ns() - start;
+    }
+    return result;
+  }
+
+  VM vm;
+  vm.registers.resize(8);
+  vm.locals.resize(8);
+  for (const auto &program : workload.programs) {
+    u64 start = now_ns();
+    if (engine == Engine::Interpreter) {
+      if (options.profile.empty()) {
+        vm.interpret(*program);
+      } else {
+        ProfilerHooks hooks;
+        vm.interpret(*program, hooks);
+      }
+    } else {
+      vm.jit(*program);
+    }
+    elapsed += now_ns() - start;
+    result += vm.locals[0];
+  }
+  return result;
+}
+
+// Outside the timings, as the hooks slow the interpreter down.
+static void record_histogram(const Workload &workload) {
+  VM vm;
+  vm.registers.resize(8);
+  vm.locals.resize(8);
+  for (const auto &program : workload.programs) {
+    vm.interpret(*program, OpcodeHistogram::global());
+  }
+}
+
+// Fails if the process-wide Stats miss any of the VM::interpret and VM::jit
+// calls bench made, or count an Executable that is still mapped.
+static bool check_stats(const StatsSnapshot &stats, u64 interpret_calls, u64 jit_runs) {
+  if (stats[Stat::InterpretCalls] != interpret_calls || stats[Stat::JitRuns] != jit_runs ||
+      stats[Stat::ProgramsCompiled] != jit_runs || stats.live_executables() ||
+      !stats[Stat::InstructionsInterpreted]) {
+    std::fprintf(stderr,
+                 "stats: %lu interpret calls, %lu JIT runs, %lu compiled, %lu live executables; "
+                 "expected %lu, %lu, %lu, 0\n",
+                 stats[Stat::InterpretCalls], stats[Stat::JitRuns],
+                 stats[Stat::ProgramsCompiled], stats.live_executables(), interpret_calls,
+                 jit_runs, jit_runs);
+    return false;
+  }
+  return true;
+}
+
+static void benchmark(const Workload &workload, Engine engine, const Options &options,
+                      PerfCounters &counters, JsonWriter &json) {
+  u64 elapsed = 0;
+  for (int i = 0; i < options.warmup; ++i) {
+    run(engine, workload, options, elapsed);
+  }
+
+  std::vector<double> samples;
+  for (int i = 0; i < options.repetitions; ++i) {
+    u64 result = run(engine, workload, options, elapsed);
+    if (result != workload.expected) {
+      std::fprintf(stderr, "%s/%s: wrong result %lu, expected %lu\n", workload.name.c_str(),
+                   to_string(engine), result, workload.expected);
+      std::exit(1);
+    }
+    samples.push_back(double(elapsed));
+  }
+  auto stats = Statistics::of(samples);
+
+  // One extra run under the hardware counters, kept out of the timings.
+  auto hardware = counters.measure([&] { run(engine, workload, options, elapsed); });
+
+  std::fprintf(stderr, "%-22s %-16s %12.3f ms  p99 %10.3f ms  ci95 [%.3f, %.3f] ms",
+               workload.name.c_str(), to_string(engine), stats.median / 1e6, stats.p99 / 1e6,
+               stats.ci95_low / 1e6, stats.ci95_high / 1e6);
+  if (hardware.has(PerfCounters::Cycles) && hardware.has(PerfCounters::Instructions)) {
+    std::fprintf(stderr, "  ipc %.2f", hardware.ipc());
+  }
+  std::fprintf(stderr, "\n");
+
+  json.begin_object();
+  json.field("workload", workload.name);
+  json.field("engine", std::string(to_string(engine)));
+  json.field("warmup", u64(options.warmup));
+  json.field("time_ns", stats);
+  for (int i = 0; i < PerfCounters::CounterCount; ++i) {
+    auto counter = PerfCounters::Counter(i);
+    if (hardware.has(counter)) {
+      json.field(PerfCounters::name(counter), hardware.values[counter]);
+    }
+  }
+  json.end_object();
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!std::strcmp(argv[i], "--warmup")) {
+      options.warmup = std::atoi(argv[i + 1]);
+    } else if (!std::strcmp(argv[i], "--repetitions")) {
+      options.repetitions = std::atoi(argv[i + 1]);
+    } else if (!std::strcmp(argv[i], "--scale")) {
+      options.scale = std::atoi(argv[i + 1]);
+    } else if (!std::strcmp(argv[i], "--filter")) {
+      options.filter = argv[i + 1];
+    } else if (!std::strcmp(argv[i], "--json")) {
+      options.json = argv[i + 1];
+    } else if (!std::strcmp(argv[i], "--profile")) {
+      options.profile = argv[i + 1];
+    } else if (!std::strcmp(argv[i], "--stats")) {
+      options.stats = argv[i + 1];
+    } else {
+      std::fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  std::vector<std::function<Workload()>> corpus = {
+      [&] { return make_count_loop(1000000 * options.scale); },
+      [&] { return make_fib(10000 * options.scale); },
+      [&] { return make_nested_loops(10000 * options.scale); },
+      [&] { return make_branchy(1000000 * options.scale); },
+      [&] { return make_many_small_programs(1000 * options.scale); },
+  };
+
+  FILE *out = options.json.empty() ? stdout : std::fopen(options.json.c_str(), "w");
+  if (!out) {
+    std::perror(options.json.c_str());
+    return 1;
+  }
+
+  PerfCounters counters;
+  JsonWriter json{out};
+  json.begin_object();
+  json.field("repetitions", u64(options.repetitions));
+  json.field("hardware_counters", u64(counters.available()));
+  json.begin_array("benchmarks");
+  // Samples point into the Programs, which must outlive write_folded.
+  std::vector<Workload> profiled;
+  // VM::interpret and VM::jit calls, for --stats.
+  u64 interpret_calls = 0;
+  u64 jit_runs        = 0;
+  if (!options.profile.empty()) {
+    Profiler::instance().start();
+  }
+  for (const auto &make : corpus) {
+    auto workload = make();
+    if (workload.name.find(options.filter) == std::string::npos) {
+      continue;
+    }
+    for (auto engine :
+         {Engine::AstInterpreter, Engine::AstCompiler, Engine::Interpreter, Engine::Jit}) {
+      benchmark(workload, engine, options, counters, json);
+    }
+    if (options.histogram) {
+      record_histogram(workload);
+    }
+    // Warmup, timed runs and the hardware counter run.
+    u64 runs = u64(std::max(options.warmup, 0) + std::max(options.repetitions, 0) + 1);
+    interpret_calls += (runs + options.histogram) * workload.programs.size();
+    jit_runs += runs * workload.programs.size();
+    if (!options.profile.empty()) {
+      profiled.push_back(std::move(workload));
+    }
+  }
+  if (!options.profile.empty()) {
+    Profiler::instance().stop();
+    std::ofstream folded(options.profile);
+    Profiler::instance().write_folded(folded);
+    if (!folded) {
+      std::perror(options.profile.c_str());
+      return 1;
+    }
+  }
+  if (!options.stats.empty()) {
+    auto stats = Stats::snapshot();
+    if (!check_stats(stats, interpret_calls, jit_runs)) {
+      return 1;
+    }
+    if (!stats.write_prometheus_file(options.stats)) {
+      std::perror(options.stats.c_str());
+      return 1;
+    }
+  }
+  json.end_array();
+  json.end_object();
+  std::fputc('\n', out);
+
+  if (out != stdout) {
+    std::fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,156 @@
+// Compares AstCompiler with AstInterpreter: how fast functions compile, and
+// how long a function has to run before compiling it pays off.
+//
+//   g++ -std=c++17 -O2 bench_ast_compiler.cpp ast.cpp -o bench_ast_compiler
+//   ./bench_ast_compiler [--max-statements N] [--max-iterations N] [--repetitions N]
+//                        [--seed N] [--json FILE]
+//
+// The first table compiles generated functions (see ast_generator.h) of 10
+// up to --max-statements (default 10000) statements, and reports compile
+// time per node and the time to interpret or call the function once. The
+// second runs count_loop from workloads.h for 1 up to --max-iterations
+// (default 1000000) iterations, where compilation is a fixed cost against
+// the interpreter's per-iteration one. Every point checks that the compiled
+// function returns what the interpreter does; times are medians over
+// --repetitions (default 20) runs.
+
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+
+#include "ast_compiler.h"
+#include "ast_generator.h"
+#include "benchmark.h"
+#include "workloads.h"
+
+struct Point {
+  size_t nodes;
+  size_t code_bytes;
+  Statistics compile_ns;
+  Statistics interpret_ns;
+  Statistics run_ns;
+};
+
+static Statistics time(size_t repetitions, const std::function<void()> &body) {
+  std::vector<double> samples;
+  for (size_t i = 0; i < repetitions; ++i) {
+    u64 start = now_ns();
+    body();
+    samples.push_back(double(now_ns() - start));
+  }
+  return Statistics::of(samples);
+}
+
+static Point measure(const Ast::FunctionDeclaration &function, size_t repetitions) {
+  Point point{};
+  point.nodes = count_nodes(function);
+
+  int expected       = 0;
+  point.interpret_ns = time(repetitions, [&] { expected = AstInterpreter().interpret(function); });
+  point.compile_ns   = time(repetitions, [&] { AstCompiler::compile(function); });
+
+  auto compiled    = AstCompiler::compile(function);
+  point.code_bytes = compiled.executable.code_size;
+  int result       = 0;
+  point.run_ns     = time(repetitions, [&] { result = compiled(); });
+  if (result != expected) {
+    throw std::runtime_error("AstCompiler and AstInterpreter disagree on " + function.name);
+  }
+  return point;
+}
+
+static void write_point(JsonWriter &json, const Point &point) {
+  json.field("nodes", u64(point.nodes));
+  json.field("code_bytes", u64(point.code_bytes));
+  json.field("compile_ns", point.compile_ns);
+  json.field("interpret_ns", point.interpret_ns);
+  json.field("run_ns", point.run_ns);
+}
+
+int main(int argc, char **argv) {
+  u64 seed              = 1;
+  size_t max_statements = 10000;
+  size_t max_iterations = 1000000;
+  size_t repetitions    = 20;
+  std::string json_path;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!std::strcmp(argv[i], "--max-statements")) {
+      max_statements = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--max-iterations")) {
+      max_iterations = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--repetitions")) {
+      repetitions = std::max<size_t>(1, std::strtoull(argv[i + 1], nullptr, 10));
+    } else if (!std::strcmp(argv[i], "--seed")) {
+      seed = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--json")) {
+      json_path = argv[i + 1];
+    } else {
+      std::fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  FILE *out = json_path.empty() ? stdout : std::fopen(json_path.c_str(), "w");
+  if (!out) {
+    std::perror(json_path.c_str());
+    return 1;
+  }
+
+  JsonWriter json{out};
+  json.begin_object();
+  json.field("seed", seed);
+  json.field("repetitions", u64(repetitions));
+
+  json.begin_array("generated");
+  std::fprintf(stderr, "%10s %9s %10s %10s %11s %9s %12s %9s\n", "statements", "nodes",
+               "code KB", "compile us", "ns per node", "run us", "interpret us", "speedup");
+  for (size_t statements = 10;; statements = std::min(statements * 10, max_statements)) {
+    ScriptBuilder builder{std::mt19937_64(seed), statements};
+    auto function = builder.function(0);
+    auto point    = measure(*function, repetitions);
+    std::fprintf(stderr, "%10zu %9zu %10.1f %10.1f %11.1f %9.2f %12.2f %8.1fx\n", statements,
+                 point.nodes, point.code_bytes / 1e3, point.compile_ns.median / 1e3,
+                 point.compile_ns.median / point.nodes, point.run_ns.median / 1e3,
+                 point.interpret_ns.median / 1e3,
+                 point.interpret_ns.median / point.run_ns.median);
+
+    json.begin_object();
+    json.field("statements", u64(statements));
+    write_point(json, point);
+    json.end_object();
+
+    if (statements >= max_statements) {
+      break;
+    }
+  }
+  json.end_array();
+
+  json.begin_array("count_loop");
+  std::fprintf(stderr, "\n%10s %12s %10s %9s %16s\n", "iterations", "interpret us",
+               "compile us", "run us", "compile+run us");
+  for (size_t iterations = 1;; iterations = std::min(iterations * 10, max_iterations)) {
+    auto workload = make_count_loop(int(iterations));
+    auto point    = measure(*workload.functions.front(), repetitions);
+    std::fprintf(stderr, "%10zu %12.2f %10.2f %9.2f %16.2f\n", iterations,
+                 point.interpret_ns.median / 1e3, point.compile_ns.median / 1e3,
+                 point.run_ns.median / 1e3,
+                 (point.compile_ns.median + point.run_ns.median) / 1e3);
+
+    json.begin_object();
+    json.field("iterations", u64(iterations));
+    write_point(json, point);
+    json.end_object();
+
+    if (iterations >= max_iterations) {
+      break;
+    }
+  }
+  json.end_array();
+  json.end_object();
+  std::fputc('\n', out);
+
+  if (out != stdout) {
+    std::fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,223 @@
+// Compares building large scripts with the C++ Ast builders against loading
+// them from AST images, across script sizes.
+//
+//   g++ -std=c++17 -O2 bench_ast_image.cpp ast.cpp -o bench_ast_image
+//   ./bench_ast_image [--max-functions N] [--statements N] [--used N] [--seed N]
+//                     [--json FILE]
+//
+// Scripts are random functions of declarations, assignments of sums,
+// if/else and counted while loops over a shared set of variable names.
+// Functions grow by 10x from 10 up to --max-functions (default 10000), each
+// of about --statements (default 50) statements. For every size it reports
+// building the script, writing its image, loading the image (ready for
+// AstImageInterpreter), reading it back into Ast nodes, and interpreting
+// every function from the Ast and from the image, and checks both give the
+// same results. Reading is repeated through an AstInterner, reporting how
+// many expressions were shared and the bytes that saved; the shared trees
+// must interpret to the same results.
+//
+// Startup is then compared for a run that calls only --used (default 5)
+// functions: reading the whole image before calling them, against a
+// LazyScript that reads each one on its first call.
+
+#include <cstdlib>
+#include <cstring>
+
+#include "ast_generator.h"
+#include "ast_image.h"
+#include "benchmark.h"
+#include "lazy_script.h"
+
+struct Point {
+  size_t functions;
+  size_t nodes;
+  size_t image_bytes;
+  u64 build_ns;
+  u64 write_ns;
+  u64 load_ns;
+  u64 read_ns;
+  u64 shared_read_ns;
+  AstInterner::Stats shared;
+  u64 interpret_ns;
+  u64 interpret_image_ns;
+  u64 eager_run_ns;
+  u64 lazy_run_ns;
+};
+
+static Point measure(u64 seed, size_t functions, size_t statements, size_t used) {
+  Point point{};
+  point.functions = functions;
+  ScriptBuilder builder{std::mt19937_64(seed), statements};
+
+  u64 start = now_ns();
+  std::vector<std::unique_ptr<Ast::FunctionDeclaration>> script;
+  for (size_t i = 0; i < functions; ++i) {
+    script.push_back(builder.function(i));
+  }
+  point.build_ns = now_ns() - start;
+  for (const auto &function : script) {
+    point.nodes += count_nodes(*function);
+  }
+
+  start             = now_ns();
+  auto bytes        = AstWriter::build(script);
+  point.write_ns    = now_ns() - start;
+  point.image_bytes = bytes.size();
+
+  start         = now_ns();
+  auto image    = AstImage::view(bytes.data(), bytes.size());
+  point.load_ns = now_ns() - start;
+
+  start         = now_ns();
+  auto loaded   = image.read();
+  point.read_ns = now_ns() - start;
+
+  std::vector<int> results;
+  start = now_ns();
+  for (const auto &function : loaded) {
+    results.push_back(AstInterpreter().interpret(*function));
+  }
+  point.interpret_ns = now_ns() - start;
+
+  start = now_ns();
+  for (u32 i = 0; i < image.function_count(); ++i) {
+    if (AstImageInterpreter(image).interpret(i) != results[i]) {
+      throw std::runtime_error("Ast and AST image disagree on " + loaded[i]->name);
+    }
+  }
+  point.interpret_image_ns = now_ns() - start;
+
+  {
+    AstInterner interner;
+    start                = now_ns();
+    auto shared          = image.read(&interner);
+    point.shared_read_ns = now_ns() - start;
+    point.shared         = interner.stats();
+    for (size_t i = 0; i < shared.size(); ++i) {
+      if (AstInterpreter().interpret(*shared[i]) != results[i]) {
+        throw std::runtime_error("Shared read of " + shared[i]->name + " disagrees");
+      }
+    }
+    // The trees go before the interner holding their expressions.
+    shared.clear();
+  }
+
+  // Spread over the script, so the lazy run cannot just read a prefix.
+  std::vector<u32> calls;
+  for (size_t i = 0; i < std::min(used, functions); ++i) {
+    calls.push_back(narrow_cast<u32>(i * functions / std::min(used, functions)));
+  }
+  std::vector<std::string> names;
+  for (auto index : calls) {
+    names.push_back(loaded[index]->name);
+  }
+
+  // Torn down after the clock stops.
+  std::vector<std::unique_ptr<Ast::FunctionDeclaration>> eager;
+  int eager_sum = 0;
+  start         = now_ns();
+  eager         = AstImage::view(bytes.data(), bytes.size()).read();
+  for (auto index : calls) {
+    eager_sum += AstInterpreter().interpret(*eager[index]);
+  }
+  point.eager_run_ns = now_ns() - start;
+
+  std::unique_ptr<LazyScript> lazy;
+  int lazy_sum = 0;
+  start        = now_ns();
+  lazy         = std::make_unique<LazyScript>(AstImage::view(bytes.data(), bytes.size()));
+  for (const auto &name : names) {
+    lazy_sum += lazy->call(name);
+  }
+  point.lazy_run_ns = now_ns() - start;
+
+  if (eager_sum != lazy_sum || lazy->loaded_count() != calls.size()) {
+    throw std::runtime_error("Lazy and eager runs disagree");
+  }
+  return point;
+}
+
+int main(int argc, char **argv) {
+  u64 seed             = 1;
+  size_t max_functions = 10000;
+  size_t statements    = 50;
+  size_t used          = 5;
+  std::string json_path;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!std::strcmp(argv[i], "--max-functions")) {
+      max_functions = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--statements")) {
+      statements = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--used")) {
+      used = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--seed")) {
+      seed = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--json")) {
+      json_path = argv[i + 1];
+    } else {
+      std::fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  FILE *out = json_path.empty() ? stdout : std::fopen(json_path.c_str(), "w");
+  if (!out) {
+    std::perror(json_path.c_str());
+    return 1;
+  }
+
+  JsonWriter json{out};
+  json.begin_object();
+  json.field("seed", seed);
+  json.field("statements", u64(statements));
+  json.field("used", u64(used));
+  json.begin_array("points");
+  std::fprintf(stderr, "%9s %10s %9s %9s %9s %9s %9s %9s %7s %9s %12s %10s %9s %9s\n",
+               "functions", "nodes", "image MB", "build ms", "write ms", "load us", "read ms",
+               "shared ms", "hits %", "saved MB", "interpret ms", "image ms", "eager ms",
+               "lazy ms");
+  for (size_t functions = 10;; functions = std::min(functions * 10, max_functions)) {
+    auto point = measure(seed, functions, statements, used);
+    const auto &shared = point.shared;
+    std::fprintf(stderr,
+                 "%9zu %10zu %9.2f %9.1f %9.1f %9.1f %9.1f %9.1f %7.1f %9.2f %12.1f %10.1f %9.2f "
+                 "%9.2f\n",
+                 point.functions, point.nodes, point.image_bytes / 1e6, point.build_ns / 1e6,
+                 point.write_ns / 1e6, point.load_ns / 1e3, point.read_ns / 1e6,
+                 point.shared_read_ns / 1e6,
+                 shared.requests ? 100.0 * shared.hits / shared.requests : 0.0,
+                 shared.bytes_saved / 1e6, point.interpret_ns / 1e6, point.interpret_image_ns / 1e6,
+                 point.eager_run_ns / 1e6, point.lazy_run_ns / 1e6);
+
+    json.begin_object();
+    json.field("functions", u64(point.functions));
+    json.field("nodes", u64(point.nodes));
+    json.field("image_bytes", u64(point.image_bytes));
+    json.field("build_ns", point.build_ns);
+    json.field("write_ns", point.write_ns);
+    json.field("load_ns", point.load_ns);
+    json.field("read_ns", point.read_ns);
+    json.field("shared_read_ns", point.shared_read_ns);
+    json.field("shared_requests", shared.requests);
+    json.field("shared_hits", shared.hits);
+    json.field("shared_nodes", shared.nodes);
+    json.field("shared_bytes_saved", shared.bytes_saved);
+    json.field("interpret_ns", point.interpret_ns);
+    json.field("interpret_image_ns", point.interpret_image_ns);
+    json.field("eager_run_ns", point.eager_run_ns);
+    json.field("lazy_run_ns", point.lazy_run_ns);
+    json.end_object();
+
+    if (functions >= max_functions) {
+      break;
+    }
+  }
+  json.end_array();
+  json.end_object();
+  std::fputc('\n', out);
+
+  if (out != stdout) {
+    std::fclose(out);
+  }
+  return 0;
+}
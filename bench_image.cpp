@@ -0,0 +1,154 @@
+// Compares building generated Programs in C++ with mapping them from
+// program images, across Program sizes.
+//
+//   g++ -std=c++17 -O2 bench_image.cpp -o bench_image
+//   ./bench_image [--max-instructions N] [--repetitions N] [--dir DIR] [--seed N]
+//                 [--json FILE]
+//
+// Mapping should take the same time at every size: it validates the header
+// and sections and touches nothing else. Verifying reads the whole image
+// and is reported separately. Images are written to --dir (default /tmp) and
+// are still in the page cache when mapped. Every point also checks that the
+// image interprets to the same registers and locals as the Program.
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "benchmark.h"
+#include "program_generator.h"
+#include "program_image.h"
+
+struct Point {
+  size_t blocks;
+  size_t instructions;
+  u64 image_bytes;
+  u64 generate_ns;
+  u64 write_ns;
+  Statistics map_ns;
+  u64 verify_ns;
+  u64 interpret_ns;
+  u64 interpret_image_ns;
+};
+
+static Point measure(const ProgramShape &shape, size_t repetitions, const std::string &path) {
+  Point point{};
+  u64 start          = now_ns();
+  auto program       = ProgramGenerator::generate(shape);
+  point.generate_ns  = now_ns() - start;
+  point.blocks       = program->blocks.size();
+  point.instructions = program->instruction_count();
+
+  start = now_ns();
+  ProgramImageWriter::write(*program, path);
+  point.write_ns = now_ns() - start;
+
+  std::vector<double> samples;
+  for (size_t i = 0; i < repetitions; ++i) {
+    start      = now_ns();
+    auto image = ProgramImage::map(path);
+    samples.push_back(now_ns() - start);
+  }
+  point.map_ns = Statistics::of(samples);
+
+  auto image        = ProgramImage::map(path);
+  point.image_bytes = image.header().file_size;
+  start             = now_ns();
+  image.verify();
+  point.verify_ns = now_ns() - start;
+
+  VM from_program;
+  from_program.registers.resize(shape.register_count);
+  from_program.locals.resize(shape.local_count);
+  start = now_ns();
+  from_program.interpret(*program);
+  point.interpret_ns = now_ns() - start;
+
+  VM from_image;
+  from_image.registers.resize(shape.register_count);
+  from_image.locals.resize(shape.local_count);
+  start = now_ns();
+  from_image.interpret(image);
+  point.interpret_image_ns = now_ns() - start;
+
+  if (from_program.registers != from_image.registers || from_program.locals != from_image.locals) {
+    throw std::runtime_error("Program and image of " + program->name + " disagree");
+  }
+  return point;
+}
+
+int main(int argc, char **argv) {
+  ProgramShape shape;
+  size_t max_instructions = 1000000;
+  size_t repetitions      = 200;
+  std::string dir         = "/tmp";
+  std::string json_path;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!std::strcmp(argv[i], "--max-instructions")) {
+      max_instructions = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--repetitions")) {
+      repetitions = std::max<size_t>(1, std::strtoull(argv[i + 1], nullptr, 10));
+    } else if (!std::strcmp(argv[i], "--dir")) {
+      dir = argv[i + 1];
+    } else if (!std::strcmp(argv[i], "--seed")) {
+      shape.seed = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--json")) {
+      json_path = argv[i + 1];
+    } else {
+      std::fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  FILE *out = json_path.empty() ? stdout : std::fopen(json_path.c_str(), "w");
+  if (!out) {
+    std::perror(json_path.c_str());
+    return 1;
+  }
+
+  std::string path = dir + "/bench_image_" + std::to_string(getpid()) + ".vmi";
+  JsonWriter json{out};
+  json.begin_object();
+  json.field("seed", shape.seed);
+  json.field("repetitions", u64(repetitions));
+  json.begin_array("points");
+  std::fprintf(stderr, "%9s %11s %9s %9s %9s %10s %10s %10s %12s %10s\n", "blocks", "instrs",
+               "image MB", "gen ms", "write ms", "map us", "map p99", "verify ms",
+               "interpret ms", "image ms");
+  for (shape.block_count = 100;;) {
+    auto point = measure(shape, repetitions, path);
+    std::fprintf(stderr, "%9zu %11zu %9.1f %9.1f %9.1f %10.2f %10.2f %10.1f %12.1f %10.1f\n",
+                 point.blocks, point.instructions, point.image_bytes / 1e6,
+                 point.generate_ns / 1e6, point.write_ns / 1e6, point.map_ns.median / 1e3,
+                 point.map_ns.p99 / 1e3, point.verify_ns / 1e6, point.interpret_ns / 1e6,
+                 point.interpret_image_ns / 1e6);
+
+    json.begin_object();
+    json.field("blocks", u64(point.blocks));
+    json.field("instructions", u64(point.instructions));
+    json.field("image_bytes", point.image_bytes);
+    json.field("generate_ns", point.generate_ns);
+    json.field("write_ns", point.write_ns);
+    json.field("map_ns", point.map_ns);
+    json.field("verify_ns", point.verify_ns);
+    json.field("interpret_ns", point.interpret_ns);
+    json.field("interpret_image_ns", point.interpret_image_ns);
+    json.end_object();
+
+    if (point.instructions >= max_instructions) {
+      break;
+    }
+    double per_block  = double(point.instructions) / point.blocks;
+    shape.block_count = std::min(shape.block_count * 10,
+                                 size_t(std::ceil(1.01 * max_instructions / per_block)));
+  }
+  std::remove(path.c_str());
+  json.end_array();
+  json.end_object();
+  std::fputc('\n', out);
+
+  if (out != stdout) {
+    std::fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,113 @@
+// Heap allocations per phase for AST construction, building a Program,
+// compiling it, running it and tearing everything down, reported per guest
+// instruction so capacity can be sized and allocation regressions caught.
+//
+//   g++ -std=c++17 -O2 bench_memory.cpp allocation_tracker.cpp ast.cpp -o bench_memory
+//   ./bench_memory [--blocks N] [--seed N] [--json FILE]
+//
+// The AST is a straight-line function of `x = x + <literal>` statements,
+// each the AST form of five VM instructions (GetLocal, Store, LoadImmediate,
+// Add, SetLocal), sized to match the generated Program's instruction count.
+
+#include <cstdlib>
+#include <cstring>
+
+#include "allocation_tracker.h"
+#include "benchmark.h"
+#include "program_generator.h"
+#include "workloads.h"
+
+static std::unique_ptr<Ast::FunctionDeclaration> make_straight_line_ast(size_t statements) {
+  auto function = ast_function("straight_line");
+  auto &body    = *function->body;
+  ast_declare(body, "x", 0);
+  for (size_t i = 0; i < statements; ++i) {
+    body.append<Ast::Assignment>("x",
+                                 std::make_unique<Ast::Add>(ast_var("x"), ast_lit(int(i & 0xff))));
+  }
+  body.append<Ast::Return>(ast_var("x"));
+  return function;
+}
+
+int main(int argc, char **argv) {
+  ProgramShape shape;
+  shape.block_count = 100000;
+  std::string json_path;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!std::strcmp(argv[i], "--blocks")) {
+      shape.block_count = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--seed")) {
+      shape.seed = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--json")) {
+      json_path = argv[i + 1];
+    } else {
+      std::fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (!AllocationTracker::enabled()) {
+    std::fprintf(stderr, "link allocation_tracker.cpp to track allocations\n");
+    return 1;
+  }
+
+  AllocationTracker::reset();
+  std::unique_ptr<Program> program;
+  {
+    AllocationTracker::Scope scope(AllocationPhase::IrBuild);
+    program = ProgramGenerator::generate(shape);
+  }
+  size_t instructions = program->instruction_count();
+
+  std::unique_ptr<Ast::FunctionDeclaration> function;
+  {
+    AllocationTracker::Scope scope(AllocationPhase::AstBuild);
+    function = make_straight_line_ast(instructions / 5);
+  }
+
+  std::unique_ptr<Executable> executable;
+  {
+    AllocationTracker::Scope scope(AllocationPhase::Compile);
+    executable = std::make_unique<Executable>(Jit::compile(*program));
+  }
+
+  {
+    AllocationTracker::Scope scope(AllocationPhase::Execution);
+    VM vm;
+    vm.registers.resize(shape.register_count);
+    vm.locals.resize(shape.local_count);
+    vm.interpret(*program);
+    vm.run(*program, *executable);
+  }
+
+  {
+    AllocationTracker::Scope scope(AllocationPhase::Teardown);
+    function.reset();
+    executable.reset();
+    program.reset();
+    // The IR's chunks would otherwise stay pooled and look live.
+    Arena::trim_pool();
+  }
+
+  std::fprintf(stderr, "%zu blocks, %zu instructions\n", shape.block_count, instructions);
+  AllocationTracker::dump(stderr, instructions);
+
+  FILE *out = json_path.empty() ? stdout : std::fopen(json_path.c_str(), "w");
+  if (!out) {
+    std::perror(json_path.c_str());
+    return 1;
+  }
+  JsonWriter json{out};
+  json.begin_object();
+  json.field("seed", shape.seed);
+  json.field("blocks", u64(shape.block_count));
+  json.field("instructions", u64(instructions));
+  json.begin_object("phases");
+  AllocationTracker::write_json(json, instructions);
+  json.end_object();
+  json.end_object();
+  std::fputc('\n', out);
+  if (out != stdout) {
+    std::fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,227 @@
+// Measures how generation, compilation, memory and execution scale with the
+// size of generated Programs.
+//
+//   g++ -std=c++17 -O2 bench_program_size.cpp -o bench_program_size
+//   ./bench_program_size [--max-instructions N] [--build-instructions N] [--seed N]
+//                        [--json FILE]
+//
+// Block counts grow by 10x from 100 until the Program has at least
+// --max-instructions (default 1000000; pass 10000000 for the large point).
+// Compile memory is the resident growth across Jit::compile, which is the
+// code plus the compiler's side tables. Every point also checks that
+// VM::interpret and the JIT leave the same registers and locals behind.
+//
+// Before those, a Program of --build-instructions (default 1000000)
+// instructions in blocks of eight is built and destroyed: first while the
+// Arena chunks still have to be faulted in, then `rebuilds` times more,
+// warm, and reported last. Unlike the generator, the builder draws no
+// random numbers, so this times the IR allocation alone.
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "benchmark.h"
+#include "program_generator.h"
+
+// Resident set size in bytes, from /proc/self/statm.
+static u64 resident_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  u64 pages    = 0;
+  u64 resident = 0;
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+struct Point {
+  size_t blocks;
+  size_t instructions;
+  u64 generate_ns;
+  u64 program_bytes;
+  u64 compile_ns;
+  u64 compile_bytes;
+  u64 code_bytes;
+  u64 interpret_ns;
+  u64 jit_ns;
+};
+
+static Point measure(ProgramShape shape) {
+  Point point{};
+  u64 resident        = resident_bytes();
+  u64 start           = now_ns();
+  auto program        = ProgramGenerator::generate(shape);
+  point.generate_ns   = now_ns() - start;
+  point.program_bytes = std::max(resident_bytes(), resident) - resident;
+  point.blocks        = program->blocks.size();
+  point.instructions  = program->instruction_count();
+
+  resident            = resident_bytes();
+  start               = now_ns();
+  auto executable     = Jit::compile(*program);
+  point.compile_ns    = now_ns() - start;
+  point.compile_bytes = std::max(resident_bytes(), resident) - resident;
+  point.code_bytes    = executable.size;
+
+  VM interpreted;
+  interpreted.registers.resize(shape.register_count);
+  interpreted.locals.resize(shape.local_count);
+  start = now_ns();
+  interpreted.interpret(*program);
+  point.interpret_ns = now_ns() - start;
+
+  VM compiled;
+  compiled.registers.resize(shape.register_count);
+  compiled.locals.resize(shape.local_count);
+  start = now_ns();
+  compiled.run(*program, executable);
+  point.jit_ns = now_ns() - start;
+
+  if (interpreted.registers != compiled.registers || interpreted.locals != compiled.locals) {
+    throw std::runtime_error("VM::interpret and the JIT disagree on " + program->name);
+  }
+  return point;
+}
+
+static std::unique_ptr<Program> build_blocks(size_t instructions) {
+  auto program  = std::make_unique<Program>();
+  auto *current = &program->make_block();
+  for (size_t i = 0; i + 9 <= instructions; i += 8) {
+    current->append<GetLocal>(VM_Local(0));
+    current->append<Store>(VM_Register(1));
+    current->append<LoadImmediate>(VM_Value(i));
+    current->append<Add>(VM_Register(1));
+    current->append<SetLocal>(VM_Local(0));
+    current->append<GetLocal>(VM_Local(1));
+    current->append<Increment>();
+    auto &next = program->make_block();
+    current->append<Jump>(next);
+    current = &next;
+  }
+  current->append<Exit>();
+  return program;
+}
+
+struct BuildPoint {
+  size_t instructions;
+  u64 first_build_ns;
+  u64 first_destroy_ns;
+  Statistics build_ns;
+  Statistics destroy_ns;
+};
+
+static constexpr size_t rebuilds = 20;
+
+static BuildPoint measure_build(size_t instructions) {
+  BuildPoint point{};
+  std::vector<double> build_samples;
+  std::vector<double> destroy_samples;
+  for (size_t i = 0; i <= rebuilds; ++i) {
+    u64 start          = now_ns();
+    auto program       = build_blocks(instructions);
+    u64 build_ns       = now_ns() - start;
+    point.instructions = program->instruction_count();
+    start              = now_ns();
+    program.reset();
+    u64 destroy_ns = now_ns() - start;
+    if (i == 0) {
+      point.first_build_ns   = build_ns;
+      point.first_destroy_ns = destroy_ns;
+    } else {
+      build_samples.push_back(double(build_ns));
+      destroy_samples.push_back(double(destroy_ns));
+    }
+  }
+  point.build_ns   = Statistics::of(build_samples);
+  point.destroy_ns = Statistics::of(destroy_samples);
+  return point;
+}
+
+int main(int argc, char **argv) {
+  ProgramShape shape;
+  size_t max_instructions   = 1000000;
+  size_t build_instructions = 1000000;
+  std::string json_path;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!std::strcmp(argv[i], "--max-instructions")) {
+      max_instructions = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--build-instructions")) {
+      build_instructions = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--seed")) {
+      shape.seed = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--json")) {
+      json_path = argv[i + 1];
+    } else {
+      std::fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  FILE *out = json_path.empty() ? stdout : std::fopen(json_path.c_str(), "w");
+  if (!out) {
+    std::perror(json_path.c_str());
+    return 1;
+  }
+
+  // First, while no chunks are pooled.
+  auto build = measure_build(build_instructions);
+
+  JsonWriter json{out};
+  json.begin_object();
+  json.field("seed", shape.seed);
+  json.begin_array("points");
+  std::fprintf(stderr, "%9s %11s %9s %9s %11s %10s %11s %10s %12s %9s\n", "blocks", "instrs",
+               "gen ms", "prog MB", "compile ms", "ns/instr", "compile MB", "code MB",
+               "interpret ms", "jit ms");
+  for (shape.block_count = 100;;) {
+    auto point = measure(shape);
+    std::fprintf(stderr, "%9zu %11zu %9.1f %9.1f %11.1f %10.1f %11.1f %10.1f %12.1f %9.1f\n",
+                 point.blocks, point.instructions, point.generate_ns / 1e6,
+                 point.program_bytes / 1e6, point.compile_ns / 1e6,
+                 double(point.compile_ns) / point.instructions, point.compile_bytes / 1e6,
+                 point.code_bytes / 1e6, point.interpret_ns / 1e6, point.jit_ns / 1e6);
+
+    json.begin_object();
+    json.field("blocks", u64(point.blocks));
+    json.field("instructions", u64(point.instructions));
+    json.field("generate_ns", point.generate_ns);
+    json.field("program_bytes", point.program_bytes);
+    json.field("compile_ns", point.compile_ns);
+    json.field("compile_ns_per_instruction", double(point.compile_ns) / point.instructions);
+    json.field("compile_bytes", point.compile_bytes);
+    json.field("code_bytes", point.code_bytes);
+    json.field("interpret_ns", point.interpret_ns);
+    json.field("jit_ns", point.jit_ns);
+    json.end_object();
+
+    if (point.instructions >= max_instructions) {
+      break;
+    }
+    // Aim the last point at --max-instructions rather than overshooting 10x.
+    double per_block  = double(point.instructions) / point.blocks;
+    shape.block_count = std::min(shape.block_count * 10,
+                                 size_t(std::ceil(1.01 * max_instructions / per_block)));
+  }
+  json.end_array();
+
+  std::fprintf(stderr, "\n%11s %15s %17s %14s %16s\n", "instrs", "first build ms",
+               "first destroy ms", "warm build ms", "warm destroy ms");
+  std::fprintf(stderr, "%11zu %15.2f %17.2f %14.2f %16.2f\n", build.instructions,
+               build.first_build_ns / 1e6, build.first_destroy_ns / 1e6,
+               build.build_ns.median / 1e6, build.destroy_ns.median / 1e6);
+  json.begin_object("build");
+  json.field("instructions", u64(build.instructions));
+  json.field("first_build_ns", build.first_build_ns);
+  json.field("first_destroy_ns", build.first_destroy_ns);
+  json.field("build_ns", build.build_ns);
+  json.field("destroy_ns", build.destroy_ns);
+  json.end_object();
+  json.end_object();
+  std::fputc('\n', out);
+
+  if (out != stdout) {
+    std::fclose(out);
+  }
+  return 0;
+}
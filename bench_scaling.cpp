@@ -0,0 +1,255 @@
+// Measures how VM throughput scales with the number of threads.
+//
+//   g++ -std=c++17 -O2 -pthread bench_scaling.cpp ast.cpp -o bench_scaling
+//   ./bench_scaling [--threads 1,2,4,...] [--iterations N] [--json FILE]
+//
+// Every thread owns its VM and its Programs; nothing guest-visible is
+// shared, so any loss of scaling comes from the process: the allocator,
+// the kernel's mm lock taken by mmap/mprotect/munmap, unwinder registration
+// and shared cache lines. Modes:
+//
+//   interpret    VM::interpret of a short count loop
+//   jit          VM::run of code compiled once per thread
+//   jit_compile  Jit::compile + VM::run on every iteration
+//   code_memory  only the Executable lifecycle (mmap, mprotect, munmap)
+//
+// code_memory isolates the syscalls jit_compile makes per compilation;
+// when its per-operation latency grows with the thread count the address
+// space lock is contended, and the table marks that row.
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+#include "benchmark.h"
+#include "workloads.h"
+
+enum class Mode {
+  Interpret,
+  Jit,
+  JitCompile,
+  CodeMemory,
+};
+
+static const char *to_string(Mode mode) {
+  switch (mode) {
+    case Mode::Interpret:
+      return "interpret";
+    case Mode::Jit:
+      return "jit";
+    case Mode::JitCompile:
+      return "jit_compile";
+    case Mode::CodeMemory:
+      return "code_memory";
+  }
+  return "unknown";
+}
+
+// Loop trip count of the guest program; small enough that compilation and
+// code memory dominate jit_compile.
+static constexpr int loop_count = 1000;
+
+// Runs `iterations` operations of `mode` and returns a checksum so the work
+// cannot be optimized away.
+static u64 run_thread(Mode mode, u64 iterations) {
+  auto workload = make_count_loop(loop_count);
+  auto &program = *workload.programs.front();
+  VM vm;
+  vm.registers.resize(8);
+  vm.locals.resize(8);
+
+  u64 checksum = 0;
+  switch (mode) {
+    case Mode::Interpret:
+      for (u64 i = 0; i < iterations; ++i) {
+        vm.interpret(program);
+        checksum += vm.locals[0];
+      }
+      break;
+    case Mode::Jit: {
+      auto executable = Jit::compile(program);
+      for (u64 i = 0; i < iterations; ++i) {
+        vm.run(program, executable);
+        checksum += vm.locals[0];
+      }
+      break;
+    }
+    case Mode::JitCompile:
+      for (u64 i = 0; i < iterations; ++i) {
+        auto executable = Jit::compile(program);
+        vm.run(program, executable);
+        checksum += vm.locals[0];
+      }
+      break;
+    case Mode::CodeMemory: {
+      size_t size = Jit::compile(program).size;
+      for (u64 i = 0; i < iterations; ++i) {
+        Executable executable(size);
+        static_cast<u8 *>(executable.data)[0] = 0xc3;
+        executable.finalize();
+        checksum += static_cast<u8 *>(executable.data)[0];
+      }
+      break;
+    }
+  }
+  return checksum;
+}
+
+struct Sample {
+  Mode mode;
+  unsigned threads;
+  u64 operations;
+  double seconds;
+
+  double throughput() const { return operations / seconds; }
+  // Wall time of one operation as seen by one thread.
+  double latency_ns() const { return seconds * 1e9 * threads / operations; }
+};
+
+// Starts all threads together and times from the release of the start
+// barrier until the last one finishes.
+static Sample measure(Mode mode, unsigned threads, u64 iterations) {
+  std::atomic<unsigned> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> workers;
+  std::vector<u64> checksums(threads);
+
+  for (unsigned t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      ready.fetch_add(1);
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      checksums[t] = run_thread(mode, iterations);
+    });
+  }
+  while (ready.load() != threads) {
+    std::this_thread::yield();
+  }
+
+  u64 start = now_ns();
+  go.store(true, std::memory_order_release);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  u64 elapsed = now_ns() - start;
+
+  u64 expected = mode == Mode::CodeMemory ? 0xc3 : loop_count;
+  for (auto checksum : checksums) {
+    if (checksum != expected * iterations) {
+      throw std::runtime_error(std::string("wrong result in ") + to_string(mode));
+    }
+  }
+  return {mode, threads, threads * iterations, elapsed / 1e9};
+}
+
+static std::vector<unsigned> default_thread_counts() {
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<unsigned> counts;
+  for (unsigned count = 1; count < cores; count *= 2) {
+    counts.push_back(count);
+  }
+  counts.push_back(cores);
+  return counts;
+}
+
+static std::vector<unsigned> parse_thread_counts(const char *text) {
+  std::vector<unsigned> counts;
+  std::stringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    counts.push_back(std::max(1, std::atoi(item.c_str())));
+  }
+  return counts;
+}
+
+// Iterations per thread, chosen so every mode runs for a comparable time.
+static u64 iterations_for(Mode mode, u64 base) {
+  switch (mode) {
+    case Mode::Interpret:
+      return base;
+    case Mode::Jit:
+      return base * 10;
+    case Mode::JitCompile:
+    case Mode::CodeMemory:
+      return base * 2;
+  }
+  return base;
+}
+
+int main(int argc, char **argv) {
+  auto thread_counts = default_thread_counts();
+  u64 iterations     = 500;
+  std::string json_path;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!std::strcmp(argv[i], "--threads")) {
+      thread_counts = parse_thread_counts(argv[i + 1]);
+    } else if (!std::strcmp(argv[i], "--iterations")) {
+      iterations = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--json")) {
+      json_path = argv[i + 1];
+    } else {
+      std::fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  FILE *out = json_path.empty() ? stdout : std::fopen(json_path.c_str(), "w");
+  if (!out) {
+    std::perror(json_path.c_str());
+    return 1;
+  }
+
+  JsonWriter json{out};
+  json.begin_object();
+  json.field("hardware_concurrency", u64(std::thread::hardware_concurrency()));
+  json.begin_array("samples");
+  std::fprintf(stderr, "%-12s %7s %14s %9s %11s %12s\n", "mode", "threads", "ops/s", "speedup",
+               "efficiency", "latency ns");
+
+  for (auto mode : {Mode::Interpret, Mode::Jit, Mode::JitCompile, Mode::CodeMemory}) {
+    // Warm up the allocator and page tables.
+    measure(mode, 1, iterations_for(mode, iterations) / 10 + 1);
+
+    // Speedup and efficiency are against one thread, even when --threads
+    // does not start at 1.
+    auto single           = measure(mode, 1, iterations_for(mode, iterations));
+    double single_thread  = single.throughput();
+    double single_latency = single.latency_ns();
+    for (auto threads : thread_counts) {
+      auto sample =
+          threads == 1 ? single : measure(mode, threads, iterations_for(mode, iterations));
+      double speedup    = sample.throughput() / single_thread;
+      double efficiency = speedup / threads;
+      // Operations that do not share state should keep their latency, as
+      // long as every thread has a core of its own.
+      bool oversubscribed = threads > std::thread::hardware_concurrency();
+      bool contended      = !oversubscribed && sample.latency_ns() > 2 * single_latency;
+
+      std::fprintf(stderr, "%-12s %7u %14.0f %9.2f %10.0f%% %12.0f%s\n", to_string(mode), threads,
+                   sample.throughput(), speedup, efficiency * 100, sample.latency_ns(),
+                   contended ? "  <- contended" : oversubscribed ? "  (oversubscribed)" : "");
+
+      json.begin_object();
+      json.field("mode", std::string(to_string(mode)));
+      json.field("threads", u64(threads));
+      json.field("operations", sample.operations);
+      json.field("seconds", sample.seconds);
+      json.field("throughput", sample.throughput());
+      json.field("speedup", speedup);
+      json.field("efficiency", efficiency);
+      json.field("latency_ns", sample.latency_ns());
+      json.field("contended", std::string(contended ? "yes" : "no"));
+      json.end_object();
+    }
+  }
+  json.end_array();
+  json.end_object();
+  std::fputc('\n', out);
+
+  if (out != stdout) {
+    std::fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,223 @@
+// Measures when compiling with Jit::compile pays off over VM::interpret.
+//
+//   g++ -std=c++17 -O2 bench_tiering.cpp -o bench_tiering
+//   ./bench_tiering [--repetitions N] [--json FILE]
+//
+// Two workload shapes, each swept over the number of instructions K:
+//
+//   invocation  a straight-line Program of K instructions called many times;
+//               the break-even is in invocations.
+//   loop        a loop whose body has K instructions; the break-even is in
+//               loop iterations (back edges).
+//
+// For each point it measures the compile time C and the per-unit cost of
+// interpreting (I) and of running the compiled code (J). Compiling pays
+// off after C / (I - J) units. Tiering up exactly there costs at most twice
+// the optimal choice (ski rental), so the recommended thresholds are the
+// largest break-even seen for each shape.
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "benchmark.h"
+#include "vm.h"
+
+// Every three instructions increment local 1 once.
+static void append_body(BasicBlock &block, size_t instructions) {
+  for (size_t i = 0; i < instructions / 3; ++i) {
+    block.append<GetLocal>(VM_Local(1));
+    block.append<Increment>();
+    block.append<SetLocal>(VM_Local(1));
+  }
+}
+
+static std::unique_ptr<Program> make_straight_line(size_t instructions) {
+  auto program = std::make_unique<Program>();
+  auto &block  = program->make_block();
+  append_body(block, instructions);
+  block.append<Exit>();
+  return program;
+}
+
+// while (local 0 < iterations) { body; local 0++ }
+static std::unique_ptr<Program> make_loop(size_t instructions, u64 iterations) {
+  auto program = std::make_unique<Program>();
+  auto &entry  = program->make_block();
+  auto &header = program->make_block();
+  auto &body   = program->make_block();
+  auto &done   = program->make_block();
+
+  entry.append<LoadImmediate>(VM_Value(0));
+  entry.append<SetLocal>(VM_Local(0));
+  entry.append<Jump>(header);
+
+  header.append<GetLocal>(VM_Local(0));
+  header.append<Store>(VM_Register(1));
+  header.append<LoadImmediate>(iterations);
+  header.append<LessThan>(VM_Register(1));
+  header.append<JumpConditional>(body, done);
+
+  append_body(body, instructions);
+  body.append<GetLocal>(VM_Local(0));
+  body.append<Increment>();
+  body.append<SetLocal>(VM_Local(0));
+  body.append<Jump>(header);
+
+  done.append<Exit>();
+  return program;
+}
+
+struct Point {
+  const char *shape;
+  size_t instructions;
+  double compile_ns;
+  double interpret_ns;  // per invocation or iteration
+  double jit_ns;        // per invocation or iteration
+
+  double break_even() const {
+    if (interpret_ns <= jit_ns) {
+      return INFINITY;
+    }
+    return compile_ns / (interpret_ns - jit_ns);
+  }
+};
+
+template <typename F>
+static double median_ns(int repetitions, F &&f) {
+  std::vector<double> samples;
+  for (int i = 0; i < repetitions; ++i) {
+    u64 start = now_ns();
+    f();
+    samples.push_back(double(now_ns() - start));
+  }
+  return Statistics::of(samples).median;
+}
+
+static double compile_ns(const Program &program, int repetitions) {
+  return median_ns(repetitions, [&] { Jit::compile(program); });
+}
+
+static Point measure_invocation(size_t instructions, int repetitions) {
+  constexpr int invocations = 1000;
+
+  auto program    = make_straight_line(instructions);
+  auto executable = Jit::compile(*program);
+  VM vm;
+  vm.registers.resize(8);
+  vm.locals.resize(8);
+
+  Point point{};
+  point.shape        = "invocation";
+  point.instructions = instructions;
+  point.compile_ns   = compile_ns(*program, repetitions);
+  point.interpret_ns = median_ns(repetitions, [&] {
+                         for (int i = 0; i < invocations; ++i) {
+                           vm.interpret(*program);
+                         }
+                       }) /
+                       invocations;
+  point.jit_ns = median_ns(repetitions, [&] {
+                   for (int i = 0; i < invocations; ++i) {
+                     vm.run(*program, executable);
+                   }
+                 }) /
+                 invocations;
+  return point;
+}
+
+// The per-iteration cost is the slope between two iteration counts, which
+// cancels the fixed cost of entering and leaving the Program.
+static Point measure_loop(size_t instructions, int repetitions) {
+  constexpr u64 short_run = 1000;
+  constexpr u64 long_run  = 11000;
+
+  auto short_program    = make_loop(instructions, short_run);
+  auto long_program     = make_loop(instructions, long_run);
+  auto short_executable = Jit::compile(*short_program);
+  auto long_executable  = Jit::compile(*long_program);
+  VM vm;
+  vm.registers.resize(8);
+  vm.locals.resize(8);
+
+  Point point{};
+  point.shape        = "loop";
+  point.instructions = instructions;
+  point.compile_ns   = compile_ns(*long_program, repetitions);
+
+  double interpret_short = median_ns(repetitions, [&] { vm.interpret(*short_program); });
+  double interpret_long  = median_ns(repetitions, [&] { vm.interpret(*long_program); });
+  double jit_short = median_ns(repetitions, [&] { vm.run(*short_program, short_executable); });
+  double jit_long  = median_ns(repetitions, [&] { vm.run(*long_program, long_executable); });
+
+  point.interpret_ns = (interpret_long - interpret_short) / (long_run - short_run);
+  point.jit_ns       = (jit_long - jit_short) / (long_run - short_run);
+  return point;
+}
+
+int main(int argc, char **argv) {
+  int repetitions = 15;
+  std::string json_path;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!std::strcmp(argv[i], "--repetitions")) {
+      repetitions = std::atoi(argv[i + 1]);
+    } else if (!std::strcmp(argv[i], "--json")) {
+      json_path = argv[i + 1];
+    } else {
+      std::fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  std::vector<Point> points;
+  for (size_t instructions : {3, 12, 48, 192, 768, 3072}) {
+    points.push_back(measure_invocation(instructions, repetitions));
+    points.push_back(measure_loop(instructions, repetitions));
+  }
+
+  FILE *out = json_path.empty() ? stdout : std::fopen(json_path.c_str(), "w");
+  if (!out) {
+    std::perror(json_path.c_str());
+    return 1;
+  }
+
+  double invocation_threshold = 0;
+  double loop_threshold       = 0;
+
+  JsonWriter json{out};
+  json.begin_object();
+  json.begin_array("points");
+  std::fprintf(stderr, "%-10s %6s %12s %14s %12s %12s\n", "shape", "K", "compile us",
+               "interpret ns", "jit ns", "break-even");
+  for (const auto &point : points) {
+    double break_even = point.break_even();
+    std::fprintf(stderr, "%-10s %6zu %12.2f %14.2f %12.2f %12.1f\n", point.shape,
+                 point.instructions, point.compile_ns / 1e3, point.interpret_ns, point.jit_ns,
+                 break_even);
+
+    auto &threshold = std::strcmp(point.shape, "loop") ? invocation_threshold : loop_threshold;
+    threshold       = std::max(threshold, break_even);
+
+    json.begin_object();
+    json.field("shape", std::string(point.shape));
+    json.field("instructions", u64(point.instructions));
+    json.field("compile_ns", point.compile_ns);
+    json.field("interpret_ns", point.interpret_ns);
+    json.field("jit_ns", point.jit_ns);
+    json.field("break_even", break_even);
+    json.end_object();
+  }
+  json.end_array();
+  json.field("recommended_invocation_threshold", std::ceil(invocation_threshold));
+  json.field("recommended_loop_threshold", std::ceil(loop_threshold));
+  json.end_object();
+  std::fputc('\n', out);
+
+  std::fprintf(stderr, "recommended tier-up: after %.0f invocations or %.0f loop iterations\n",
+               std::ceil(invocation_threshold), std::ceil(loop_threshold));
+
+  if (out != stdout) {
+    std::fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "json_writer.h"
+
+inline u64 now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Summary of repeated timings of the same thing, in nanoseconds.
+struct Statistics {
+  size_t count{};
+  double min{};
+  double max{};
+  double mean{};
+  double median{};
+  double p99{};
+  double stddev{};
+  // 95% confidence interval of the mean (normal approximation).
+  double ci95_low{};
+  double ci95_high{};
+
+  static Statistics of(std::vector<double> samples) {
+    Statistics stats;
+    if (samples.empty()) {
+      return stats;
+    }
+    std::sort(samples.begin(), samples.end());
+    stats.count  = samples.size();
+    stats.min    = samples.front();
+    stats.max    = samples.back();
+    stats.median = percentile(samples, 50);
+    stats.p99    = percentile(samples, 99);
+
+    double sum = 0;
+    for (auto sample : samples) {
+      sum += sample;
+    }
+    stats.mean = sum / samples.size();
+
+    double squares = 0;
+    for (auto sample : samples) {
+      squares += (sample - stats.mean) * (sample - stats.mean);
+    }
+    stats.stddev = samples.size() > 1 ? std::sqrt(squares / (samples.size() - 1)) : 0;
+
+    double margin   = 1.96 * stats.stddev / std::sqrt(double(samples.size()));
+    stats.ci95_low  = stats.mean - margin;
+    stats.ci95_high = stats.mean + margin;
+    return stats;
+  }
+
+  void write_json(JsonWriter &json) const {
+    json.begin_object();
+    json.field("count", u64(count));
+    json.field("min", min);
+    json.field("max", max);
+    json.field("mean", mean);
+    json.field("median", median);
+    json.field("p99", p99);
+    json.field("stddev", stddev);
+    json.field("ci95_low", ci95_low);
+    json.field("ci95_high", ci95_high);
+    json.end_object();
+  }
+
+  // Nearest-rank percentile of sorted samples.
+  static double percentile(const std::vector<double> &sorted, double percent) {
+    size_t rank = size_t(std::ceil(percent / 100 * sorted.size()));
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+  }
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "common.h"
+#include "json_writer.h"
+
+// Per-block counts for one Program, indexed by BasicBlock::index: how often
+// each block was entered, and how often the JumpConditional ending it went
+// to its true and false blocks. Gathered by the interpreter (BranchProfiler)
+// or by instrumented JIT code; the input for block layout, if-conversion
+// and recompilation decisions.
+struct BranchProfile {
+  std::vector<u64> entries;
+  std::vector<u64> taken;
+  std::vector<u64> not_taken;
+
+  BranchProfile() = default;
+
+  explicit BranchProfile(size_t block_count)
+      : entries(block_count), taken(block_count), not_taken(block_count) {}
+
+  size_t block_count() const { return entries.size(); }
+
+  void resize(size_t block_count) {
+    entries.resize(block_count);
+    taken.resize(block_count);
+    not_taken.resize(block_count);
+  }
+
+  u64 hottest() const {
+    u64 max = 0;
+    for (auto count : entries) {
+      max = std::max(max, count);
+    }
+    return max;
+  }
+
+  // Fraction of the block's branches that went to the true block, or -1
+  // when the branch never ran.
+  double taken_ratio(size_t block) const {
+    u64 total = taken[block] + not_taken[block];
+    return total ? double(taken[block]) / double(total) : -1;
+  }
+
+  void merge(const BranchProfile &other) {
+    if (other.block_count() > block_count()) {
+      resize(other.block_count());
+    }
+    for (size_t i = 0; i < other.block_count(); ++i) {
+      entries[i] += other.entries[i];
+      taken[i] += other.taken[i];
+      not_taken[i] += other.not_taken[i];
+    }
+  }
+
+  // {"blocks":[{"entries":N,"taken":N,"not_taken":N}, ...]}
+  void write_json(JsonWriter &json) const {
+    json.begin_object();
+    json.begin_array("blocks");
+    for (size_t i = 0; i < block_count(); ++i) {
+      json.begin_object();
+      json.field("entries", entries[i]);
+      json.field("taken", taken[i]);
+      json.field("not_taken", not_taken[i]);
+      json.end_object();
+    }
+    json.end_array();
+    json.end_object();
+  }
+};
@@ -0,0 +1,407 @@
+// Runs Programs that use the VM's less common features through both
+// VM::interpret and VM::jit and checks that the two agree, exiting non-zero
+// on the first difference.
+//
+//   g++ -std=c++17 -O2 check.cpp ast.cpp -o check
+//   ./check
+//
+// Covered: host calls with and without the VM and through an intrinsic,
+// rejecting jumps into another Program, Stats for an interpret call that a
+// host call ends with an exception, allocation under enough pressure
+// for minor and major collections, with old-to-young stores, and the
+// workloads. Every Program compared is also compiled with and without
+// branch counters, and that code, like AstCompiler's for the workloads,
+// must decode with X86Decoder from the first byte to the last. The counts
+// from JitOptions::count_branches, run on two threads, must add up to
+// twice what BranchProfiler records in the interpreter.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "ast_compiler.h"
+#include "workloads.h"
+#include "x86_decoder.h"
+
+static void fail(const std::string &message) {
+  std::fprintf(stderr, "check failed: %s\n", message.c_str());
+  std::exit(1);
+}
+
+static void size(VM &vm) {
+  vm.registers.resize(8);
+  vm.locals.resize(8);
+}
+
+// Instruction boundaries must fall on every block and VM instruction start,
+// so a desynchronized decode cannot hide behind a later resync.
+static void check_decoding(const std::string &name, const Executable &executable) {
+  auto code         = static_cast<const u8 *>(executable.data);
+  auto instructions = X86Decoder::decode_all(code, executable.code_size);
+  std::vector<bool> starts(executable.code_size + 1);
+  for (const auto &instruction : instructions) {
+    if (instruction.text.rfind(".byte", 0) == 0) {
+      char offset[32];
+      std::snprintf(offset, sizeof(offset), " at 0x%zx", instruction.offset);
+      fail(name + ": X86Decoder fell back to " + instruction.text + offset);
+    }
+    starts[instruction.offset] = true;
+  }
+  starts[executable.code_size] = true;
+  for (auto offset : executable.block_offsets) {
+    if (!starts[offset]) {
+      fail(name + ": a block starts inside a decoded instruction");
+    }
+  }
+  for (const auto &location : executable.locations) {
+    if (!starts[location.offset]) {
+      fail(name + ": a VM instruction starts inside a decoded instruction");
+    }
+  }
+}
+
+template <typename Setup>
+static void compare_branch_counts(const std::string &name, const Program &program, Setup setup) {
+  BranchProfiler profiler;
+  VM interpreted;
+  size(interpreted);
+  setup(interpreted);
+  interpreted.interpret(program, profiler);
+  const auto &expected = profiler.profile(program);
+
+  auto executable = Jit::compile(program, {true});
+  auto run        = [&] {
+    VM compiled;
+    size(compiled);
+    setup(compiled);
+    compiled.run(program, executable);
+  };
+  run();
+  std::thread(run).join();
+
+  auto counted = executable.counters->snapshot();
+  for (size_t block = 0; block < program.blocks.size(); ++block) {
+    if (counted.entries[block] != 2 * expected.entries[block] ||
+        counted.taken[block] != 2 * expected.taken[block] ||
+        counted.not_taken[block] != 2 * expected.not_taken[block]) {
+      fail(name + ": JIT branch counters and BranchProfiler disagree on block " +
+           std::to_string(block));
+    }
+  }
+}
+
+// Runs `program` on a fresh VM per engine, after `setup`, and compares all
+// registers and locals.
+template <typename Setup>
+static void compare_engines(const std::string &name, const Program &program, Setup setup) {
+  VM interpreted;
+  size(interpreted);
+  setup(interpreted);
+  interpreted.interpret(program);
+
+  VM compiled;
+  size(compiled);
+  setup(compiled);
+  compiled.jit(program);
+
+  if (interpreted.registers != compiled.registers || interpreted.locals != compiled.locals) {
+    std::fprintf(stderr, "interpreted:\n");
+    interpreted.dump();
+    std::fprintf(stderr, "compiled:\n");
+    compiled.dump();
+    fail(name + ": VM::interpret and VM::jit disagree");
+  }
+  check_decoding(name, Jit::compile(program));
+  check_decoding(name + " (counted)", Jit::compile(program, {true}));
+  compare_branch_counts(name, program, setup);
+  std::printf("%-12s ok\n", name.c_str());
+}
+
+static VM_Value host_add3(VM_Value a, VM_Value b, VM_Value c) { return a + b + c; }
+
+// Scales by local 3 and keeps the result small.
+static VM_Value host_scale(VM &vm, VM_Value value) { return value * vm.locals[3] % 1000003; }
+
+static void host_record(VM &vm, VM_Value value) { vm.locals[2] += value; }
+
+static VM_Value host_add2(VM_Value a, VM_Value b) { return a + b; }
+
+static void emit_add2(Assembler &assembler, const std::vector<VM_Register> &arguments) {
+  assembler.load_vm_register(Assembler::Reg::R0, arguments[0]);
+  assembler.load_vm_register(Assembler::Reg::R1, arguments[1]);
+  assembler.add(Assembler::Reg::R0, Assembler::Reg::R1);
+}
+
+// for (i = 0; i < 1000; i++) {
+//   acc = add2(scale(add3(i, 7, acc)), i);
+//   record(i);
+// }
+// Locals: 0 = i, 1 = acc, 2 = sum of recorded values, 3 = scale.
+static void check_hosts() {
+  constexpr VM_Value iterations = 1000;
+
+  HostRegistry hosts;
+  auto &add3   = hosts.register_function("add3", &host_add3);
+  auto &scale  = hosts.register_function("scale", &host_scale);
+  auto &record = hosts.register_function("record", &host_record);
+  auto &add2   = hosts.register_function("add2", &host_add2, &emit_add2);
+
+  Program program;
+  program.name = "hosts";
+  auto &entry  = program.make_block();
+  auto &header = program.make_block();
+  auto &body   = program.make_block();
+  auto &done   = program.make_block();
+
+  entry.append<LoadImmediate>(0);
+  entry.append<SetLocal>(0);
+  entry.append<SetLocal>(1);
+  entry.append<SetLocal>(2);
+  entry.append<Jump>(header);
+
+  header.append<GetLocal>(0);
+  header.append<Store>(1);
+  header.append<LoadImmediate>(iterations);
+  header.append<LessThan>(1);
+  header.append<JumpConditional>(body, done);
+
+  body.append<GetLocal>(0);
+  body.append<Store>(2);
+  body.append<LoadImmediate>(7);
+  body.append<Store>(3);
+  body.append<GetLocal>(1);
+  body.append<Store>(4);
+  body.append<CallHost>(add3, std::vector<VM_Register>{2, 3, 4});
+  body.append<Store>(5);
+  body.append<CallHost>(scale, std::vector<VM_Register>{5});
+  body.append<Store>(5);
+  body.append<CallHost>(add2, std::vector<VM_Register>{5, 2});
+  body.append<SetLocal>(1);
+  body.append<CallHost>(record, std::vector<VM_Register>{2});
+  body.append<GetLocal>(0);
+  body.append<Increment>();
+  body.append<SetLocal>(0);
+  body.append<Jump>(header);
+
+  done.append<Exit>();
+
+  compare_engines("hosts", program, [](VM &vm) { vm.locals[3] = 3; });
+
+  VM_Value acc = 0;
+  for (VM_Value i = 0; i < iterations; ++i) {
+    acc = (i + 7 + acc) * 3 % 1000003 + i;
+  }
+  VM vm;
+  size(vm);
+  vm.locals[3] = 3;
+  vm.jit(program);
+  if (vm.locals[1] != acc || vm.locals[2] != iterations * (iterations - 1) / 2) {
+    fail("hosts: wrong result");
+  }
+}
+
+// A block of another Program may have an index that is valid here too.
+static void check_foreign_jump() {
+  Program other;
+  other.make_block().append<Exit>();
+
+  Program program;
+  program.name = "foreign";
+  program.make_block().append<Jump>(*other.blocks[0]);
+  try {
+    Jit::compile(program);
+  } catch (const std::runtime_error &) {
+    std::printf("%-12s ok\n", program.name.c_str());
+    return;
+  }
+  fail("foreign: jump into another Program compiled");
+}
+
+static VM_Value host_throw(VM_Value) { throw std::runtime_error("host failed"); }
+
+static void check_throwing_host() {
+  HostRegistry hosts;
+  auto &fail_host = hosts.register_function("throw", &host_throw);
+
+  Program program;
+  program.name = "host throw";
+  auto &entry  = program.make_block();
+  entry.append<LoadImmediate>(1);
+  entry.append<Store>(1);
+  entry.append<CallHost>(fail_host, std::vector<VM_Register>{1});
+  entry.append<Exit>();
+
+  auto before = Stats::snapshot();
+  VM vm;
+  size(vm);
+  try {
+    vm.interpret(program);
+    fail("host throw: the exception was lost");
+  } catch (const std::runtime_error &) {
+  }
+  auto after = Stats::snapshot();
+  if (after[Stat::InterpretCalls] - before[Stat::InterpretCalls] != 1 ||
+      after[Stat::InstructionsInterpreted] - before[Stat::InstructionsInterpreted] != 3) {
+    fail("host throw: the interpret call was not counted");
+  }
+  std::printf("%-12s ok\n", program.name.c_str());
+}
+
+// for (j = 0; j < 40; j++) {
+//   for (k = 0; k < 50000; k++) anchor.head = {next: anchor.head, value: k};
+//   for (node = anchor.head, n = 0; n <= 50000 && node; node = node.next, n++)
+//     sum += node.value;
+//   anchor.head = 0;
+// }
+// Each list outlives a minor collection, so most of it is promoted and
+// then reachable only through the anchor, an old object pointing into the
+// nursery. The dropped lists fill the old space until it is compacted.
+// Counting the nodes keeps a list broken by the collector from looping.
+//
+// Locals: 0 = j, 1 = k, 2 = sum, 3 = anchor, 4 = node, 5 = n. Registers 2-4
+// hold references only between safepoints.
+static void check_heap() {
+  constexpr VM_Value lists  = 40;
+  constexpr VM_Value length = 50000;
+
+  Program program;
+  program.name       = "heap";
+  auto &entry        = program.make_block();
+  auto &outer_header = program.make_block();
+  auto &outer_body   = program.make_block();
+  auto &build_header = program.make_block();
+  auto &build_body   = program.make_block();
+  auto &walk_start   = program.make_block();
+  auto &walk_header  = program.make_block();
+  auto &walk_check   = program.make_block();
+  auto &walk_body    = program.make_block();
+  auto &outer_latch  = program.make_block();
+  auto &done         = program.make_block();
+
+  entry.append<Allocate>(1, 1, StackMap{});
+  entry.append<SetLocal>(3);
+  entry.append<LoadImmediate>(0);
+  entry.append<SetLocal>(0);
+  entry.append<SetLocal>(2);
+  entry.append<Jump>(outer_header);
+
+  outer_header.append<GetLocal>(0);
+  outer_header.append<Store>(1);
+  outer_header.append<LoadImmediate>(lists);
+  outer_header.append<LessThan>(1);
+  outer_header.append<JumpConditional>(outer_body, done);
+
+  outer_body.append<LoadImmediate>(0);
+  outer_body.append<SetLocal>(1);
+  outer_body.append<Jump>(build_header);
+
+  build_header.append<GetLocal>(1);
+  build_header.append<Store>(1);
+  build_header.append<LoadImmediate>(length);
+  build_header.append<LessThan>(1);
+  build_header.append<JumpConditional>(build_body, walk_start);
+
+  build_body.append<Allocate>(2, 1, StackMap{{}, {3}});
+  build_body.append<Store>(2);
+  build_body.append<GetLocal>(3);
+  build_body.append<Store>(3);
+  build_body.append<GetField>(3, 0);
+  build_body.append<SetField>(2, 0);
+  build_body.append<GetLocal>(1);
+  build_body.append<SetField>(2, 1);
+  build_body.append<Load>(2);
+  build_body.append<SetField>(3, 0);
+  build_body.append<GetLocal>(1);
+  build_body.append<Increment>();
+  build_body.append<SetLocal>(1);
+  build_body.append<Jump>(build_header);
+
+  walk_start.append<GetLocal>(3);
+  walk_start.append<Store>(3);
+  walk_start.append<GetField>(3, 0);
+  walk_start.append<SetLocal>(4);
+  walk_start.append<LoadImmediate>(0);
+  walk_start.append<SetLocal>(5);
+  walk_start.append<Jump>(walk_header);
+
+  walk_header.append<GetLocal>(5);
+  walk_header.append<Store>(1);
+  walk_header.append<LoadImmediate>(length + 1);
+  walk_header.append<LessThan>(1);
+  walk_header.append<JumpConditional>(walk_check, outer_latch);
+
+  walk_check.append<GetLocal>(4);
+  walk_check.append<JumpConditional>(walk_body, outer_latch);
+
+  walk_body.append<GetLocal>(4);
+  walk_body.append<Store>(4);
+  walk_body.append<GetField>(4, 1);
+  walk_body.append<Store>(1);
+  walk_body.append<GetLocal>(2);
+  walk_body.append<Add>(1);
+  walk_body.append<SetLocal>(2);
+  walk_body.append<GetField>(4, 0);
+  walk_body.append<SetLocal>(4);
+  walk_body.append<GetLocal>(5);
+  walk_body.append<Increment>();
+  walk_body.append<SetLocal>(5);
+  walk_body.append<Jump>(walk_header);
+
+  outer_latch.append<LoadImmediate>(0);
+  outer_latch.append<SetField>(3, 0);
+  outer_latch.append<GetLocal>(0);
+  outer_latch.append<Increment>();
+  outer_latch.append<SetLocal>(0);
+  outer_latch.append<Jump>(outer_header);
+
+  // Addresses differ between the two VMs, so no references are left for
+  // compare_engines to see.
+  done.append<LoadImmediate>(0);
+  done.append<Store>(2);
+  done.append<Store>(3);
+  done.append<Store>(4);
+  done.append<SetLocal>(3);
+  done.append<SetLocal>(4);
+  done.append<Exit>();
+
+  compare_engines("heap", program, [](VM &) {});
+
+  for (bool jit : {false, true}) {
+    VM vm;
+    size(vm);
+    jit ? vm.jit(program) : vm.interpret(program);
+    if (vm.locals[2] != lists * (length * (length - 1) / 2)) {
+      fail("heap: wrong sum");
+    }
+    if (!vm.heap.minor_collections || !vm.heap.major_collections) {
+      fail("heap: expected minor and major collections");
+    }
+  }
+}
+
+static void check_workloads() {
+  std::vector<Workload> workloads;
+  workloads.push_back(make_count_loop(1000));
+  workloads.push_back(make_fib(100));
+  workloads.push_back(make_nested_loops(100));
+  workloads.push_back(make_branchy(1000));
+  workloads.push_back(make_many_small_programs(10));
+  for (const auto &workload : workloads) {
+    for (const auto &program : workload.programs) {
+      compare_engines(workload.name, *program, [](VM &) {});
+    }
+    for (const auto &function : workload.functions) {
+      check_decoding(workload.name + " (AST)", AstCompiler::compile(*function).executable);
+    }
+  }
+}
+
+int main() {
+  check_hosts();
+  check_foreign_jump();
+  check_throwing_host();
+  check_heap();
+  check_workloads();
+  return 0;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include "common.h"
+
+// Machine code under construction, written straight into an anonymous
+// mapping that later becomes the Executable. The mapping grows by doubling
+// with mremap, which moves page table entries rather than bytes, so
+// emission is linear, nothing is ever copied, and only the pages actually
+// written are backed by memory.
+struct CodeBuffer {
+  static constexpr size_t initial_capacity = 64 * 1024;
+
+  CodeBuffer() { map(initial_capacity); }
+
+  CodeBuffer(const CodeBuffer &)            = delete;
+  CodeBuffer &operator=(const CodeBuffer &) = delete;
+
+  ~CodeBuffer() {
+    if (data) {
+      munmap(data, capacity);
+    }
+  }
+
+  size_t size() const { return cursor - data; }
+
+  // Makes room for `bytes` more without moving the mapping again.
+  void reserve(size_t bytes) {
+    if (size() + bytes > capacity) {
+      grow(size() + bytes);
+    }
+  }
+
+  void push_back(u8 byte) {
+    if (cursor == end) {
+      grow(capacity + 1);
+    }
+    *cursor++ = byte;
+  }
+
+  // Little-endian, like every immediate and displacement on x86-64.
+  void append(u64 value, size_t bytes) {
+    if (size_t(end - cursor) < bytes) {
+      grow(capacity + bytes);
+    }
+    std::memcpy(cursor, &value, bytes);
+    cursor += bytes;
+  }
+
+  u8 &operator[](size_t offset) { return data[offset]; }
+
+  void patch32(size_t offset, u32 value) { std::memcpy(data + offset, &value, sizeof(value)); }
+
+  // Hands the mapping over, trimmed to the pages that hold code. The buffer
+  // is empty afterwards.
+  std::pair<void *, size_t> release() {
+    size_t used = round_to_pages(std::max<size_t>(size(), 1));
+    if (used < capacity) {
+      munmap(data + used, capacity - used);
+    }
+    std::pair<void *, size_t> mapping{data, used};
+    data = cursor = end = nullptr;
+    capacity            = 0;
+    return mapping;
+  }
+
+ private:
+  static size_t round_to_pages(size_t bytes) {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    return (bytes + page_size - 1) / page_size * page_size;
+  }
+
+  void map(size_t bytes) {
+    capacity = round_to_pages(bytes);
+    void *mapping =
+        mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+      throw std::runtime_error("Memory allocation failed");
+    }
+    data = cursor = static_cast<u8 *>(mapping);
+    end           = data + capacity;
+  }
+
+  void grow(size_t minimum) {
+    size_t used         = size();
+    size_t new_capacity = round_to_pages(std::max(minimum, 2 * capacity));
+    void *mapping       = mremap(data, capacity, new_capacity, MREMAP_MAYMOVE);
+    if (mapping == MAP_FAILED) {
+      throw std::runtime_error("Memory allocation failed");
+    }
+    capacity = new_capacity;
+    data     = static_cast<u8 *>(mapping);
+    cursor   = data + used;
+    end      = data + capacity;
+  }
+
+  u8 *data{};
+  u8 *cursor{};
+  u8 *end{};
+  size_t capacity{};
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+
+typedef uint64_t u64;
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+
+typedef u64 VM_Value;
+typedef u64 VM_Register;
+typedef u64 VM_Local;
+
+template <typename T, typename U>
+constexpr T narrow_cast(U &&u) noexcept {
+  return static_cast<T>(std::forward<U>(u));
+}
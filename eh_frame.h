@@ -0,0 +1,176 @@
+#pragma once
+
+#include <vector>
+
+#include "common.h"
+
+// Provided by libgcc; `begin` is a complete .eh_frame section terminated by
+// a zero length entry.
+extern "C" void __register_frame(void *begin);
+extern "C" void __deregister_frame(void *begin);
+
+// Builds the .eh_frame for one region of JIT code. Every compiled Program is
+// a single function that starts with `push rbp; mov rbp, rsp` and leaves
+// through `pop rbp; ret` at each of `epilogues` (offsets of the `pop`).
+// Between the two the CFA is RBP + 16, so calls and pushes need no rows.
+struct EhFrameBuilder {
+  enum : u8 {
+    DW_CFA_nop              = 0x00,
+    DW_CFA_advance_loc1     = 0x02,
+    DW_CFA_advance_loc2     = 0x03,
+    DW_CFA_advance_loc4     = 0x04,
+    DW_CFA_remember_state   = 0x0a,
+    DW_CFA_restore_state    = 0x0b,
+    DW_CFA_def_cfa          = 0x0c,
+    DW_CFA_def_cfa_register = 0x0d,
+    DW_CFA_def_cfa_offset   = 0x0e,
+    DW_CFA_advance_loc      = 0x40,
+    DW_CFA_offset           = 0x80,
+    DW_EH_PE_absptr         = 0x00,
+  };
+
+  // DWARF register numbers on x86-64. Not another enum: they are ORed into
+  // DW_CFA_offset, and mixing two enum types is deprecated in C++20.
+  static constexpr u8 DwarfRBP           = 6;
+  static constexpr u8 DwarfRSP           = 7;
+  static constexpr u8 DwarfReturnAddress = 16;
+
+  static constexpr size_t push_rbp_size    = 1;
+  static constexpr size_t mov_rbp_rsp_size = 3;
+  static constexpr size_t pop_rbp_size     = 1;
+  static constexpr size_t ret_size         = 1;
+
+  std::vector<u8> buf;
+  size_t location{};
+
+  static std::vector<u8> build(const void *code, size_t size,
+                               const std::vector<size_t> &epilogues) {
+    EhFrameBuilder builder;
+    builder.emit_cie();
+    builder.emit_fde(0, code, size, epilogues);
+    builder.emit32(0);  // terminator
+    return builder.buf;
+  }
+
+  void emit_cie() {
+    size_t start = begin_entry();
+    emit32(0);  // CIE id
+    emit8(1);   // version
+    emit8('z');
+    emit8('R');
+    emit8(0);
+    emit_uleb(1);   // code alignment
+    emit_sleb(-8);  // data alignment
+    emit_uleb(DwarfReturnAddress);
+    emit_uleb(1);  // augmentation data length
+    emit8(DW_EH_PE_absptr);
+
+    // On entry CFA = RSP + 8 and the return address is at CFA - 8.
+    emit8(DW_CFA_def_cfa);
+    emit_uleb(DwarfRSP);
+    emit_uleb(8);
+    emit8(DW_CFA_offset | DwarfReturnAddress);
+    emit_uleb(1);
+    end_entry(start);
+  }
+
+  void emit_fde(size_t cie, const void *code, size_t size, const std::vector<size_t> &epilogues) {
+    size_t start = begin_entry();
+    emit32(narrow_cast<u32>(buf.size() - cie));  // CIE pointer, relative to this field
+    emit64(reinterpret_cast<u64>(code));
+    emit64(size);
+    emit_uleb(0);  // augmentation data length
+
+    location = 0;
+    advance_to(push_rbp_size);
+    emit8(DW_CFA_def_cfa_offset);
+    emit_uleb(16);
+    emit8(DW_CFA_offset | DwarfRBP);
+    emit_uleb(2);
+    advance_to(push_rbp_size + mov_rbp_rsp_size);
+    emit8(DW_CFA_def_cfa_register);
+    emit_uleb(DwarfRBP);
+
+    for (auto epilogue : epilogues) {
+      advance_to(epilogue);
+      emit8(DW_CFA_remember_state);
+      advance_to(epilogue + pop_rbp_size);
+      emit8(DW_CFA_def_cfa);
+      emit_uleb(DwarfRSP);
+      emit_uleb(8);
+      advance_to(epilogue + pop_rbp_size + ret_size);
+      emit8(DW_CFA_restore_state);
+    }
+    end_entry(start);
+  }
+
+  void advance_to(size_t target) {
+    size_t delta = target - location;
+    location     = target;
+    if (delta < 0x40) {
+      emit8(DW_CFA_advance_loc | narrow_cast<u8>(delta));
+    } else if (delta <= 0xff) {
+      emit8(DW_CFA_advance_loc1);
+      emit8(narrow_cast<u8>(delta));
+    } else if (delta <= 0xffff) {
+      emit8(DW_CFA_advance_loc2);
+      emit8(delta & 0xff);
+      emit8((delta >> 8) & 0xff);
+    } else {
+      emit8(DW_CFA_advance_loc4);
+      emit32(narrow_cast<u32>(delta));
+    }
+  }
+
+  size_t begin_entry() {
+    size_t start = buf.size();
+    emit32(0);  // length, patched by end_entry
+    return start;
+  }
+
+  // Pads the entry to pointer alignment and patches its length.
+  void end_entry(size_t start) {
+    while ((buf.size() - start) % 8 != 0) {
+      emit8(DW_CFA_nop);
+    }
+    u32 length     = narrow_cast<u32>(buf.size() - start - 4);
+    buf[start + 0] = (length >> 0) & 0xff;
+    buf[start + 1] = (length >> 8) & 0xff;
+    buf[start + 2] = (length >> 16) & 0xff;
+    buf[start + 3] = (length >> 24) & 0xff;
+  }
+
+  void emit8(u8 byte) { buf.push_back(byte); }
+
+  void emit32(u32 dword) {
+    for (int i = 0; i < 4; ++i) {
+      buf.push_back((dword >> (8 * i)) & 0xff);
+    }
+  }
+
+  void emit64(u64 qword) {
+    for (int i = 0; i < 8; ++i) {
+      buf.push_back((qword >> (8 * i)) & 0xff);
+    }
+  }
+
+  void emit_uleb(u64 value) {
+    do {
+      u8 byte = value & 0x7f;
+      value >>= 7;
+      emit8(value ? byte | 0x80 : byte);
+    } while (value);
+  }
+
+  void emit_sleb(int64_t value) {
+    for (;;) {
+      u8 byte = value & 0x7f;
+      value >>= 7;
+      bool done = (value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40));
+      emit8(done ? byte : byte | 0x80);
+      if (done) {
+        return;
+      }
+    }
+  }
+};
@@ -0,0 +1,309 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "common.h"
+
+// Every heap object starts with this header and is followed by `slot_count`
+// VM_Values. The first `reference_slots` slots hold either 0 or a pointer to
+// another HeapObject, the remaining slots hold raw values. Keeping references
+// in a prefix is what lets the collector find them precisely.
+struct HeapObject {
+  enum Flags : u64 {
+    Marked     = 1,
+    Remembered = 2,
+    FlagMask   = 7,
+  };
+
+  u32 slot_count;
+  u32 reference_slots;
+  // Forwarding address during collection. The low bits hold Flags.
+  u64 forward;
+
+  VM_Value *slots() { return reinterpret_cast<VM_Value *>(this + 1); }
+
+  size_t size() const { return sizeof(HeapObject) + slot_count * sizeof(VM_Value); }
+
+  HeapObject *forwarding_address() const {
+    return reinterpret_cast<HeapObject *>(forward & ~u64(FlagMask));
+  }
+
+  static u64 header_word(u32 slot_count, u32 reference_slots) {
+    return u64(slot_count) | (u64(reference_slots) << 32);
+  }
+};
+
+static_assert(sizeof(HeapObject) == 16);
+
+// Generational heap owned by a single VM. New objects are bump-allocated in
+// the nursery; a minor collection copies the survivors into the old space
+// (Cheney scan), and a major collection mark-compacts the old space in place.
+struct Heap {
+  // The JIT reads and writes these fields directly, keep them first.
+  u8 *nursery_top{};
+  u8 *nursery_end{};
+  u8 *nursery_begin{};
+  u64 nursery_size{};
+
+  u8 *old_begin{};
+  u8 *old_top{};
+  u8 *old_end{};
+
+  // Old objects that may point into the nursery.
+  std::vector<HeapObject *> remembered;
+
+  size_t minor_collections{};
+  size_t major_collections{};
+
+  static constexpr size_t default_nursery_size = 1 << 20;
+  static constexpr size_t default_old_size     = 16 << 20;
+
+  Heap(size_t nursery_size = default_nursery_size, size_t old_size = default_old_size)
+      : nursery_size(nursery_size) {
+    nursery_begin = map(nursery_size);
+    nursery_top   = nursery_begin;
+    nursery_end   = nursery_begin + nursery_size;
+
+    old_begin = map(old_size);
+    old_top   = old_begin;
+    old_end   = old_begin + old_size;
+  }
+
+  Heap(const Heap &)            = delete;
+  Heap &operator=(const Heap &) = delete;
+
+  ~Heap() {
+    munmap(nursery_begin, nursery_end - nursery_begin);
+    munmap(old_begin, old_end - old_begin);
+  }
+
+  bool in_nursery(VM_Value value) const {
+    return value - reinterpret_cast<u64>(nursery_begin) < nursery_size;
+  }
+
+  bool in_old(VM_Value value) const {
+    auto *pointer = reinterpret_cast<u8 *>(value);
+    return pointer >= old_begin && pointer < old_top;
+  }
+
+  // Fast path, returns nullptr when the nursery is full. The nursery is kept
+  // zeroed so only the header has to be written.
+  HeapObject *allocate(u32 slot_count, u32 reference_slots) {
+    size_t size = sizeof(HeapObject) + slot_count * sizeof(VM_Value);
+    if (size > size_t(nursery_end - nursery_top)) {
+      return nullptr;
+    }
+    auto *object = reinterpret_cast<HeapObject *>(nursery_top);
+    nursery_top += size;
+    object->slot_count      = slot_count;
+    object->reference_slots = reference_slots;
+    return object;
+  }
+
+  // Slow path, only called at safepoints. `roots` are the addresses of every
+  // VM register and local that holds a reference at this point.
+  HeapObject *allocate_slow(u32 slot_count, u32 reference_slots,
+                            const std::vector<VM_Value *> &roots) {
+    size_t size = sizeof(HeapObject) + slot_count * sizeof(VM_Value);
+    if (size > nursery_size / 2) {
+      return allocate_old(slot_count, reference_slots, roots);
+    }
+
+    collect(roots);
+    auto *object = allocate(slot_count, reference_slots);
+    if (!object) {
+      throw std::runtime_error("Out of memory");
+    }
+    return object;
+  }
+
+  void write_barrier(HeapObject *object, u32 index, VM_Value value) {
+    if (index >= object->reference_slots || !in_nursery(value) ||
+        in_nursery(reinterpret_cast<u64>(object)) ||
+        (object->forward & HeapObject::Remembered)) {
+      return;
+    }
+    object->forward |= HeapObject::Remembered;
+    remembered.push_back(object);
+  }
+
+  void collect(const std::vector<VM_Value *> &roots) {
+    if (size_t(old_end - old_top) < size_t(nursery_top - nursery_begin)) {
+      collect_major(roots);
+      if (size_t(old_end - old_top) < size_t(nursery_top - nursery_begin)) {
+        throw std::runtime_error("Out of memory");
+      }
+    }
+    collect_minor(roots);
+  }
+
+  void collect_minor(const std::vector<VM_Value *> &roots) {
+    minor_collections++;
+
+    u8 *scan = old_top;
+    for (auto *root : roots) {
+      *root = evacuate(*root);
+    }
+    for (auto *object : remembered) {
+      object->forward &= ~u64(HeapObject::Remembered);
+      evacuate_references(object);
+    }
+    remembered.clear();
+
+    while (scan < old_top) {
+      auto *object = reinterpret_cast<HeapObject *>(scan);
+      evacuate_references(object);
+      scan += object->size();
+    }
+
+    std::memset(nursery_begin, 0, nursery_top - nursery_begin);
+    nursery_top = nursery_begin;
+  }
+
+  // Marks through both generations but only compacts the old space. Live
+  // nursery objects stay where they are and get their old references fixed
+  // up, the next minor collection moves them.
+  void collect_major(const std::vector<VM_Value *> &roots) {
+    major_collections++;
+
+    std::vector<HeapObject *> worklist;
+    std::vector<HeapObject *> marked_nursery;
+    auto mark = [&](VM_Value value) {
+      if (!value) {
+        return;
+      }
+      auto *object = reinterpret_cast<HeapObject *>(value);
+      if (object->forward & HeapObject::Marked) {
+        return;
+      }
+      object->forward |= HeapObject::Marked;
+      worklist.push_back(object);
+      if (in_nursery(value)) {
+        marked_nursery.push_back(object);
+      }
+    };
+
+    for (auto *root : roots) {
+      mark(*root);
+    }
+    while (!worklist.empty()) {
+      auto *object = worklist.back();
+      worklist.pop_back();
+      for (u32 i = 0; i < object->reference_slots; ++i) {
+        mark(object->slots()[i]);
+      }
+    }
+
+    // Compute forwarding addresses for the live old objects.
+    u8 *free = old_begin;
+    for (u8 *scan = old_begin; scan < old_top;) {
+      auto *object = reinterpret_cast<HeapObject *>(scan);
+      if (object->forward & HeapObject::Marked) {
+        object->forward = reinterpret_cast<u64>(free) | (object->forward & HeapObject::FlagMask);
+        free += object->size();
+      }
+      scan += object->size();
+    }
+
+    // Update every reference into the old space.
+    auto update = [&](VM_Value &value) {
+      if (in_old(value)) {
+        value = reinterpret_cast<u64>(reinterpret_cast<HeapObject *>(value)->forwarding_address());
+      }
+    };
+    for (auto *root : roots) {
+      update(*root);
+    }
+    for (auto *object : marked_nursery) {
+      for (u32 i = 0; i < object->reference_slots; ++i) {
+        update(object->slots()[i]);
+      }
+      object->forward &= ~u64(HeapObject::Marked);
+    }
+    std::vector<HeapObject *> still_remembered;
+    for (u8 *scan = old_begin; scan < old_top;) {
+      auto *object = reinterpret_cast<HeapObject *>(scan);
+      if (object->forward & HeapObject::Marked) {
+        for (u32 i = 0; i < object->reference_slots; ++i) {
+          update(object->slots()[i]);
+        }
+        if (object->forward & HeapObject::Remembered) {
+          still_remembered.push_back(object->forwarding_address());
+        }
+      }
+      scan += object->size();
+    }
+
+    // Slide the live objects down. Destinations never overlap a later source.
+    for (u8 *scan = old_begin; scan < old_top;) {
+      auto *object = reinterpret_cast<HeapObject *>(scan);
+      size_t size  = object->size();
+      if (object->forward & HeapObject::Marked) {
+        auto *destination = object->forwarding_address();
+        u64 flags         = object->forward & HeapObject::Remembered;
+        std::memmove(destination, object, size);
+        destination->forward = flags;
+      }
+      scan += size;
+    }
+
+    std::memset(free, 0, old_top - free);
+    old_top    = free;
+    remembered = std::move(still_remembered);
+  }
+
+ private:
+  static u8 *map(size_t size) {
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("Memory allocation failed");
+    }
+    return static_cast<u8 *>(data);
+  }
+
+  HeapObject *allocate_old(u32 slot_count, u32 reference_slots,
+                           const std::vector<VM_Value *> &roots) {
+    size_t size = sizeof(HeapObject) + slot_count * sizeof(VM_Value);
+    if (size > size_t(old_end - old_top)) {
+      collect_major(roots);
+      if (size > size_t(old_end - old_top)) {
+        throw std::runtime_error("Out of memory");
+      }
+    }
+    auto *object = reinterpret_cast<HeapObject *>(old_top);
+    old_top += size;
+    object->slot_count      = slot_count;
+    object->reference_slots = reference_slots;
+    object->forward         = 0;
+    // A fresh old object has no nursery references yet, no barrier needed.
+    return object;
+  }
+
+  VM_Value evacuate(VM_Value value) {
+    if (!in_nursery(value)) {
+      return value;
+    }
+    auto *object = reinterpret_cast<HeapObject *>(value);
+    if (object->forward) {
+      return reinterpret_cast<u64>(object->forwarding_address());
+    }
+    size_t size = object->size();
+    auto *copy  = reinterpret_cast<HeapObject *>(old_top);
+    old_top += size;
+    std::memcpy(copy, object, size);
+    copy->forward   = 0;
+    object->forward = reinterpret_cast<u64>(copy);
+    return reinterpret_cast<u64>(copy);
+  }
+
+  void evacuate_references(HeapObject *object) {
+    for (u32 i = 0; i < object->reference_slots; ++i) {
+      object->slots()[i] = evacuate(object->slots()[i]);
+    }
+  }
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+
+struct VM;
+struct Assembler;
+
+// Emits the inline expansion of a host function. It reads its arguments from
+// the given VM registers and leaves the result in Assembler::Reg::R0.
+typedef void (*Intrinsic)(Assembler &assembler, const std::vector<VM_Register> &arguments);
+
+// A native function callable from Programs. Arguments and results are plain
+// VM_Values; the function may optionally take the calling VM as its first
+// parameter. Host functions are not safepoints and must not allocate on the
+// VM heap.
+struct HostFunction {
+  typedef void (*Pointer)();
+  typedef VM_Value (*Invoker)(Pointer function, VM &vm, const VM_Value *arguments);
+
+  // System V passes at most six integer arguments in registers.
+  static constexpr size_t max_arguments = 6;
+
+  std::string name;
+  Pointer function{};
+  Invoker invoke{};
+  u32 argument_count{};
+  bool takes_vm{};
+  bool returns_value{};
+  Intrinsic intrinsic{};
+};
+
+template <typename T>
+constexpr bool is_host_value_v = std::is_same_v<T, VM_Value>;
+
+template <typename Return, typename... Args, size_t... I>
+VM_Value invoke_host(HostFunction::Pointer function, VM &, const VM_Value *arguments,
+                     std::index_sequence<I...>) {
+  auto *typed = reinterpret_cast<Return (*)(Args...)>(function);
+  if constexpr (std::is_void_v<Return>) {
+    typed(arguments[I]...);
+    return 0;
+  } else {
+    return typed(arguments[I]...);
+  }
+}
+
+template <typename Return, typename... Args, size_t... I>
+VM_Value invoke_host_with_vm(HostFunction::Pointer function, VM &vm, const VM_Value *arguments,
+                             std::index_sequence<I...>) {
+  auto *typed = reinterpret_cast<Return (*)(VM &, Args...)>(function);
+  if constexpr (std::is_void_v<Return>) {
+    typed(vm, arguments[I]...);
+    return 0;
+  } else {
+    return typed(vm, arguments[I]...);
+  }
+}
+
+struct HostRegistry {
+  std::vector<std::unique_ptr<HostFunction>> functions;
+
+  template <typename Return, typename... Args>
+  HostFunction &register_function(std::string name, Return (*function)(Args...),
+                                  Intrinsic intrinsic = nullptr) {
+    static_assert((is_host_value_v<Args> && ...), "Host arguments must be VM_Values");
+    // JIT code takes all of RAX, whose upper half is undefined for narrower
+    // return types.
+    static_assert(is_host_value_v<Return> || std::is_void_v<Return>,
+                  "Host results must be VM_Values");
+    static_assert(sizeof...(Args) <= HostFunction::max_arguments, "Too many host arguments");
+    return add(std::move(name), reinterpret_cast<HostFunction::Pointer>(function),
+               [](HostFunction::Pointer function, VM &vm, const VM_Value *arguments) {
+                 return invoke_host<Return, Args...>(function, vm, arguments,
+                                                     std::index_sequence_for<Args...>{});
+               },
+               sizeof...(Args), false, !std::is_void_v<Return>, intrinsic);
+  }
+
+  template <typename Return, typename... Args>
+  HostFunction &register_function(std::string name, Return (*function)(VM &, Args...),
+                                  Intrinsic intrinsic = nullptr) {
+    static_assert((is_host_value_v<Args> && ...), "Host arguments must be VM_Values");
+    // JIT code takes all of RAX, whose upper half is undefined for narrower
+    // return types.
+    static_assert(is_host_value_v<Return> || std::is_void_v<Return>,
+                  "Host results must be VM_Values");
+    static_assert(sizeof...(Args) < HostFunction::max_arguments, "Too many host arguments");
+    return add(std::move(name), reinterpret_cast<HostFunction::Pointer>(function),
+               [](HostFunction::Pointer function, VM &vm, const VM_Value *arguments) {
+                 return invoke_host_with_vm<Return, Args...>(function, vm, arguments,
+                                                             std::index_sequence_for<Args...>{});
+               },
+               sizeof...(Args), true, !std::is_void_v<Return>, intrinsic);
+  }
+
+  const HostFunction &find(const std::string &name) const {
+    for (const auto &function : functions) {
+      if (function->name == name) {
+        return *function;
+      }
+    }
+    throw std::runtime_error("Unknown host function: " + name);
+  }
+
+ private:
+  HostFunction &add(std::string name, HostFunction::Pointer function, HostFunction::Invoker invoke,
+                    u32 argument_count, bool takes_vm, bool returns_value, Intrinsic intrinsic) {
+    auto host            = std::make_unique<HostFunction>();
+    host->name           = std::move(name);
+    host->function       = function;
+    host->invoke         = invoke;
+    host->argument_count = argument_count;
+    host->takes_vm       = takes_vm;
+    host->returns_value  = returns_value;
+    host->intrinsic      = intrinsic;
+    functions.push_back(std::move(host));
+    return *functions.back();
+  }
+};
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "vm.h"
+#include "x86_decoder.h"
+
+// Shows what the JIT made of a Program: every VM instruction followed by the
+// machine code compiled for it, with byte counts and, given samples from
+// Profiler::jit_samples, where the time went.
+//
+//   auto executable = Jit::compile(program);
+//   JitListing::dump(program, executable, &samples);
+//
+// `write_mca` exports the same code as assembly for llvm-mca, with each
+// (hot) block as an analysis region:
+//
+//   llvm-mca -mcpu=native fib.s
+struct JitListing {
+  // Per (block index, instruction index).
+  using Samples = std::map<std::pair<u32, u32>, u64>;
+
+  static void dump(const Program &program, const Executable &executable,
+                   const Samples *samples = nullptr) {
+    auto code         = static_cast<const u8 *>(executable.data);
+    auto instructions = X86Decoder::decode_all(code, executable.code_size);
+    u64 total         = samples ? std::max<u64>(total_samples(*samples), 1) : 1;
+    size_t next       = 0;
+
+    auto print_code = [&](size_t end) {
+      for (; next < instructions.size() && instructions[next].offset < end; ++next) {
+        const auto &instruction = instructions[next];
+        char bytes[3 * 16 + 1]  = {};
+        for (size_t i = 0; i < instruction.length && i < 16; ++i) {
+          std::snprintf(bytes + 3 * i, 4, "%02x ", code[instruction.offset + i]);
+        }
+        std::printf("      %06zx  %-31s %s\n", instruction.offset, bytes,
+                    instruction.text.c_str());
+      }
+    };
+
+    std::printf("prologue (%zu bytes):\n", block_start(executable, 0));
+    print_code(block_start(executable, 0));
+
+    size_t location = 0;
+    for (const auto &block : program.blocks) {
+      u32 index         = block->index;
+      size_t end        = block_start(executable, index + 1);
+      u64 block_samples = 0;
+      if (samples) {
+        for (auto it = samples->lower_bound({index, 0});
+             it != samples->end() && it->first.first == index; ++it) {
+          block_samples += it->second;
+        }
+      }
+      std::printf("block %u (%p): %zu bytes", index, static_cast<const void *>(block.get()),
+                  end - block_start(executable, index));
+      if (samples) {
+        std::printf(", %lu samples (%.1f%%)", block_samples, 100.0 * block_samples / total);
+      }
+      std::printf("\n");
+
+      for (; location < executable.locations.size() &&
+             executable.locations[location].block == index;
+           ++location) {
+        const auto &current = executable.locations[location];
+        print_code(current.offset);
+        size_t instruction_end = location + 1 < executable.locations.size() &&
+                                         executable.locations[location + 1].block == index
+                                     ? executable.locations[location + 1].offset
+                                     : end;
+        std::printf("  %5zu bytes", instruction_end - current.offset);
+        if (samples) {
+          auto it   = samples->find({index, current.instruction});
+          u64 count = it == samples->end() ? 0 : it->second;
+          std::printf(" %10lu %5.1f%%", count, 100.0 * count / total);
+        }
+        std::printf(" | ");
+        block->instructions[current.instruction]->dump();
+      }
+      print_code(end);
+    }
+  }
+
+  // Intel syntax that llvm-mc assembles: jump targets become labels, and
+  // every block whose share of `samples` is at least `min_share` (every
+  // block, without samples) is wrapped in LLVM-MCA-BEGIN/END markers.
+  static void write_mca(FILE *out, const Program &program, const Executable &executable,
+                        const Samples *samples = nullptr, double min_share = 0.01) {
+    auto code         = static_cast<const u8 *>(executable.data);
+    auto instructions = X86Decoder::decode_all(code, executable.code_size);
+
+    std::vector<bool> labels(executable.code_size + 1);
+    for (const auto &instruction : instructions) {
+      if (instruction.has_target && instruction.target <= executable.code_size) {
+        labels[instruction.target] = true;
+      }
+    }
+
+    std::vector<bool> hot(program.blocks.size(), true);
+    if (samples) {
+      u64 total = std::max<u64>(total_samples(*samples), 1);
+      std::vector<u64> block_samples(program.blocks.size());
+      for (const auto &[key, count] : *samples) {
+        if (key.first < block_samples.size()) {
+          block_samples[key.first] += count;
+        }
+      }
+      for (size_t i = 0; i < hot.size(); ++i) {
+        hot[i] = block_samples[i] > 0 && double(block_samples[i]) / total >= min_share;
+      }
+    }
+
+    std::fprintf(out, ".intel_syntax noprefix\n");
+    std::string name = program.name.empty() ? "program" : program.name;
+    u32 block        = 0;
+    bool in_region   = false;
+    for (const auto &instruction : instructions) {
+      // Blocks are laid out in order, so a region ends where the next
+      // block starts.
+      while (block < program.blocks.size() &&
+             block_start(executable, block) <= instruction.offset) {
+        if (in_region) {
+          std::fprintf(out, "# LLVM-MCA-END\n");
+        }
+        // llvm-mca rejects empty regions.
+        in_region = hot[block] &&
+                    block_start(executable, block + 1) > block_start(executable, block);
+        if (in_region) {
+          std::fprintf(out, "# LLVM-MCA-BEGIN %s:block%u\n", name.c_str(), block);
+        }
+        ++block;
+      }
+      if (labels[instruction.offset]) {
+        std::fprintf(out, ".L%zx:\n", instruction.offset);
+      }
+      if (instruction.has_target) {
+        auto mnemonic = instruction.text.substr(0, instruction.text.find(' '));
+        std::fprintf(out, "  %s .L%zx\n", mnemonic.c_str(), instruction.target);
+      } else {
+        std::fprintf(out, "  %s\n", instruction.text.c_str());
+      }
+    }
+    if (in_region) {
+      std::fprintf(out, "# LLVM-MCA-END\n");
+    }
+    if (labels[executable.code_size]) {
+      std::fprintf(out, ".L%zx:\n", executable.code_size);
+    }
+  }
+
+ private:
+  // Past the last block, the end of the code.
+  static size_t block_start(const Executable &executable, size_t block) {
+    return block < executable.block_offsets.size() ? executable.block_offsets[block]
+                                                   : executable.code_size;
+  }
+
+  static u64 total_samples(const Samples &samples) {
+    u64 total = 0;
+    for (const auto &[key, count] : samples) {
+      total += count;
+    }
+    return total;
+  }
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+
+#include "common.h"
+
+// Minimal streaming JSON writer: enough for benchmark and profile records.
+struct JsonWriter {
+  FILE *out;
+  // Set after every complete value, so the next one is preceded by a comma.
+  bool needs_comma{};
+
+  void begin_object() { open('{'); }
+  void begin_object(const char *key) {
+    write_key(key);
+    open('{');
+  }
+  void end_object() { close('}'); }
+
+  void begin_array(const char *key) {
+    write_key(key);
+    open('[');
+  }
+  void end_array() { close(']'); }
+
+  void field(const char *key, const std::string &value) {
+    write_key(key);
+    std::fputc('"', out);
+    for (char c : value) {
+      if (c == '"' || c == '\\') {
+        std::fputc('\\', out);
+      }
+      std::fputc(c, out);
+    }
+    std::fputc('"', out);
+    needs_comma = true;
+  }
+
+  void field(const char *key, double value) {
+    write_key(key);
+    std::fprintf(out, std::isfinite(value) ? "%.17g" : "null", value);
+    needs_comma = true;
+  }
+
+  void field(const char *key, u64 value) {
+    write_key(key);
+    std::fprintf(out, "%lu", value);
+    needs_comma = true;
+  }
+
+  // Any type with `void write_json(JsonWriter &) const` that writes one
+  // value.
+  template <typename T>
+  auto field(const char *key, const T &value) -> decltype(value.write_json(*this)) {
+    write_key(key);
+    value.write_json(*this);
+  }
+
+ private:
+  void write_key(const char *key) {
+    if (needs_comma) {
+      std::fputc(',', out);
+    }
+    std::fprintf(out, "\"%s\":", key);
+    needs_comma = false;
+  }
+
+  void open(char c) {
+    if (needs_comma) {
+      std::fputc(',', out);
+    }
+    std::fputc(c, out);
+    needs_comma = false;
+  }
+
+  void close(char c) {
+    std::fputc(c, out);
+    needs_comma = true;
+  }
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "ast_image.h"
+
+// The functions of an AST image, each read into Ast nodes on its first call
+// and kept for later ones. Opening a script only scans the function table
+// and names, so startup scales with the functions a run uses rather than
+// with the whole script.
+//
+//   LazyScript script(AstImage::map("script.asti"));
+//   int result = script.call("main");
+//
+// Not thread-safe, like AstInterpreter.
+struct LazyScript {
+  explicit LazyScript(AstImage image)
+      : image(std::move(image)), functions(this->image.function_count()) {
+    names.reserve(functions.size());
+    for (u32 i = 0; i < functions.size(); ++i) {
+      // Keys point into the image. The first of two same-named functions wins.
+      names.emplace(this->image.function_name(i), i);
+    }
+  }
+
+  // Null if the script has no function called `name`.
+  const Ast::FunctionDeclaration *find(std::string_view name) {
+    auto it = names.find(name);
+    return it == names.end() ? nullptr : &function(it->second);
+  }
+
+  const Ast::FunctionDeclaration &function(u32 index) {
+    auto &function = functions.at(index);
+    if (!function) {
+      function = image.read_function(index);
+      loaded++;
+    }
+    return *function;
+  }
+
+  int call(std::string_view name) {
+    auto *function = find(name);
+    if (!function) {
+      throw std::runtime_error("Unknown function " + std::string(name));
+    }
+    return AstInterpreter().interpret(*function);
+  }
+
+  size_t function_count() const { return functions.size(); }
+  // Functions read into Ast nodes so far.
+  size_t loaded_count() const { return loaded; }
+
+ private:
+  AstImage image;
+  std::vector<std::unique_ptr<Ast::FunctionDeclaration>> functions;
+  std::unordered_map<std::string_view, u32> names;
+  size_t loaded{};
+};
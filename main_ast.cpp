@@ -15,6 +15,7 @@
 // }
 
 #include "ast.h"
+#include "ast_compiler.h"
 
 int main() {
   // begin function declaration
@@ -57,4 +58,5 @@ int main() {
 
   function_decl->dump(std::cout);
   std::cout << AstInterpreter().interpret(*function_decl) << std::endl;
+  std::cout << AstCompiler::compile(*function_decl)() << std::endl;
 }
\ No newline at end of file
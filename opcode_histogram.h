@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "json_writer.h"
+#include "vm.h"
+
+// Dynamic execution counts from VM::interpret, per opcode, per pair of
+// consecutive opcodes and per block: the input for superinstruction,
+// quickening and JIT priority decisions. Pass it as the hooks argument:
+//
+//   OpcodeHistogram histogram;
+//   vm.interpret(program, histogram);
+//
+// A histogram must only be used by one thread at a time; `merge` combines
+// per-thread ones. `global()` is reported when the process exits, as a
+// table on stderr and, when VM_OPCODE_HISTOGRAM names a file, as JSON.
+struct OpcodeHistogram {
+  static constexpr size_t types = Instruction::type_count;
+
+  struct ProgramCounts {
+    std::string name;
+    std::vector<u64> blocks;
+  };
+
+  u64 opcodes[types]{};
+  // pairs[first][second]: `second` executed right after `first`, across
+  // jumps but not across separate interpret calls.
+  u64 pairs[types][types]{};
+  // Keyed by Program address; the name is copied so reports still work
+  // after the Program is gone.
+  std::unordered_map<const Program *, ProgramCounts> programs;
+
+  static OpcodeHistogram &global();
+
+  void begin(const Program &program) {
+    auto &counts = programs[&program];
+    if (counts.name.empty()) {
+      counts.name = program.name.empty() ? "program" : program.name;
+    }
+    counts.blocks.resize(std::max(counts.blocks.size(), program.blocks.size()));
+    current  = &counts;
+    previous = types;
+  }
+
+  void enter_block(const BasicBlock &block) { current->blocks[block.index]++; }
+
+  void execute(const Instruction &instruction) {
+    auto type = size_t(instruction.type);
+    opcodes[type]++;
+    if (previous != types) {
+      pairs[previous][type]++;
+    }
+    previous = type;
+  }
+
+  void branch(const BasicBlock &, bool) {}
+
+  void merge(const OpcodeHistogram &other) {
+    for (size_t i = 0; i < types; ++i) {
+      opcodes[i] += other.opcodes[i];
+      for (size_t j = 0; j < types; ++j) {
+        pairs[i][j] += other.pairs[i][j];
+      }
+    }
+    for (const auto &[program, counts] : other.programs) {
+      auto &mine = programs[program];
+      mine.name  = counts.name;
+      mine.blocks.resize(std::max(mine.blocks.size(), counts.blocks.size()));
+      for (size_t i = 0; i < counts.blocks.size(); ++i) {
+        mine.blocks[i] += counts.blocks[i];
+      }
+    }
+  }
+
+  u64 total() const {
+    u64 sum = 0;
+    for (auto count : opcodes) {
+      sum += count;
+    }
+    return sum;
+  }
+
+  // Sorted tables, the `limit` most frequent rows of each.
+  void dump(FILE *out, size_t limit = 20) const {
+    u64 executed = std::max<u64>(total(), 1);
+
+    std::fprintf(out, "Opcodes (%lu executed):\n", total());
+    for (const auto &row : top(opcode_rows(), types)) {
+      std::fprintf(out, "  %-24s %14lu %6.2f%%\n", row.name.c_str(), row.count,
+                   100.0 * row.count / executed);
+    }
+
+    std::fprintf(out, "Opcode pairs:\n");
+    for (const auto &row : top(pair_rows(), limit)) {
+      std::fprintf(out, "  %-40s %14lu %6.2f%%\n", row.name.c_str(), row.count,
+                   100.0 * row.count / executed);
+    }
+
+    std::fprintf(out, "Blocks:\n");
+    for (const auto &row : top(block_rows(), limit)) {
+      std::fprintf(out, "  %-40s %14lu\n", row.name.c_str(), row.count);
+    }
+  }
+
+  void write_json(FILE *out) const {
+    JsonWriter json{out};
+    json.begin_object();
+    json.field("executed", total());
+    write_rows(json, "opcodes", top(opcode_rows(), types));
+    write_rows(json, "pairs", top(pair_rows(), types * types));
+    auto blocks = block_rows();
+    write_rows(json, "blocks", top(blocks, blocks.size()));
+    json.end_object();
+    std::fputc('\n', out);
+  }
+
+ private:
+  struct Row {
+    std::string name;
+    u64 count;
+  };
+
+  std::vector<Row> opcode_rows() const {
+    std::vector<Row> rows;
+    for (size_t i = 0; i < types; ++i) {
+      if (opcodes[i]) {
+        rows.push_back({to_string(Instruction::Type(i)), opcodes[i]});
+      }
+    }
+    return rows;
+  }
+
+  std::vector<Row> pair_rows() const {
+    std::vector<Row> rows;
+    for (size_t i = 0; i < types; ++i) {
+      for (size_t j = 0; j < types; ++j) {
+        if (pairs[i][j]) {
+          rows.push_back({std::string(to_string(Instruction::Type(i))) + " -> " +
+                              to_string(Instruction::Type(j)),
+                          pairs[i][j]});
+        }
+      }
+    }
+    return rows;
+  }
+
+  std::vector<Row> block_rows() const {
+    std::vector<Row> rows;
+    for (const auto &[program, counts] : programs) {
+      for (size_t i = 0; i < counts.blocks.size(); ++i) {
+        if (counts.blocks[i]) {
+          rows.push_back({counts.name + ":block" + std::to_string(i), counts.blocks[i]});
+        }
+      }
+    }
+    return rows;
+  }
+
+  static std::vector<Row> top(std::vector<Row> rows, size_t limit) {
+    std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) {
+      return a.count != b.count ? a.count > b.count : a.name < b.name;
+    });
+    rows.resize(std::min(rows.size(), limit));
+    return rows;
+  }
+
+  static void write_rows(JsonWriter &json, const char *key, const std::vector<Row> &rows) {
+    json.begin_array(key);
+    for (const auto &row : rows) {
+      json.begin_object();
+      json.field("name", row.name);
+      json.field("count", row.count);
+      json.end_object();
+    }
+    json.end_array();
+  }
+
+  ProgramCounts *current{};
+  size_t previous{types};
+};
+
+inline OpcodeHistogram &OpcodeHistogram::global() {
+  // Reports from its destructor, during static destruction.
+  static struct Reporter {
+    OpcodeHistogram histogram;
+
+    ~Reporter() {
+      if (!histogram.total()) {
+        return;
+      }
+      histogram.dump(stderr);
+      if (const char *path = std::getenv("VM_OPCODE_HISTOGRAM")) {
+        if (FILE *out = std::fopen(path, "w")) {
+          histogram.write_json(out);
+          std::fclose(out);
+        }
+      }
+    }
+  } reporter;
+  return reporter.histogram;
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+
+// Hardware counters for one measured region, read as a single perf_event
+// group so they are scheduled together. Counters the kernel or the CPU does
+// not provide (containers, VMs, perf_event_paranoid) are simply missing
+// from the result; when none are available `available()` is false and
+// `measure` still runs the code.
+struct PerfCounters {
+  enum Counter {
+    Cycles,
+    Instructions,
+    BranchMisses,
+    L1InstructionMisses,
+    L1DataMisses,
+    CounterCount,
+  };
+
+  struct Result {
+    bool valid[CounterCount]{};
+    u64 values[CounterCount]{};
+    // Fraction of the region the group was actually on the PMU.
+    double running_fraction{};
+
+    bool has(Counter counter) const { return valid[counter]; }
+
+    double ipc() const {
+      if (!has(Cycles) || !has(Instructions) || !values[Cycles]) {
+        return 0;
+      }
+      return double(values[Instructions]) / double(values[Cycles]);
+    }
+
+    // Cost of `counter` per executed guest (VM or AST) instruction.
+    double per_guest_instruction(Counter counter, u64 guest_instructions) const {
+      if (!has(counter) || !guest_instructions) {
+        return 0;
+      }
+      return double(values[counter]) / double(guest_instructions);
+    }
+
+    void dump(const char *label, u64 guest_instructions = 0) const {
+      std::printf("%s:\n", label);
+      bool any = false;
+      for (int i = 0; i < CounterCount; ++i) {
+        if (!valid[i]) {
+          continue;
+        }
+        any = true;
+        std::printf("  %-24s %14lu", name(Counter(i)), values[i]);
+        if (guest_instructions) {
+          std::printf("  %10.3f / guest instruction",
+                      per_guest_instruction(Counter(i), guest_instructions));
+        }
+        std::printf("\n");
+      }
+      if (!any) {
+        std::printf("  hardware counters unavailable\n");
+        return;
+      }
+      if (has(Cycles) && has(Instructions)) {
+        std::printf("  %-24s %14.3f\n", "ipc", ipc());
+      }
+      if (running_fraction < 1) {
+        std::printf("  (multiplexed, scaled from %.1f%% of the run)\n", running_fraction * 100);
+      }
+    }
+  };
+
+  PerfCounters() {
+    for (int i = 0; i < CounterCount; ++i) {
+      open_counter(Counter(i));
+    }
+  }
+
+  PerfCounters(const PerfCounters &)            = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  ~PerfCounters() {
+    for (auto &[counter, fd] : counters) {
+      close(fd);
+    }
+  }
+
+  bool available() const { return !counters.empty(); }
+
+  template <typename F>
+  Result measure(F &&f) {
+    if (!available()) {
+      f();
+      return Result{};
+    }
+    int leader = counters.front().second;
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    f();
+    ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    return read_group();
+  }
+
+  static const char *name(Counter counter) {
+    switch (counter) {
+      case Cycles:
+        return "cycles";
+      case Instructions:
+        return "instructions";
+      case BranchMisses:
+        return "branch-misses";
+      case L1InstructionMisses:
+        return "L1-icache-load-misses";
+      case L1DataMisses:
+        return "L1-dcache-load-misses";
+      case CounterCount:
+        break;
+    }
+    return "unknown";
+  }
+
+ private:
+  static u64 cache_config(u64 cache, u64 op, u64 result) {
+    return cache | (op << 8) | (result << 16);
+  }
+
+  void open_counter(Counter counter) {
+    perf_event_attr attr{};
+    attr.size           = sizeof(attr);
+    attr.disabled       = counters.empty() ? 1 : 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.read_format =
+        PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    switch (counter) {
+      case Cycles:
+        attr.type   = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+      case Instructions:
+        attr.type   = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+      case BranchMisses:
+        attr.type   = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+      case L1InstructionMisses:
+        attr.type   = PERF_TYPE_HW_CACHE;
+        attr.config = cache_config(PERF_COUNT_HW_CACHE_L1I, PERF_COUNT_HW_CACHE_OP_READ,
+                                   PERF_COUNT_HW_CACHE_RESULT_MISS);
+        break;
+      case L1DataMisses:
+        attr.type   = PERF_TYPE_HW_CACHE;
+        attr.config = cache_config(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                                   PERF_COUNT_HW_CACHE_RESULT_MISS);
+        break;
+      case CounterCount:
+        return;
+    }
+
+    int group = counters.empty() ? -1 : counters.front().second;
+    int fd    = narrow_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+    if (fd >= 0) {
+      counters.emplace_back(counter, fd);
+    }
+  }
+
+  Result read_group() {
+    // nr, time_enabled, time_running, then one value per counter.
+    std::vector<u64> data(3 + counters.size());
+    Result result;
+    if (read(counters.front().second, data.data(), data.size() * sizeof(u64)) <= 0) {
+      return result;
+    }
+
+    u64 enabled             = data[1];
+    u64 running             = data[2];
+    result.running_fraction = enabled ? double(running) / double(enabled) : 0;
+    // Never scheduled: the zeros are not measurements.
+    if (!running) {
+      return result;
+    }
+    for (size_t i = 0; i < counters.size() && i < data[0]; ++i) {
+      u64 value = data[3 + i];
+      if (running < enabled) {
+        value = u64(double(value) * double(enabled) / double(running));
+      }
+      result.valid[counters[i].first]  = true;
+      result.values[counters[i].first] = value;
+    }
+    return result;
+  }
+
+  // The first entry is the group leader.
+  std::vector<std::pair<Counter, int>> counters;
+};
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// Tells `perf` about JIT code. Two independent outputs:
+//
+//   /tmp/perf-<pid>.map   one "start size name" line per Executable, read by
+//                         `perf report` directly.
+//   /tmp/jit-<pid>.dump   the jitdump format with code bytes and line tables,
+//                         merged by `perf inject --jit` for `perf annotate`.
+//
+// Both are off by default. They can be enabled from code or with the
+// VM_PERF_MAP / VM_PERF_JITDUMP environment variables.
+struct PerfJit {
+  // Machine code address -> line in the Program::dump listing.
+  struct LineEntry {
+    u64 address;
+    u32 line;
+    u32 block;
+  };
+
+  static_assert(sizeof(LineEntry) == 16, "LineEntry is written as a jitdump debug entry");
+
+  static PerfJit &instance() {
+    static PerfJit perf;
+    return perf;
+  }
+
+  bool enabled() const { return map_file || dump_file; }
+
+  void enable_map() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (map_file) {
+      return;
+    }
+    auto path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    map_file  = std::fopen(path.c_str(), "w");
+  }
+
+  void enable_jitdump() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (dump_file) {
+      return;
+    }
+    auto path = "/tmp/jit-" + std::to_string(getpid()) + ".dump";
+    int fd    = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+    if (fd < 0) {
+      return;
+    }
+    // perf record only finds the dump through an executable mapping of it.
+    marker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    if (marker == MAP_FAILED) {
+      close(fd);
+      return;
+    }
+    dump_file = fdopen(fd, "wb");
+
+    FileHeader header{};
+    header.magic      = 0x4A695444;
+    header.version    = 1;
+    header.total_size = sizeof(FileHeader);
+    header.elf_mach   = 62;  // EM_X86_64
+    header.pid        = narrow_cast<u32>(getpid());
+    header.timestamp  = timestamp();
+    std::fwrite(&header, sizeof(header), 1, dump_file);
+    std::fflush(dump_file);
+  }
+
+  void code_loaded(const void *code, size_t size, const std::string &name,
+                   const std::string &source, const std::vector<LineEntry> &lines) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (map_file) {
+      std::fprintf(map_file, "%lx %lx %s\n", reinterpret_cast<u64>(code), size, name.c_str());
+      std::fflush(map_file);
+    }
+    if (dump_file) {
+      write_debug_info(code, source, lines);
+      write_code_load(code, size, name);
+      std::fflush(dump_file);
+    }
+  }
+
+  ~PerfJit() {
+    if (map_file) {
+      std::fclose(map_file);
+    }
+    if (dump_file) {
+      std::fclose(dump_file);
+      munmap(marker, sysconf(_SC_PAGESIZE));
+    }
+  }
+
+ private:
+  PerfJit() {
+    if (std::getenv("VM_PERF_MAP")) {
+      enable_map();
+    }
+    if (std::getenv("VM_PERF_JITDUMP")) {
+      enable_jitdump();
+    }
+  }
+
+  struct FileHeader {
+    u32 magic;
+    u32 version;
+    u32 total_size;
+    u32 elf_mach;
+    u32 pad1;
+    u32 pid;
+    u64 timestamp;
+    u64 flags;
+  };
+
+  struct RecordHeader {
+    u32 id;
+    u32 total_size;
+    u64 timestamp;
+  };
+
+  enum : u32 {
+    JIT_CODE_LOAD       = 0,
+    JIT_CODE_DEBUG_INFO = 2,
+  };
+
+  // perf record uses CLOCK_MONOTONIC for jitdump timestamps (-k 1).
+  static u64 timestamp() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return u64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  void write_code_load(const void *code, size_t size, const std::string &name) {
+    struct {
+      u32 pid;
+      u32 tid;
+      u64 vma;
+      u64 code_address;
+      u64 code_size;
+      u64 code_index;
+    } load{};
+    load.pid          = narrow_cast<u32>(getpid());
+    load.tid          = narrow_cast<u32>(syscall(SYS_gettid));
+    load.vma          = reinterpret_cast<u64>(code);
+    load.code_address = reinterpret_cast<u64>(code);
+    load.code_size    = size;
+    load.code_index   = code_index++;
+
+    RecordHeader header{};
+    header.id         = JIT_CODE_LOAD;
+    header.total_size = narrow_cast<u32>(sizeof(header) + sizeof(load) + name.size() + 1 + size);
+    header.timestamp  = timestamp();
+    std::fwrite(&header, sizeof(header), 1, dump_file);
+    std::fwrite(&load, sizeof(load), 1, dump_file);
+    std::fwrite(name.c_str(), name.size() + 1, 1, dump_file);
+    std::fwrite(code, size, 1, dump_file);
+  }
+
+  // Must precede the code load record it describes.
+  void write_debug_info(const void *code, const std::string &source,
+                        const std::vector<LineEntry> &lines) {
+    if (lines.empty()) {
+      return;
+    }
+
+    RecordHeader header{};
+    header.id         = JIT_CODE_DEBUG_INFO;
+    header.total_size = narrow_cast<u32>(sizeof(header) + 2 * sizeof(u64) +
+                                         lines.size() * (sizeof(LineEntry) + source.size() + 1));
+    header.timestamp  = timestamp();
+    std::fwrite(&header, sizeof(header), 1, dump_file);
+
+    u64 address = reinterpret_cast<u64>(code);
+    u64 count   = lines.size();
+    std::fwrite(&address, sizeof(address), 1, dump_file);
+    std::fwrite(&count, sizeof(count), 1, dump_file);
+    for (const auto &line : lines) {
+      // The block index goes into the discriminator.
+      std::fwrite(&line, sizeof(line), 1, dump_file);
+      std::fwrite(source.c_str(), source.size() + 1, 1, dump_file);
+    }
+  }
+
+  std::mutex mutex;
+  FILE *map_file{};
+  FILE *dump_file{};
+  void *marker{MAP_FAILED};
+  u64 code_index{};
+};
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "vm.h"
+
+// In-process sampling profiler. A SIGPROF timer interrupts whichever thread
+// is burning CPU; the handler reads that thread's ExecutionPosition and, for
+// JIT code, maps the interrupted pc through the Executable's locations. Each
+// thread aggregates into its own fixed-size table without locks, and
+// `write_folded` merges them into folded stacks for flamegraph.pl.
+//
+// The interpreter publishes which instruction it is at only when run with
+// ProfilerHooks, so uninstrumented interpretation pays nothing for it:
+//
+//   ProfilerHooks hooks;
+//   vm.interpret(program, hooks);
+struct Profiler {
+  enum class Tier : u8 {
+    Host,         // outside any VM
+    Interpreter,  // VM::interpret
+    Jit,          // inside JIT code
+    JitRuntime,   // a host or runtime call made from JIT code
+  };
+
+  // Open addressing table written only by the signal handler of its thread.
+  // `program` is stored last with release so readers see complete entries.
+  struct SampleTable {
+    static constexpr size_t capacity = 4096;
+
+    struct Entry {
+      std::atomic<const Program *> program{};
+      const BasicBlock *block{};
+      u32 instruction{};
+      Tier tier{};
+      std::atomic<u64> count{};
+    };
+
+    Entry entries[capacity];
+    std::atomic<u64> host_samples{};
+    std::atomic<u64> dropped{};
+
+    // Async-signal-safe: no allocation, no locks.
+    void record(const Program *program, const BasicBlock *block, u32 instruction, Tier tier) {
+      if (!program) {
+        host_samples.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      size_t hash = (reinterpret_cast<uintptr_t>(block) >> 4) * 31 + instruction * 7 +
+                    narrow_cast<size_t>(tier);
+      for (size_t probe = 0; probe < capacity; ++probe) {
+        auto &entry = entries[(hash + probe) % capacity];
+        auto *owner = entry.program.load(std::memory_order_acquire);
+        if (!owner) {
+          entry.block       = block;
+          entry.instruction = instruction;
+          entry.tier        = tier;
+          entry.count.store(1, std::memory_order_relaxed);
+          entry.program.store(program, std::memory_order_release);
+          return;
+        }
+        if (owner == program && entry.block == block && entry.instruction == instruction &&
+            entry.tier == tier) {
+          entry.count.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+      }
+      dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+  };
+
+  static Profiler &instance() {
+    static Profiler profiler;
+    return profiler;
+  }
+
+  // Every thread that runs guest code has to attach before it is sampled;
+  // the handler cannot allocate its table.
+  void attach_thread() {
+    if (thread_table) {
+      return;
+    }
+    auto table = std::make_unique<SampleTable>();
+    std::lock_guard<std::mutex> lock(mutex);
+    thread_table = table.get();
+    tables.push_back(std::move(table));
+  }
+
+  void start(int frequency_hz = 997) {
+    attach_thread();
+
+    struct sigaction action {};
+    action.sa_sigaction = &Profiler::handle_signal;
+    action.sa_flags     = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &previous_action);
+
+    itimerval timer{};
+    timer.it_interval.tv_usec = 1000000 / frequency_hz;
+    timer.it_value            = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+  }
+
+  void stop() {
+    itimerval timer{};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    sigaction(SIGPROF, &previous_action, nullptr);
+  }
+
+  // One line per (program, tier, block, instruction):
+  //   <program>;<tier>;block<N>;<index>:<Opcode> <samples>
+  // Programs must still be alive when this is called.
+  void write_folded(std::ostream &os) {
+    std::map<std::string, u64> stacks;
+    u64 host    = 0;
+    u64 dropped = 0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &table : tables) {
+      host += table->host_samples.load(std::memory_order_relaxed);
+      dropped += table->dropped.load(std::memory_order_relaxed);
+      for (const auto &entry : table->entries) {
+        auto *program = entry.program.load(std::memory_order_acquire);
+        if (!program) {
+          continue;
+        }
+        stacks[frame_name(*program, entry.block, entry.instruction, entry.tier)] +=
+            entry.count.load(std::memory_order_relaxed);
+      }
+    }
+
+    for (const auto &[stack, count] : stacks) {
+      os << stack << " " << count << "\n";
+    }
+    if (host) {
+      os << "[host] " << host << "\n";
+    }
+    if (dropped) {
+      os << "[dropped] " << dropped << "\n";
+    }
+  }
+
+  // JIT samples of `program` per (block index, instruction index), the
+  // input for JitListing.
+  std::map<std::pair<u32, u32>, u64> jit_samples(const Program &program) {
+    std::map<std::pair<u32, u32>, u64> samples;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &table : tables) {
+      for (const auto &entry : table->entries) {
+        if (entry.program.load(std::memory_order_acquire) != &program ||
+            entry.tier != Tier::Jit || !entry.block) {
+          continue;
+        }
+        samples[{entry.block->index, entry.instruction}] +=
+            entry.count.load(std::memory_order_relaxed);
+      }
+    }
+    return samples;
+  }
+
+ private:
+  Profiler() = default;
+
+  static const char *to_string(Tier tier) {
+    switch (tier) {
+      case Tier::Host:
+        return "host";
+      case Tier::Interpreter:
+        return "interpreter";
+      case Tier::Jit:
+        return "jit";
+      case Tier::JitRuntime:
+        return "jit-runtime";
+    }
+    return "unknown";
+  }
+
+  static std::string frame_name(const Program &program, const BasicBlock *block, u32 instruction,
+                                Tier tier) {
+    std::string name = program.name.empty() ? "program" : program.name;
+    name += ";";
+    name += to_string(tier);
+    if (!block) {
+      return name;
+    }
+    name += ";block" + std::to_string(block->index);
+    if (instruction < block->instructions.size()) {
+      name += ";" + std::to_string(instruction) + ":";
+      name += ::to_string(block->instructions[instruction]->type);
+    }
+    return name;
+  }
+
+  static void handle_signal(int, siginfo_t *, void *context) {
+    int saved_errno = errno;
+    if (auto *table = thread_table) {
+      sample(*table, static_cast<ucontext_t *>(context));
+    }
+    errno = saved_errno;
+  }
+
+  static void sample(SampleTable &table, ucontext_t *context) {
+    auto &position = execution_position;
+    auto *program  = position.program.load(std::memory_order_relaxed);
+    if (!program) {
+      table.record(nullptr, nullptr, 0, Tier::Host);
+      return;
+    }
+
+    auto *executable = position.executable.load(std::memory_order_relaxed);
+    if (!executable) {
+      table.record(program, position.block.load(std::memory_order_relaxed),
+                   position.instruction.load(std::memory_order_relaxed), Tier::Interpreter);
+      return;
+    }
+
+    auto pc    = static_cast<u64>(context->uc_mcontext.gregs[REG_RIP]);
+    auto start = reinterpret_cast<u64>(executable->data);
+    if (pc < start || pc >= start + executable->size || executable->locations.empty()) {
+      table.record(program, nullptr, 0, Tier::JitRuntime);
+      return;
+    }
+
+    // Last location starting at or before the pc. The prologue comes before
+    // the first location and is attributed to it.
+    auto offset   = pc - start;
+    auto &located = executable->locations;
+    auto it       = std::upper_bound(
+        located.begin(), located.end(), offset,
+        [](u64 offset, const CodeLocation &location) { return offset < location.offset; });
+    if (it != located.begin()) {
+      --it;
+    }
+    table.record(program, program->blocks[it->block].get(), it->instruction, Tier::Jit);
+  }
+
+  static inline thread_local SampleTable *thread_table{};
+
+  std::mutex mutex;
+  std::vector<std::unique_ptr<SampleTable>> tables;
+  struct sigaction previous_action {};
+};
+
+// Interpreter hooks that publish the current block and instruction to the
+// thread's ExecutionPosition for Profiler.
+struct ProfilerHooks {
+  void begin(const Program &) {}
+
+  // Index first: a sample between the stores still sees a valid pair.
+  void enter_block(const BasicBlock &block) {
+    next_instruction = 0;
+    execution_position.instruction.store(0, std::memory_order_relaxed);
+    execution_position.block.store(&block, std::memory_order_relaxed);
+  }
+
+  void execute(const Instruction &) {
+    execution_position.instruction.store(next_instruction++, std::memory_order_relaxed);
+  }
+
+  void branch(const BasicBlock &, bool) {}
+
+ private:
+  u32 next_instruction{};
+};
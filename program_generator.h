@@ -0,0 +1,229 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#include "vm.h"
+
+// Relative weights of the straight-line instructions the generator emits.
+struct InstructionMix {
+  u32 load_immediate = 2;
+  u32 load           = 1;
+  u32 store          = 2;
+  u32 get_local      = 3;
+  u32 set_local      = 2;
+  u32 increment      = 2;
+  u32 add            = 2;
+  u32 less_than      = 1;
+};
+
+struct ProgramShape {
+  u64 seed = 1;
+  // Approximate; a loop or branch started near the end may add a few.
+  size_t block_count = 1000;
+  // Mean straight-line instructions per block, before the terminator.
+  size_t instructions_per_block = 8;
+  InstructionMix mix;
+  // Chance that a new region is a loop, while below `max_loop_depth`.
+  double loop_density = 0.05;
+  u32 max_loop_depth  = 2;
+  // Mean blocks in a loop body, nested loops included.
+  size_t loop_body_blocks = 8;
+  u64 loop_trip_count     = 3;
+  // Chance that a region is an if or if/else on a data-dependent condition.
+  double branch_density = 0.2;
+  // Registers and locals the program may use; the VM needs at least this
+  // many. Locals below `max_loop_depth` hold loop counters.
+  size_t register_count = 8;
+  size_t local_count    = 8;
+};
+
+// Builds random but valid and terminating Programs: loops only count a
+// reserved local up to `loop_trip_count`, every other edge goes forward.
+// The same shape and seed give the same Program (for a given standard
+// library), so benchmarks can be repeated and compared across builds.
+struct ProgramGenerator {
+  static std::unique_ptr<Program> generate(const ProgramShape &shape) {
+    if (shape.register_count < 3 || shape.local_count <= shape.max_loop_depth) {
+      throw std::runtime_error("Program shape has too few registers or locals");
+    }
+    ProgramGenerator generator(shape);
+    return generator.build();
+  }
+
+ private:
+  // Register 1 holds the left-hand side of generated compares; registers
+  // from 2 on are data.
+  static constexpr VM_Register compare_register = 1;
+
+  explicit ProgramGenerator(const ProgramShape &shape)
+      : shape(shape), program(std::make_unique<Program>()), rng(shape.seed) {}
+
+  std::unique_ptr<Program> build() {
+    program->name = "generated_" + std::to_string(shape.seed);
+    auto *current = &program->make_block();
+
+    // Start from a known state, so repeated runs on one VM do the same work.
+    current->append<LoadImmediate>(VM_Value(0));
+    for (VM_Register reg = 1; reg < shape.register_count; ++reg) {
+      current->append<Store>(reg);
+    }
+    for (VM_Local local = 0; local < shape.local_count; ++local) {
+      current->append<SetLocal>(local);
+    }
+
+    emit_region(current, 0, shape.block_count);
+    current->append<Exit>();
+    return std::move(program);
+  }
+
+  // Appends regions after `current` until the program has `limit` blocks;
+  // `current` is left at the open block that follows them.
+  void emit_region(BasicBlock *&current, u32 depth, size_t limit) {
+    while (program->blocks.size() < limit) {
+      if (depth < shape.max_loop_depth && chance(shape.loop_density)) {
+        emit_loop(current, depth, limit);
+      } else if (chance(shape.branch_density)) {
+        emit_branch(current);
+      } else {
+        fill(*current);
+        auto &next = program->make_block();
+        current->append<Jump>(next);
+        current = &next;
+      }
+    }
+  }
+
+  // for (counter = 0; counter < trip count; ++counter) { region }
+  void emit_loop(BasicBlock *&current, u32 depth, size_t limit) {
+    VM_Local counter = depth;
+    fill(*current);
+    current->append<LoadImmediate>(VM_Value(0));
+    current->append<SetLocal>(counter);
+
+    auto &header = program->make_block();
+    current->append<Jump>(header);
+    header.append<GetLocal>(counter);
+    header.append<Store>(compare_register);
+    header.append<LoadImmediate>(shape.loop_trip_count);
+    header.append<LessThan>(compare_register);
+
+    auto &body_entry = program->make_block();
+    auto *body       = &body_entry;
+    size_t body_size = 1 + uniform(2 * shape.loop_body_blocks);
+    emit_region(body, depth + 1, std::min(limit, program->blocks.size() + body_size));
+    fill(*body);
+    body->append<GetLocal>(counter);
+    body->append<Increment>();
+    body->append<SetLocal>(counter);
+    body->append<Jump>(header);
+
+    auto &exit = program->make_block();
+    header.append<JumpConditional>(body_entry, exit);
+    current = &exit;
+  }
+
+  // if (data < literal) { then } [else { else }]
+  void emit_branch(BasicBlock *&current) {
+    fill(*current);
+    current->append<GetLocal>(data_local_or_counter());
+    current->append<Store>(compare_register);
+    current->append<LoadImmediate>(VM_Value(uniform(64)));
+    current->append<LessThan>(compare_register);
+
+    auto &then_block = program->make_block();
+    fill(then_block);
+    BasicBlock *else_block = nullptr;
+    if (chance(0.5)) {
+      else_block = &program->make_block();
+      fill(*else_block);
+    }
+    auto &join = program->make_block();
+    then_block.append<Jump>(join);
+    if (else_block) {
+      else_block->append<Jump>(join);
+    }
+    current->append<JumpConditional>(then_block, else_block ? *else_block : join);
+    current = &join;
+  }
+
+  // Appends a random number of straight-line instructions.
+  void fill(BasicBlock &block) {
+    size_t count = 1 + uniform(2 * std::max<size_t>(shape.instructions_per_block, 1) - 1);
+    for (size_t i = 0; i < count; ++i) {
+      emit_instruction(block);
+    }
+  }
+
+  void emit_instruction(BasicBlock &block) {
+    const auto &mix = shape.mix;
+    u32 weights[]   = {mix.load_immediate, mix.load,      mix.store, mix.get_local,
+                       mix.set_local,      mix.increment, mix.add,   mix.less_than};
+    u64 total       = 0;
+    for (auto weight : weights) {
+      total += weight;
+    }
+    if (!total) {
+      block.append<Increment>();
+      return;
+    }
+
+    u64 pick    = uniform(total);
+    size_t kind = 0;
+    while (pick >= weights[kind]) {
+      pick -= weights[kind++];
+    }
+    switch (kind) {
+      case 0:
+        block.append<LoadImmediate>(VM_Value(uniform(1000)));
+        break;
+      case 1:
+        block.append<Load>(data_register());
+        break;
+      case 2:
+        block.append<Store>(data_register());
+        break;
+      case 3:
+        block.append<GetLocal>(data_local_or_counter());
+        break;
+      case 4:
+        block.append<SetLocal>(data_local());
+        break;
+      case 5:
+        block.append<Increment>();
+        break;
+      case 6:
+        block.append<Add>(data_register());
+        break;
+      case 7:
+        block.append<LessThan>(data_register());
+        break;
+    }
+  }
+
+  VM_Register data_register() { return 2 + uniform(shape.register_count - 2); }
+  // Loop counters may be read but never written outside their loop.
+  VM_Local data_local() {
+    return shape.max_loop_depth + uniform(shape.local_count - shape.max_loop_depth);
+  }
+  VM_Local data_local_or_counter() { return uniform(shape.local_count); }
+
+  // Uniform in [0, bound).
+  u64 uniform(u64 bound) {
+    if (bound <= 1) {
+      return 0;
+    }
+    return std::uniform_int_distribution<u64>(0, bound - 1)(rng);
+  }
+
+  bool chance(double probability) {
+    return std::uniform_real_distribution<double>(0, 1)(rng) < probability;
+  }
+
+  const ProgramShape &shape;
+  std::unique_ptr<Program> program;
+  std::mt19937_64 rng;
+};
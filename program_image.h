@@ -0,0 +1,631 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "vm.h"
+
+// A Program serialized so it can be mmapped and interpreted where it lies:
+// loading does no parsing and no per-instruction allocation, and costs the
+// same for any Program size. Pages are only read as the interpreter reaches
+// them.
+//
+//   ProgramImageWriter::write(program, "program.vmi");
+//   auto image = ProgramImage::map("program.vmi", &hosts);
+//   vm.interpret(image);
+//
+// Sections follow the header in this order, each 8-byte aligned:
+//
+//   blocks        u32[block_count + 1]: each block's first instruction,
+//                 then instruction_count
+//   instructions  ImageInstruction[instruction_count]
+//   operands      u32[operand_count]: stack maps and host call arguments
+//   hosts         ImageHost[host_count]: host functions, bound by name
+//   strings       the Program's name and host function names
+//
+// Integers are little-endian, as the VM only targets x86-64. The checksum
+// covers everything after the header. Checking it takes time linear in the
+// image, so map() only validates the header and sections; verify() checks
+// the checksum and every instruction.
+struct ImageString {
+  // Into the strings section; the string is followed by a NUL.
+  u32 offset;
+  u32 size;
+};
+
+struct ImageHost {
+  ImageString name;
+  u32 argument_count;
+  u32 reserved;
+};
+
+// Fixed size, so instructions are indexed like the Program's. By type:
+//
+//   LoadImmediate    b = value
+//   Load, Store      b = register
+//   GetLocal,
+//   SetLocal         b = local
+//   LessThan, Add    b = lhs register
+//   Jump             a = target block
+//   JumpConditional  a = true block, b = false block
+//   Allocate         a = slot count, b = operand index of: reference slots,
+//                    register count, local count, registers, locals
+//   GetField,
+//   SetField         a = field index, b = object register
+//   CallHost         a = host index, b = operand index of: argument count,
+//                    argument registers
+struct ImageInstruction {
+  u8 type;
+  u8 reserved[3];
+  u32 a;
+  u64 b;
+};
+static_assert(sizeof(ImageInstruction) == 16, "ImageInstruction is part of the file format");
+
+struct ProgramImageHeader {
+  static constexpr char expected_magic[8] = {'V', 'M', 'I', 'M', 'A', 'G', 'E', 0};
+  static constexpr u32 current_version    = 1;
+
+  char magic[8];
+  u32 version;
+  u32 header_size;
+  u64 file_size;
+  u64 checksum;
+  u32 block_count;
+  u32 instruction_count;
+  u32 operand_count;
+  u32 host_count;
+  u64 blocks_offset;
+  u64 instructions_offset;
+  u64 operands_offset;
+  u64 hosts_offset;
+  u64 strings_offset;
+  u64 strings_size;
+  ImageString name;
+
+  // FNV-1a, as Program::hash.
+  static u64 checksum_of(const u8 *data, size_t size) {
+    u64 hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; ++i) {
+      hash = (hash ^ data[i]) * 0x100000001b3;
+    }
+    return hash;
+  }
+};
+
+// Variable-length operands of one instruction, as a range of indices.
+struct ImageOperands {
+  const u32 *first;
+  const u32 *last;
+
+  const u32 *begin() const { return first; }
+  const u32 *end() const { return last; }
+  size_t size() const { return last - first; }
+};
+
+struct ProgramImage {
+  // Host functions are looked up by name in `hosts`, which must outlive the
+  // image; it may be null when the Program calls none.
+  static ProgramImage map(const std::string &path, const HostRegistry *hosts = nullptr) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("Cannot open program image " + path);
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || size_t(status.st_size) < sizeof(ProgramImageHeader)) {
+      close(fd);
+      throw std::runtime_error("Truncated program image " + path);
+    }
+    size_t size = status.st_size;
+    void *data  = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("Cannot map program image " + path);
+    }
+    // Unmapped again by the destructor if validation throws.
+    ProgramImage image(static_cast<const u8 *>(data), size);
+    image.validate();
+    image.bind(hosts);
+    return image;
+  }
+
+  ProgramImage(ProgramImage &&other) noexcept
+      : data(other.data), size(other.size), host_functions(std::move(other.host_functions)) {
+    other.data = nullptr;
+  }
+  ProgramImage &operator=(ProgramImage &&) = delete;
+
+  ~ProgramImage() {
+    if (data) {
+      munmap(const_cast<u8 *>(data), size);
+    }
+  }
+
+  const ProgramImageHeader &header() const {
+    return *reinterpret_cast<const ProgramImageHeader *>(data);
+  }
+
+  std::string_view name() const { return string(header().name); }
+  u32 block_count() const { return header().block_count; }
+  u32 instruction_count() const { return header().instruction_count; }
+
+  const u32 *block_starts() const { return section<u32>(header().blocks_offset); }
+  const ImageInstruction *instructions() const {
+    return section<ImageInstruction>(header().instructions_offset);
+  }
+  const u32 *operands() const { return section<u32>(header().operands_offset); }
+  const HostFunction &host(u32 index) const { return *host_functions[index]; }
+
+  // Checks the checksum, then that every jump, operand range and host
+  // index is inside the image. Register and local indices depend on the VM
+  // and are not checked. Throws on the first problem found.
+  void verify() const {
+    auto &header = this->header();
+    if (ProgramImageHeader::checksum_of(data + header.header_size,
+                                        size - header.header_size) != header.checksum) {
+      throw std::runtime_error("Program image checksum mismatch");
+    }
+    const u32 *starts = block_starts();
+    if (starts[0] != 0 || starts[header.block_count] != header.instruction_count) {
+      throw std::runtime_error("Program image blocks do not cover its instructions");
+    }
+    for (u32 i = 0; i < header.block_count; ++i) {
+      if (starts[i] > starts[i + 1]) {
+        throw std::runtime_error("Program image blocks out of order");
+      }
+    }
+    for (u32 i = 0; i < header.instruction_count; ++i) {
+      verify(instructions()[i]);
+    }
+  }
+
+  // Like Program::dump, with blocks named by index.
+  void dump() const {
+    const u32 *starts = block_starts();
+    for (u32 block = 0; block < block_count(); ++block) {
+      std::printf("block %u:\n", block);
+      for (u32 i = starts[block]; i < starts[block + 1]; ++i) {
+        std::printf("  ");
+        dump(instructions()[i]);
+      }
+    }
+  }
+
+ private:
+  ProgramImage(const u8 *data, size_t size) : data(data), size(size) {}
+
+  template <typename T>
+  const T *section(u64 offset) const {
+    return reinterpret_cast<const T *>(data + offset);
+  }
+
+  std::string_view string(ImageString string) const {
+    return {section<char>(header().strings_offset) + string.offset, string.size};
+  }
+
+  // Only the header and section bounds: constant time whatever the size.
+  void validate() const {
+    auto &header = this->header();
+    if (std::memcmp(header.magic, ProgramImageHeader::expected_magic, sizeof(header.magic))) {
+      throw std::runtime_error("Not a program image");
+    }
+    if (header.version != ProgramImageHeader::current_version ||
+        header.header_size != sizeof(ProgramImageHeader)) {
+      throw std::runtime_error("Unsupported program image version " +
+                               std::to_string(header.version));
+    }
+    if (header.file_size != size || header.block_count == 0) {
+      throw std::runtime_error("Malformed program image");
+    }
+    check_section(header.blocks_offset, (u64(header.block_count) + 1) * sizeof(u32));
+    check_section(header.instructions_offset,
+                  u64(header.instruction_count) * sizeof(ImageInstruction));
+    check_section(header.operands_offset, u64(header.operand_count) * sizeof(u32));
+    check_section(header.hosts_offset, u64(header.host_count) * sizeof(ImageHost));
+    check_section(header.strings_offset, header.strings_size);
+    check_string(header.name);
+  }
+
+  void check_section(u64 offset, u64 bytes) const {
+    if (offset % 8 || offset < sizeof(ProgramImageHeader) || offset > size ||
+        bytes > size - offset) {
+      throw std::runtime_error("Program image section out of bounds");
+    }
+  }
+
+  void check_string(ImageString string) const {
+    if (u64(string.offset) + string.size >= header().strings_size) {
+      throw std::runtime_error("Program image string out of bounds");
+    }
+  }
+
+  void bind(const HostRegistry *hosts) {
+    auto &header = this->header();
+    if (header.host_count && !hosts) {
+      throw std::runtime_error("Program image calls host functions but has no registry");
+    }
+    auto *table = section<ImageHost>(header.hosts_offset);
+    host_functions.reserve(header.host_count);
+    for (u32 i = 0; i < header.host_count; ++i) {
+      check_string(table[i].name);
+      auto &function = hosts->find(std::string(string(table[i].name)));
+      if (function.argument_count != table[i].argument_count) {
+        throw std::runtime_error("Wrong number of arguments to host function " + function.name);
+      }
+      host_functions.push_back(&function);
+    }
+  }
+
+  ImageOperands operands(u64 index, u64 count) const {
+    if (index > header().operand_count || count > header().operand_count - index) {
+      throw std::runtime_error("Program image operands out of bounds");
+    }
+    return {operands() + index, operands() + index + count};
+  }
+
+  void verify(const ImageInstruction &instruction) const {
+    auto check_block = [&](u64 block) {
+      if (block >= block_count()) {
+        throw std::runtime_error("Jump to a block outside the program image");
+      }
+    };
+    switch (Instruction::Type(instruction.type)) {
+      case Instruction::Type::Jump:
+        check_block(instruction.a);
+        break;
+      case Instruction::Type::JumpConditional:
+        check_block(instruction.a);
+        check_block(instruction.b);
+        break;
+      case Instruction::Type::Allocate: {
+        auto counts = operands(instruction.b, 3);
+        operands(instruction.b + 3, u64(counts.first[1]) + counts.first[2]);
+        break;
+      }
+      case Instruction::Type::CallHost: {
+        if (instruction.a >= header().host_count) {
+          throw std::runtime_error("Call to a host function outside the program image");
+        }
+        auto count = operands(instruction.b, 1);
+        if (count.first[0] != host(instruction.a).argument_count) {
+          throw std::runtime_error("Wrong number of arguments to host function " +
+                                   host(instruction.a).name);
+        }
+        operands(instruction.b + 1, count.first[0]);
+        break;
+      }
+      default:
+        if (instruction.type >= Instruction::type_count) {
+          throw std::runtime_error("Unknown instruction type in program image");
+        }
+    }
+  }
+
+  void dump(const ImageInstruction &instruction) const {
+    auto type = Instruction::Type(instruction.type);
+    switch (type) {
+      case Instruction::Type::LoadImmediate:
+        std::printf("LoadImmediate $%lu\n", instruction.b);
+        break;
+      case Instruction::Type::Load:
+      case Instruction::Type::Store:
+      case Instruction::Type::LessThan:
+      case Instruction::Type::Add:
+        std::printf("%s Reg(%lu)\n", to_string(type), instruction.b);
+        break;
+      case Instruction::Type::GetLocal:
+      case Instruction::Type::SetLocal:
+        std::printf("%s %lu\n", to_string(type), instruction.b);
+        break;
+      case Instruction::Type::Jump:
+        std::printf("Jump block %u\n", instruction.a);
+        break;
+      case Instruction::Type::JumpConditional:
+        std::printf("JumpConditional (block %u) : (block %lu)\n", instruction.a, instruction.b);
+        break;
+      case Instruction::Type::Allocate:
+        std::printf("Allocate %u (%u references)\n", instruction.a, operands()[instruction.b]);
+        break;
+      case Instruction::Type::GetField:
+      case Instruction::Type::SetField:
+        std::printf("%s Reg(%lu)[%u]\n", to_string(type), instruction.b, instruction.a);
+        break;
+      case Instruction::Type::CallHost: {
+        const u32 *arguments = operands() + instruction.b;
+        std::printf("CallHost %s(", host(instruction.a).name.c_str());
+        for (u32 i = 0; i < arguments[0]; ++i) {
+          std::printf(i ? ", Reg(%u)" : "Reg(%u)", arguments[1 + i]);
+        }
+        std::printf(")\n");
+        break;
+      }
+      default:
+        std::printf("%s\n", to_string(type));
+    }
+  }
+
+  const u8 *data;
+  size_t size;
+  std::vector<const HostFunction *> host_functions;
+};
+
+struct ProgramImageWriter {
+  static std::vector<u8> build(const Program &program) {
+    ProgramImageWriter writer;
+    writer.encode(program);
+    return writer.assemble(program);
+  }
+
+  // Through a temporary file and a rename, so a half-written image is never
+  // mapped.
+  static void write(const Program &program, const std::string &path) {
+    auto image            = build(program);
+    std::string temporary = path + ".tmp";
+    FILE *out             = std::fopen(temporary.c_str(), "wb");
+    if (!out) {
+      throw std::runtime_error("Cannot create program image " + temporary);
+    }
+    bool written = std::fwrite(image.data(), 1, image.size(), out) == image.size();
+    written      = std::fclose(out) == 0 && written;
+    if (!written || std::rename(temporary.c_str(), path.c_str()) != 0) {
+      std::remove(temporary.c_str());
+      throw std::runtime_error("Cannot write program image " + path);
+    }
+  }
+
+ private:
+  std::vector<u32> block_starts;
+  std::vector<ImageInstruction> instructions;
+  std::vector<u32> operands;
+  std::vector<ImageHost> hosts;
+  std::unordered_map<const HostFunction *, u32> host_indices;
+  std::string strings;
+
+  void encode(const Program &program) {
+    if (program.blocks.empty()) {
+      throw std::runtime_error("Cannot write an empty Program");
+    }
+    instructions.reserve(program.instruction_count());
+    for (const auto &block : program.blocks) {
+      block_starts.push_back(narrow_cast<u32>(instructions.size()));
+      for (const auto &instruction : block->instructions) {
+        instructions.push_back(encode(program, *instruction));
+      }
+    }
+    block_starts.push_back(narrow_cast<u32>(instructions.size()));
+  }
+
+  ImageInstruction encode(const Program &program, const Instruction &instruction) {
+    ImageInstruction encoded{};
+    encoded.type = u8(instruction.type);
+    switch (instruction.type) {
+      case Instruction::Type::LoadImmediate:
+        encoded.b = static_cast<const LoadImmediate &>(instruction).value;
+        break;
+      case Instruction::Type::Load:
+        encoded.b = static_cast<const Load &>(instruction).reg;
+        break;
+      case Instruction::Type::Store:
+        encoded.b = static_cast<const Store &>(instruction).reg;
+        break;
+      case Instruction::Type::GetLocal:
+        encoded.b = static_cast<const GetLocal &>(instruction).local;
+        break;
+      case Instruction::Type::SetLocal:
+        encoded.b = static_cast<const SetLocal &>(instruction).local;
+        break;
+      case Instruction::Type::LessThan:
+        encoded.b = static_cast<const LessThan &>(instruction).lhs;
+        break;
+      case Instruction::Type::Add:
+        encoded.b = static_cast<const Add &>(instruction).lhs;
+        break;
+      case Instruction::Type::Jump:
+        encoded.a = block_index(program, static_cast<const Jump &>(instruction).target_block);
+        break;
+      case Instruction::Type::JumpConditional: {
+        auto &jump = static_cast<const JumpConditional &>(instruction);
+        encoded.a  = block_index(program, jump.true_block);
+        encoded.b  = block_index(program, jump.false_block);
+        break;
+      }
+      case Instruction::Type::Allocate: {
+        auto &allocate = static_cast<const Allocate &>(instruction);
+        encoded.a      = allocate.slot_count;
+        encoded.b      = operands.size();
+        operands.push_back(allocate.reference_slots);
+        operands.push_back(narrow_cast<u32>(allocate.stack_map.registers.size()));
+        operands.push_back(narrow_cast<u32>(allocate.stack_map.locals.size()));
+        append_indices(allocate.stack_map.registers);
+        append_indices(allocate.stack_map.locals);
+        break;
+      }
+      case Instruction::Type::GetField: {
+        auto &get_field = static_cast<const GetField &>(instruction);
+        encoded.a       = get_field.index;
+        encoded.b       = get_field.object;
+        break;
+      }
+      case Instruction::Type::SetField: {
+        auto &set_field = static_cast<const SetField &>(instruction);
+        encoded.a       = set_field.index;
+        encoded.b       = set_field.object;
+        break;
+      }
+      case Instruction::Type::CallHost: {
+        auto &call = static_cast<const CallHost &>(instruction);
+        encoded.a  = host_index(call.function);
+        encoded.b  = operands.size();
+        operands.push_back(narrow_cast<u32>(call.arguments.size()));
+        append_indices(call.arguments);
+        break;
+      }
+      case Instruction::Type::Exit:
+      case Instruction::Type::Increment:
+        break;
+    }
+    return encoded;
+  }
+
+  static u32 block_index(const Program &program, const BasicBlock &block) {
+    if (block.index >= program.blocks.size() || program.blocks[block.index].get() != &block) {
+      throw std::runtime_error("Jump to a block outside the Program");
+    }
+    return block.index;
+  }
+
+  void append_indices(const std::vector<u64> &indices) {
+    for (auto index : indices) {
+      if (index > UINT32_MAX) {
+        throw std::runtime_error("Register or local index too large for a program image");
+      }
+      operands.push_back(narrow_cast<u32>(index));
+    }
+  }
+
+  u32 host_index(const HostFunction &function) {
+    auto [it, inserted] = host_indices.emplace(&function, narrow_cast<u32>(hosts.size()));
+    if (inserted) {
+      hosts.push_back({add_string(function.name), function.argument_count, 0});
+    }
+    return it->second;
+  }
+
+  ImageString add_string(const std::string &string) {
+    ImageString added{narrow_cast<u32>(strings.size()), narrow_cast<u32>(string.size())};
+    strings.append(string);
+    strings.push_back(0);
+    return added;
+  }
+
+  std::vector<u8> assemble(const Program &program) {
+    ProgramImageHeader header{};
+    std::memcpy(header.magic, ProgramImageHeader::expected_magic, sizeof(header.magic));
+    header.version           = ProgramImageHeader::current_version;
+    header.header_size       = sizeof(ProgramImageHeader);
+    header.block_count       = narrow_cast<u32>(program.blocks.size());
+    header.instruction_count = narrow_cast<u32>(instructions.size());
+    header.operand_count     = narrow_cast<u32>(operands.size());
+    header.host_count        = narrow_cast<u32>(hosts.size());
+    header.name              = add_string(program.name);
+
+    std::vector<u8> image(sizeof(header));
+    auto append = [&](const void *bytes, size_t size) {
+      image.resize((image.size() + 7) & ~size_t(7));
+      u64 offset = image.size();
+      image.insert(image.end(), static_cast<const u8 *>(bytes),
+                   static_cast<const u8 *>(bytes) + size);
+      return offset;
+    };
+    header.blocks_offset       = append(block_starts.data(), block_starts.size() * sizeof(u32));
+    header.instructions_offset = append(instructions.data(),
+                                        instructions.size() * sizeof(ImageInstruction));
+    header.operands_offset     = append(operands.data(), operands.size() * sizeof(u32));
+    header.hosts_offset        = append(hosts.data(), hosts.size() * sizeof(ImageHost));
+    header.strings_offset      = append(strings.data(), strings.size());
+    header.strings_size        = strings.size();
+    image.resize((image.size() + 7) & ~size_t(7));
+    header.file_size = image.size();
+    header.checksum  = ProgramImageHeader::checksum_of(image.data() + sizeof(header),
+                                                       image.size() - sizeof(header));
+    std::memcpy(image.data(), &header, sizeof(header));
+    return image;
+  }
+};
+
+// No ExecutionPosition is published and no hooks are called: the sampling
+// profiler and branch profiles only know Programs. The USDT probes pass the
+// image in place of the Program; image strings are NUL-terminated.
+inline void VM::interpret(const ProgramImage &image) {
+  InterpretStats stats;
+  u64 &executed   = stats.executed;
+  u64 trace_start = Tracer::enabled() ? Tracer::now() : 0;
+  VM_PROBE2(interpret_entry, &image, image.name().data());
+
+  const u32 *starts                    = image.block_starts();
+  const ImageInstruction *instructions = image.instructions();
+  const u32 *operands                  = image.operands();
+  u32 index                            = starts[0];
+  u32 end                              = starts[1];
+  while (index < end) {
+    auto &instruction = instructions[index];
+    executed++;
+    switch (Instruction::Type(instruction.type)) {
+      case Instruction::Type::LoadImmediate:
+        registers[0] = instruction.b;
+        break;
+      case Instruction::Type::Load:
+        registers[0] = registers[instruction.b];
+        break;
+      case Instruction::Type::Store:
+        registers[instruction.b] = registers[0];
+        break;
+      case Instruction::Type::SetLocal:
+        locals[instruction.b] = registers[0];
+        break;
+      case Instruction::Type::GetLocal:
+        registers[0] = locals[instruction.b];
+        break;
+      case Instruction::Type::Increment:
+        registers[0]++;
+        break;
+      case Instruction::Type::LessThan:
+        registers[0] = registers[instruction.b] < registers[0];
+        break;
+      case Instruction::Type::Add:
+        registers[0] = registers[instruction.b] + registers[0];
+        break;
+      case Instruction::Type::Jump:
+        index = starts[instruction.a];
+        end   = starts[instruction.a + 1];
+        continue;
+      case Instruction::Type::JumpConditional: {
+        u64 target = registers[0] ? instruction.a : instruction.b;
+        index      = starts[target];
+        end        = starts[target + 1];
+        continue;
+      }
+      case Instruction::Type::Exit:
+        break;
+      case Instruction::Type::Allocate: {
+        const u32 *counts = operands + instruction.b;
+        const u32 *map    = counts + 3;
+        registers[0]      = reinterpret_cast<VM_Value>(
+            allocate(instruction.a, counts[0], ImageOperands{map, map + counts[1]},
+                     ImageOperands{map + counts[1], map + counts[1] + counts[2]}));
+        break;
+      }
+      case Instruction::Type::GetField: {
+        auto *object = reinterpret_cast<HeapObject *>(registers[instruction.b]);
+        registers[0] = object->slots()[instruction.a];
+        break;
+      }
+      case Instruction::Type::SetField:
+        set_field(instruction.b, instruction.a);
+        break;
+      case Instruction::Type::CallHost: {
+        const u32 *arguments = operands + instruction.b;
+        call_host(image.host(instruction.a), ImageOperands{arguments + 1,
+                                                           arguments + 1 + arguments[0]});
+        break;
+      }
+      default:
+        throw std::runtime_error("Unknown instruction type");
+    }
+    index++;
+  }
+  if (trace_start) {
+    Tracer::complete("vm.interpret_image", trace_start, "instructions", executed);
+  }
+  VM_PROBE2(interpret_return, &image, executed);
+}
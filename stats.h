@@ -0,0 +1,248 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "json_writer.h"
+
+// Process-wide runtime counters for the VM, the Jit and Executables. Every
+// thread writes its own block without locks or atomic read-modify-writes;
+// `snapshot` sums the blocks on demand, so reading never slows the writers.
+// Blocks outlive their threads, so nothing counted is lost.
+//
+//   Stats::add(Stat::ProgramsCompiled);
+//   Stats::snapshot().write_prometheus(stdout);
+enum class Stat : u32 {
+  InterpretCalls,
+  InstructionsInterpreted,
+  JitRuns,
+  SlowAllocations,
+  MinorCollections,
+  MajorCollections,
+  ProgramsCompiled,
+  InstructionsCompiled,
+  CodeBytesEmitted,
+  CompileFailures,
+  ExecutablesMapped,
+  ExecutablesUnmapped,
+  CodeBytesMapped,
+  CodeBytesUnmapped,
+};
+
+struct StatsSnapshot {
+  static constexpr size_t stat_count = size_t(Stat::CodeBytesUnmapped) + 1;
+  // Upper bounds of the compile time buckets, in seconds; the last bucket
+  // is +Inf.
+  static constexpr double compile_bounds[] = {1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1, 10};
+  static constexpr size_t compile_buckets  = std::size(compile_bounds) + 1;
+
+  u64 values[stat_count]{};
+  u64 compile_histogram[compile_buckets]{};
+  u64 compile_ns{};
+  u64 threads{};
+
+  u64 operator[](Stat stat) const { return values[size_t(stat)]; }
+
+  u64 live_executables() const {
+    return (*this)[Stat::ExecutablesMapped] - (*this)[Stat::ExecutablesUnmapped];
+  }
+  u64 code_heap_bytes() const {
+    return (*this)[Stat::CodeBytesMapped] - (*this)[Stat::CodeBytesUnmapped];
+  }
+
+  // {"vm_interpret_calls_total":N, ..., "jit_compile_seconds":{...}}, with
+  // the same names as the Prometheus export.
+  void write_json(JsonWriter &json) const {
+    json.begin_object();
+    for (size_t i = 0; i < stat_count; ++i) {
+      json.field(descriptors[i].name, values[i]);
+    }
+    json.field("executables", live_executables());
+    json.field("executable_code_bytes", code_heap_bytes());
+    json.field("stats_threads", threads);
+    json.field("jit_compile_seconds", CompileHistogram{*this});
+    json.end_object();
+  }
+
+  void write_json(FILE *out) const {
+    JsonWriter json{out};
+    write_json(json);
+    std::fputc('\n', out);
+  }
+
+  // Prometheus text exposition format, version 0.0.4.
+  void write_prometheus(FILE *out) const {
+    for (size_t i = 0; i < stat_count; ++i) {
+      write_metric(out, descriptors[i].name, "counter", descriptors[i].help, values[i]);
+    }
+    write_metric(out, "executables", "gauge", "Executables currently mapped.",
+                 live_executables());
+    write_metric(out, "executable_code_bytes", "gauge",
+                 "Bytes of executable memory currently mapped.", code_heap_bytes());
+    write_metric(out, "stats_threads", "gauge", "Threads that have recorded statistics.",
+                 threads);
+
+    std::fprintf(out, "# HELP jit_compile_seconds Time spent in Jit::compile.\n");
+    std::fprintf(out, "# TYPE jit_compile_seconds histogram\n");
+    u64 cumulative = 0;
+    for (size_t i = 0; i < compile_buckets; ++i) {
+      cumulative += compile_histogram[i];
+      if (i < std::size(compile_bounds)) {
+        std::fprintf(out, "jit_compile_seconds_bucket{le=\"%g\"} %lu\n", compile_bounds[i],
+                     cumulative);
+      } else {
+        std::fprintf(out, "jit_compile_seconds_bucket{le=\"+Inf\"} %lu\n", cumulative);
+      }
+    }
+    std::fprintf(out, "jit_compile_seconds_sum %.9f\n", compile_ns / 1e9);
+    std::fprintf(out, "jit_compile_seconds_count %lu\n", cumulative);
+  }
+
+  // For a textfile collector: written next to `path` and renamed over it,
+  // so a scrape never sees half a file.
+  bool write_prometheus_file(const std::string &path) const {
+    std::string temporary = path + ".tmp";
+    FILE *out             = std::fopen(temporary.c_str(), "w");
+    if (!out) {
+      return false;
+    }
+    write_prometheus(out);
+    bool written = std::fclose(out) == 0;
+    return written && std::rename(temporary.c_str(), path.c_str()) == 0;
+  }
+
+ private:
+  struct Descriptor {
+    const char *name;
+    const char *help;
+  };
+
+  static constexpr Descriptor descriptors[stat_count] = {
+      {"vm_interpret_calls_total", "Calls to VM::interpret."},
+      {"vm_instructions_interpreted_total", "Instructions executed by VM::interpret."},
+      {"vm_jit_runs_total", "Calls into JIT code through VM::run."},
+      {"vm_slow_allocations_total", "Allocations that missed the nursery fast path."},
+      {"vm_minor_collections_total", "Nursery collections."},
+      {"vm_major_collections_total", "Old space collections."},
+      {"jit_programs_compiled_total", "Programs compiled by Jit::compile."},
+      {"jit_instructions_compiled_total", "Instructions compiled by Jit::compile."},
+      {"jit_code_bytes_emitted_total", "Bytes of machine code emitted."},
+      {"jit_compile_failures_total", "Jit::compile calls that threw."},
+      {"executable_mapped_total", "Executables mapped."},
+      {"executable_unmapped_total", "Executables unmapped."},
+      {"executable_code_bytes_mapped_total", "Bytes of executable memory mapped."},
+      {"executable_code_bytes_unmapped_total", "Bytes of executable memory unmapped."},
+  };
+
+  struct CompileHistogram {
+    const StatsSnapshot &snapshot;
+
+    // {"buckets":[{"le":S,"count":N}, ...],"sum":S,"count":N}, cumulative
+    // like Prometheus; the +Inf bucket is `count`.
+    void write_json(JsonWriter &json) const {
+      u64 cumulative = 0;
+      json.begin_object();
+      json.begin_array("buckets");
+      for (size_t i = 0; i < std::size(compile_bounds); ++i) {
+        cumulative += snapshot.compile_histogram[i];
+        json.begin_object();
+        json.field("le", compile_bounds[i]);
+        json.field("count", cumulative);
+        json.end_object();
+      }
+      json.end_array();
+      json.field("sum", snapshot.compile_ns / 1e9);
+      json.field("count", cumulative + snapshot.compile_histogram[compile_buckets - 1]);
+      json.end_object();
+    }
+  };
+
+  static void write_metric(FILE *out, const char *name, const char *type, const char *help,
+                           u64 value) {
+    std::fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name,
+                 value);
+  }
+};
+
+struct Stats {
+  static void add(Stat stat, u64 value = 1) { bump(this_thread().values[size_t(stat)], value); }
+
+  static void record_compile(u64 ns) {
+    auto &block  = this_thread();
+    size_t index = 0;
+    while (index < std::size(StatsSnapshot::compile_bounds) &&
+           ns > StatsSnapshot::compile_bounds[index] * 1e9) {
+      ++index;
+    }
+    bump(block.compile_histogram[index], 1);
+    bump(block.compile_ns, ns);
+  }
+
+  static u64 now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Counts may be a few increments behind threads that are running.
+  static StatsSnapshot snapshot() {
+    auto &stats = instance();
+    StatsSnapshot snapshot;
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    for (const auto &block : stats.blocks) {
+      for (size_t i = 0; i < StatsSnapshot::stat_count; ++i) {
+        snapshot.values[i] += load(block->values[i]);
+      }
+      for (size_t i = 0; i < StatsSnapshot::compile_buckets; ++i) {
+        snapshot.compile_histogram[i] += load(block->compile_histogram[i]);
+      }
+      snapshot.compile_ns += load(block->compile_ns);
+    }
+    snapshot.threads = stats.blocks.size();
+    return snapshot;
+  }
+
+ private:
+  struct ThreadBlock {
+    u64 values[StatsSnapshot::stat_count]{};
+    u64 compile_histogram[StatsSnapshot::compile_buckets]{};
+    u64 compile_ns{};
+  };
+
+  // Never destroyed: Executables in other statics still count on exit.
+  static Stats &instance() {
+    static auto *stats = new Stats;
+    return *stats;
+  }
+
+  static ThreadBlock &this_thread() {
+    static thread_local ThreadBlock *block = instance().register_thread();
+    return *block;
+  }
+
+  ThreadBlock *register_thread() {
+    auto block = std::make_unique<ThreadBlock>();
+    std::lock_guard<std::mutex> lock(mutex);
+    blocks.push_back(std::move(block));
+    return blocks.back().get();
+  }
+
+  // Only the owning thread writes a block, so load-add-store needs no
+  // locked instruction; the atomic store keeps readers from seeing a torn
+  // value.
+  static void bump(u64 &counter, u64 value) {
+    __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + value,
+                     __ATOMIC_RELAXED);
+  }
+
+  static u64 load(const u64 &counter) { return __atomic_load_n(&counter, __ATOMIC_RELAXED); }
+
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadBlock>> blocks;
+};
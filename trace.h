@@ -0,0 +1,256 @@
+#pragma once
+
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "json_writer.h"
+
+// Timeline of VM events (compiles, interpretations, JIT runs, slow
+// allocations, code being unmapped) for Perfetto or chrome://tracing.
+// Every thread records into its own ring buffer of the last `capacity`
+// events, stamped with the TSC; a disabled tracer costs one relaxed load
+// per event site. The ring of an exited thread is kept until its events
+// have been written once, then reused by the next thread that records.
+//
+//   Tracer::instance().start();
+//   ...
+//   Tracer::instance().write_chrome_trace(out);
+//
+// VM_TRACE=<file> starts tracing at startup and writes the trace at exit.
+// Embedders can add their own events, e.g. around request handling:
+//
+//   Tracer::Scope scope("handle_request");
+//
+// Event and argument names must be string literals; only the pointers are
+// stored.
+struct Tracer {
+  static constexpr size_t capacity = 32 * 1024;
+
+  struct Event {
+    u64 start;
+    u64 duration;
+    const char *name;
+    const char *arg_name;
+    u64 arg;
+    char phase;  // 'X' complete, 'i' instant
+  };
+
+  // Records a complete event for its lifetime.
+  struct Scope {
+    const char *name;
+    u64 start;
+
+    explicit Scope(const char *name) : name(name), start(enabled() ? now() : 0) {}
+    ~Scope() {
+      if (start) {
+        complete(name, start);
+      }
+    }
+  };
+
+  static Tracer &instance() {
+    // Never destroyed: threads may still record during static destruction.
+    static auto *tracer = new Tracer;
+    return *tracer;
+  }
+
+  static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+  static u64 now() { return __rdtsc(); }
+
+  // A complete event from `start` until now; `start` is a `now()` reading
+  // taken while enabled.
+  static void complete(const char *name, u64 start, const char *arg_name = nullptr,
+                       u64 arg = 0) {
+    u64 end = now();
+    record({start, end - start, name, arg_name, arg, 'X'});
+  }
+
+  static void instant(const char *name, const char *arg_name = nullptr, u64 arg = 0) {
+    if (enabled()) {
+      record({now(), 0, name, arg_name, arg, 'i'});
+    }
+  }
+
+  void start() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!enabled()) {
+      origin_tsc = now();
+      origin_ns  = steady_ns();
+    }
+    active.store(true, std::memory_order_relaxed);
+  }
+
+  void stop() { active.store(false, std::memory_order_relaxed); }
+
+  // {"traceEvents":[...]} with timestamps in microseconds since `start`.
+  // Events from before that, and events overwritten while this runs, are
+  // left out. Rings of exited threads are recycled once written.
+  void write_chrome_trace(FILE *out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    // TSC ticks per microsecond, measured over the whole trace.
+    double ticks_per_us = std::max(1.0, double(now() - origin_tsc) * 1e3 /
+                                            double(std::max<u64>(steady_ns() - origin_ns, 1)));
+    int pid             = getpid();
+
+    JsonWriter json{out};
+    json.begin_object();
+    json.begin_array("traceEvents");
+    std::vector<Event> events;
+    for (const auto &ring : rings) {
+      ring->copy(events);
+      for (const auto &event : events) {
+        if (event.start < origin_tsc) {
+          continue;
+        }
+        json.begin_object();
+        json.field("name", std::string(event.name));
+        json.field("cat", std::string("vm"));
+        json.field("ph", std::string(1, event.phase));
+        json.field("ts", double(event.start - origin_tsc) / ticks_per_us);
+        if (event.phase == 'X') {
+          json.field("dur", double(event.duration) / ticks_per_us);
+        } else {
+          json.field("s", std::string("t"));
+        }
+        json.field("pid", u64(pid));
+        json.field("tid", u64(ring->tid));
+        if (event.arg_name) {
+          json.begin_object("args");
+          json.field(event.arg_name, event.arg);
+          json.end_object();
+        }
+        json.end_object();
+      }
+    }
+    json.end_array();
+    json.field("displayTimeUnit", std::string("ns"));
+    json.end_object();
+    std::fputc('\n', out);
+
+    auto exited = std::stable_partition(rings.begin(), rings.end(),
+                                        [](const auto &ring) { return !ring->exited; });
+    std::move(exited, rings.end(), std::back_inserter(spare_rings));
+    rings.erase(exited, rings.end());
+  }
+
+ private:
+  struct Ring {
+    Event events[capacity];
+    // Events ever recorded; only the owning thread writes it.
+    std::atomic<u64> head{};
+    u32 tid = narrow_cast<u32>(syscall(SYS_gettid));
+    // Set under the Tracer's mutex when the owning thread exits.
+    bool exited{};
+
+    void record(const Event &event) {
+      u64 index                = head.load(std::memory_order_relaxed);
+      events[index % capacity] = event;
+      head.store(index + 1, std::memory_order_release);
+    }
+
+    // While the owner keeps recording, the oldest events can be overwritten
+    // as they are copied; only those the second read of `head` proves
+    // intact are kept.
+    void copy(std::vector<Event> &out) const {
+      u64 end   = head.load(std::memory_order_acquire);
+      u64 begin = end > capacity ? end - capacity : 0;
+      out.clear();
+      for (u64 i = begin; i < end; ++i) {
+        out.push_back(events[i % capacity]);
+      }
+      u64 now_head = head.load(std::memory_order_acquire);
+      u64 intact   = now_head > capacity ? now_head - capacity : 0;
+      if (intact > begin) {
+        out.erase(out.begin(), out.begin() + std::min<u64>(intact - begin, out.size()));
+      }
+    }
+  };
+
+  Tracer() = default;
+
+  static u64 steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Hands the thread's ring back when the thread exits.
+  struct RingOwner {
+    Ring *ring{};
+
+    ~RingOwner() {
+      if (ring) {
+        instance().retire(ring);
+        thread_ring = nullptr;
+      }
+    }
+  };
+
+  static void record(const Event &event) {
+    if (!thread_ring) {
+      thread_local RingOwner owner;
+      thread_ring = instance().add_ring();
+      owner.ring  = thread_ring;
+    }
+    thread_ring->record(event);
+  }
+
+  Ring *add_ring() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (spare_rings.empty()) {
+      rings.push_back(std::make_unique<Ring>());
+    } else {
+      rings.push_back(std::move(spare_rings.back()));
+      spare_rings.pop_back();
+      auto &ring = *rings.back();
+      ring.head.store(0, std::memory_order_relaxed);
+      ring.tid    = narrow_cast<u32>(syscall(SYS_gettid));
+      ring.exited = false;
+    }
+    return rings.back().get();
+  }
+
+  void retire(Ring *ring) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ring->exited = true;
+  }
+
+  static bool start_from_environment() {
+    if (!std::getenv("VM_TRACE")) {
+      return false;
+    }
+    instance().start();
+    std::atexit([] {
+      if (FILE *out = std::fopen(std::getenv("VM_TRACE"), "w")) {
+        instance().write_chrome_trace(out);
+        std::fclose(out);
+      }
+    });
+    return true;
+  }
+
+  static inline std::atomic<bool> active{};
+  static inline thread_local Ring *thread_ring{};
+  static inline const bool started_from_environment = start_from_environment();
+
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Ring>> rings;
+  // Rings of exited threads whose events have been written.
+  std::vector<std::unique_ptr<Ring>> spare_rings;
+  u64 origin_tsc{};
+  u64 origin_ns{};
+};
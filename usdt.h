@@ -0,0 +1,72 @@
+#pragma once
+
+#include "common.h"
+
+// USDT probes under the provider "vm", in the ELF note format of
+// <sys/sdt.h> (version 3) so bpftrace, perf and SystemTap find them without
+// that header being installed:
+//
+//   bpftrace -e 'usdt:./main:vm:compile_end { @code_bytes = hist(arg2); }'
+//   perf buildid-cache --add ./main && perf list sdt_vm:*
+//
+// A probe site is a single nop. Every probe also has a semaphore that
+// tracers increment while attached; VM_PROBE_ENABLED guards arguments that
+// cost something to compute. Arguments are passed as 64-bit values.
+//
+//   compile_start    (program hash, program name, instruction count)
+//   compile_end      (program hash, code address, code size)
+//   interpret_entry  (Program * or ProgramImage *, program name)
+//   interpret_return (Program * or ProgramImage *, instructions executed)
+//   jit_entry        (Program *, code address)
+//   jit_return       (Program *)
+//   code_alloc       (code address, mapping size)
+//   code_free        (code address, mapping size)
+
+#define VM_PROBE_SEMAPHORE(name) \
+  inline volatile unsigned short vm_##name##_semaphore __attribute__((section(".probes"), used))
+
+VM_PROBE_SEMAPHORE(compile_start);
+VM_PROBE_SEMAPHORE(compile_end);
+VM_PROBE_SEMAPHORE(interpret_entry);
+VM_PROBE_SEMAPHORE(interpret_return);
+VM_PROBE_SEMAPHORE(jit_entry);
+VM_PROBE_SEMAPHORE(jit_return);
+VM_PROBE_SEMAPHORE(code_alloc);
+VM_PROBE_SEMAPHORE(code_free);
+
+#define VM_PROBE_ENABLED(name) __builtin_expect(vm_##name##_semaphore != 0, 0)
+
+// The nop's address, the semaphore and the argument locations (`8@%rax`,
+// `8@$5`, `8@16(%rsp)`) go into .note.stapsdt; .stapsdt.base lets tools
+// correct the addresses for prelinking.
+#define VM_PROBE_NOTE(name, arguments, ...)                                      \
+  __asm__ __volatile__(                                                          \
+      "990: nop\n"                                                               \
+      ".pushsection .note.stapsdt,\"?\",\"note\"\n"                              \
+      ".balign 4\n"                                                              \
+      ".4byte 992f-991f, 994f-993f, 3\n"                                         \
+      "991: .asciz \"stapsdt\"\n"                                                \
+      "992: .balign 4\n"                                                         \
+      "993: .8byte 990b\n"                                                       \
+      ".8byte _.stapsdt.base\n"                                                  \
+      ".8byte vm_" #name "_semaphore\n"                                          \
+      ".asciz \"vm\"\n"                                                          \
+      ".asciz \"" #name "\"\n"                                                   \
+      ".asciz \"" arguments "\"\n"                                               \
+      "994: .balign 4\n"                                                         \
+      ".popsection\n"                                                            \
+      ".ifndef _.stapsdt.base\n"                                                 \
+      ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"    \
+      ".weak _.stapsdt.base\n"                                                   \
+      ".hidden _.stapsdt.base\n"                                                 \
+      "_.stapsdt.base: .space 1\n"                                               \
+      ".size _.stapsdt.base, 1\n"                                                \
+      ".popsection\n"                                                            \
+      ".endif\n"                                                                 \
+      :                                                                          \
+      : __VA_ARGS__)
+
+#define VM_PROBE1(name, a) VM_PROBE_NOTE(name, "8@%0", "nor"((u64)(a)))
+#define VM_PROBE2(name, a, b) VM_PROBE_NOTE(name, "8@%0 8@%1", "nor"((u64)(a)), "nor"((u64)(b)))
+#define VM_PROBE3(name, a, b, c) \
+  VM_PROBE_NOTE(name, "8@%0 8@%1 8@%2", "nor"((u64)(a)), "nor"((u64)(b)), "nor"((u64)(c)))
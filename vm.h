@@ -0,0 +1,1631 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "arena.h"
+#include "branch_profile.h"
+#include "code_buffer.h"
+#include "common.h"
+#include "eh_frame.h"
+#include "heap.h"
+#include "host.h"
+#include "perf_jit.h"
+#include "stats.h"
+#include "trace.h"
+#include "usdt.h"
+
+struct Instruction {
+  enum class Type {
+    Exit,
+    LoadImmediate,
+    Load,
+    Store,
+    SetLocal,
+    GetLocal,
+    Increment,
+    Jump,
+    JumpConditional,
+    LessThan,
+    Add,
+    Allocate,
+    GetField,
+    SetField,
+    CallHost,
+  };
+  static constexpr size_t type_count = size_t(Type::CallHost) + 1;
+
+  Type type{};
+
+  virtual void dump() const = 0;
+
+ protected:
+  explicit Instruction(Type type) : type(type) {}
+  // Instructions are destroyed by their Program's Arena, as their own
+  // type. Not virtual, so instructions without owned memory are trivially
+  // destructible and cost nothing to tear down.
+  ~Instruction() = default;
+};
+
+inline const char *to_string(Instruction::Type type) {
+  switch (type) {
+    case Instruction::Type::Exit:
+      return "Exit";
+    case Instruction::Type::LoadImmediate:
+      return "LoadImmediate";
+    case Instruction::Type::Load:
+      return "Load";
+    case Instruction::Type::Store:
+      return "Store";
+    case Instruction::Type::SetLocal:
+      return "SetLocal";
+    case Instruction::Type::GetLocal:
+      return "GetLocal";
+    case Instruction::Type::Increment:
+      return "Increment";
+    case Instruction::Type::Jump:
+      return "Jump";
+    case Instruction::Type::JumpConditional:
+      return "JumpConditional";
+    case Instruction::Type::LessThan:
+      return "LessThan";
+    case Instruction::Type::Add:
+      return "Add";
+    case Instruction::Type::Allocate:
+      return "Allocate";
+    case Instruction::Type::GetField:
+      return "GetField";
+    case Instruction::Type::SetField:
+      return "SetField";
+    case Instruction::Type::CallHost:
+      return "CallHost";
+  }
+  return "unknown";
+}
+
+struct BasicBlock {
+  // Instructions, like this list, live in the Program's Arena.
+  std::vector<ArenaPtr<Instruction>, ArenaAllocator<ArenaPtr<Instruction>>> instructions;
+  // Position in Program::blocks, set by Program::make_block.
+  u32 index{};
+
+  explicit BasicBlock(Arena &arena) : instructions(arena), arena(arena) {}
+
+  template <typename T, typename... Args>
+  void append(Args &&...args) {
+    instructions.emplace_back(arena.make<T>(std::forward<Args>(args)...));
+  }
+
+ private:
+  Arena &arena;
+};
+
+struct Program {
+  std::string name;
+  // Owns every block and instruction, and frees them in one go. Heap
+  // allocated so blocks can keep a reference when the Program moves, and
+  // declared before `blocks` so it outlives them.
+  std::unique_ptr<Arena> arena = std::make_unique<Arena>();
+  std::vector<ArenaPtr<BasicBlock>> blocks;
+
+  BasicBlock &make_block() {
+    blocks.emplace_back(arena->make<BasicBlock>(*arena));
+    blocks.back()->index = narrow_cast<u32>(blocks.size() - 1);
+    return *blocks.back();
+  }
+
+  size_t instruction_count() const {
+    size_t count = 0;
+    for (const auto &block : blocks) {
+      count += block->instructions.size();
+    }
+    return count;
+  }
+
+  // FNV-1a over the name, block sizes and opcodes: the same for the same
+  // Program in every run, so traces can match up its compiles.
+  u64 hash() const {
+    u64 hash  = 0xcbf29ce484222325;
+    auto step = [&](u64 value) { hash = (hash ^ value) * 0x100000001b3; };
+    for (char c : name) {
+      step(u8(c));
+    }
+    for (const auto &block : blocks) {
+      step(block->instructions.size());
+      for (const auto &instruction : block->instructions) {
+        step(u64(instruction->type));
+      }
+    }
+    return hash;
+  }
+
+  // With a profile, every line gets a gutter: entry count and heat (share
+  // of the hottest block) on block lines, the taken share on conditional
+  // jumps. Still one line per block and instruction, as perf expects.
+  void dump(const BranchProfile *profile = nullptr) const;
+};
+
+struct Exit : public Instruction {
+  Exit() : Instruction(Type::Exit) {}
+
+  void dump() const override { std::printf("Exit\n"); }
+};
+
+struct LoadImmediate : public Instruction {
+  VM_Value value;
+
+  LoadImmediate(VM_Value value) : Instruction(Type::LoadImmediate), value(value) {}
+
+  void dump() const override { std::printf("LoadImmediate $%lu\n", value); }
+};
+
+struct Store : public Instruction {
+  VM_Register reg{0};
+
+  Store(VM_Register reg) : Instruction(Type::Store), reg(reg) {}
+
+  void dump() const override { std::printf("Store Reg(%lu)\n", reg); }
+};
+
+struct Load : public Instruction {
+  VM_Register reg{0};
+
+  Load(VM_Register reg) : Instruction(Type::Load), reg(reg) {}
+
+  void dump() const { std::printf("Load Reg(%lu)\n", reg); }
+};
+
+struct SetLocal : public Instruction {
+  VM_Local local{0};
+
+  SetLocal(VM_Local local) : Instruction(Type::SetLocal), local(local) {}
+
+  void dump() const override { std::printf("SetLocal %lu\n", local); }
+};
+
+struct GetLocal : public Instruction {
+  VM_Local local{0};
+
+  GetLocal(VM_Local local) : Instruction(Type::GetLocal), local(local) {}
+
+  void dump() const override { std::printf("GetLocal %lu\n", local); }
+};
+
+struct Increment : public Instruction {
+  Increment() : Instruction(Type::Increment) {}
+
+  void dump() const override { std::printf("Increment\n"); }
+};
+
+struct Jump : public Instruction {
+  BasicBlock &target_block;
+
+  Jump(BasicBlock &target_block) : Instruction(Type::Jump), target_block(target_block) {}
+
+  void dump() const override { std::printf("Jump %p\n", &target_block); }
+};
+
+struct JumpConditional : public Instruction {
+  BasicBlock &true_block;
+  BasicBlock &false_block;
+
+  JumpConditional(BasicBlock &true_block, BasicBlock &false_block)
+      : Instruction(Type::JumpConditional), true_block(true_block), false_block(false_block) {}
+
+  void dump() const override {
+    std::printf("JumpConditional (%p) : (%p)\n", &true_block, &false_block);
+  }
+};
+
+inline void Program::dump(const BranchProfile *profile) const {
+  u64 hottest = profile ? std::max<u64>(profile->hottest(), 1) : 1;
+  char gutter[48];
+  for (const auto &block : blocks) {
+    u32 index = block->index;
+    if (profile && index < profile->block_count()) {
+      std::snprintf(gutter, sizeof(gutter), "%12lu %5.1f%%", profile->entries[index],
+                    100.0 * profile->entries[index] / hottest);
+      std::printf("%20s | ", gutter);
+    } else if (profile) {
+      std::printf("%20s | ", "");
+    }
+    std::printf("%p:\n", block.get());
+
+    for (const auto &instruction : block->instructions) {
+      if (profile) {
+        gutter[0] = 0;
+        if (instruction->type == Instruction::Type::JumpConditional &&
+            index < profile->block_count() && profile->taken_ratio(index) >= 0) {
+          std::snprintf(gutter, sizeof(gutter), "taken %5.1f%%", 100 * profile->taken_ratio(index));
+        }
+        std::printf("%20s | ", gutter);
+      }
+      std::printf("  ");
+      instruction->dump();
+    }
+  }
+}
+
+struct LessThan : public Instruction {
+  VM_Register lhs{0};
+
+  LessThan(VM_Register lhs) : Instruction(Type::LessThan), lhs(lhs) {}
+
+  void dump() const override { std::printf("LessThan Reg(%lu)\n", lhs); }
+};
+
+struct Add : public Instruction {
+  VM_Register lhs{0};
+
+  Add(VM_Register lhs) : Instruction(Type::Add), lhs(lhs) {}
+
+  void dump() const override { std::printf("Add Reg(%lu)\n", lhs); }
+};
+
+// Registers and locals that hold heap references at a safepoint. Written
+// by whoever builds the Program; neither the Jit nor the interpreter can
+// derive it, as VM values are untyped. A register or local missing from
+// the map is neither traced nor updated, so it dangles once the collector
+// frees or moves its object.
+struct StackMap {
+  std::vector<VM_Register> registers;
+  std::vector<VM_Local> locals;
+};
+
+struct Allocate : public Instruction {
+  u32 slot_count{0};
+  u32 reference_slots{0};
+  StackMap stack_map;
+
+  Allocate(u32 slot_count, u32 reference_slots, StackMap stack_map)
+      : Instruction(Type::Allocate),
+        slot_count(slot_count),
+        reference_slots(reference_slots),
+        stack_map(std::move(stack_map)) {}
+
+  void dump() const override {
+    std::printf("Allocate %u (%u references)\n", slot_count, reference_slots);
+  }
+};
+
+struct GetField : public Instruction {
+  VM_Register object{0};
+  u32 index{0};
+
+  GetField(VM_Register object, u32 index)
+      : Instruction(Type::GetField), object(object), index(index) {}
+
+  void dump() const override { std::printf("GetField Reg(%lu)[%u]\n", object, index); }
+};
+
+struct SetField : public Instruction {
+  VM_Register object{0};
+  u32 index{0};
+
+  SetField(VM_Register object, u32 index)
+      : Instruction(Type::SetField), object(object), index(index) {}
+
+  void dump() const override { std::printf("SetField Reg(%lu)[%u]\n", object, index); }
+};
+
+// Calls a host function with the given registers as arguments. The result,
+// if any, goes to register 0.
+struct CallHost : public Instruction {
+  const HostFunction &function;
+  std::vector<VM_Register> arguments;
+
+  CallHost(const HostFunction &function, std::vector<VM_Register> arguments)
+      : Instruction(Type::CallHost), function(function), arguments(std::move(arguments)) {
+    if (this->arguments.size() != function.argument_count) {
+      throw std::runtime_error("Wrong number of arguments to host function " + function.name);
+    }
+  }
+
+  void dump() const override {
+    std::printf("CallHost %s(", function.name.c_str());
+    for (size_t i = 0; i < arguments.size(); ++i) {
+      std::printf(i ? ", Reg(%lu)" : "Reg(%lu)", arguments[i]);
+    }
+    std::printf(")\n");
+  }
+};
+
+// Where the machine code for one VM instruction starts.
+struct CodeLocation {
+  u32 offset;
+  u32 block;
+  u32 instruction;
+};
+
+// The counters an instrumented Executable increments. For every block:
+// entries, then taken and not-taken counts of the JumpConditional ending
+// it. Each thread running the code gets its own array, so JIT code uses
+// plain increments; `snapshot` sums them and may run at any time.
+struct JitCounters {
+  explicit JitCounters(size_t block_count) : block_count(block_count) {}
+
+  JitCounters(const JitCounters &)            = delete;
+  JitCounters &operator=(const JitCounters &) = delete;
+
+  size_t block_count;
+
+  size_t entry_counter(u32 block) const { return block; }
+  size_t taken_counter(u32 block) const { return block_count + block; }
+  size_t not_taken_counter(u32 block) const { return 2 * block_count + block; }
+
+  u64 *for_this_thread() {
+    // The JitCounters this thread used last, by id rather than address,
+    // which a later JitCounters may reuse. Ids are never reused, so a
+    // destroyed one cannot match.
+    thread_local u64 cached_id = ~u64(0);
+    thread_local u64 *cached_array{};
+    if (cached_id == id) {
+      return cached_array;
+    }
+
+    auto thread = std::this_thread::get_id();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = std::find_if(threads.begin(), threads.end(), [&](const ThreadCounters &counters) {
+      return counters.thread == thread;
+    });
+    if (it == threads.end()) {
+      // A thread that reuses the id of an exited one takes over its array.
+      threads.push_back({thread, std::make_unique<u64[]>(3 * block_count)});
+      it = threads.end() - 1;
+    }
+    cached_id    = id;
+    cached_array = it->counters.get();
+    return cached_array;
+  }
+
+  BranchProfile snapshot() const {
+    BranchProfile profile(block_count);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &[thread, counters] : threads) {
+      for (u32 block = 0; block < block_count; ++block) {
+        profile.entries[block] += load(counters[entry_counter(block)]);
+        profile.taken[block] += load(counters[taken_counter(block)]);
+        profile.not_taken[block] += load(counters[not_taken_counter(block)]);
+      }
+    }
+    return profile;
+  }
+
+ private:
+  // Written by JIT code on another thread; aligned 64-bit loads see whole
+  // values.
+  static u64 load(const u64 &counter) { return __atomic_load_n(&counter, __ATOMIC_RELAXED); }
+
+  static u64 next_id() {
+    static std::atomic<u64> ids{};
+    return ids.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  struct ThreadCounters {
+    std::thread::id thread;
+    std::unique_ptr<u64[]> counters;
+  };
+
+  u64 id = next_id();
+  mutable std::mutex mutex;
+  std::vector<ThreadCounters> threads;
+};
+
+struct Executable {
+  Executable(size_t size) : size(size) {
+    data =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("Memory allocation failed");
+    }
+    mapped();
+  }
+
+  // Takes over a mapping made elsewhere, see CodeBuffer::release.
+  Executable(std::pair<void *, size_t> mapping) : data(mapping.first), size(mapping.second) {
+    mapped();
+  }
+
+  Executable(const Executable &)            = delete;
+  Executable &operator=(const Executable &) = delete;
+
+  Executable(Executable &&other) noexcept
+      : data(other.data),
+        size(other.size),
+        code_size(other.code_size),
+        unwind_info(std::move(other.unwind_info)),
+        block_offsets(std::move(other.block_offsets)),
+        locations(std::move(other.locations)),
+        counters(std::move(other.counters)) {
+    other.data = MAP_FAILED;
+    other.unwind_info.clear();
+  }
+
+  ~Executable() {
+    if (!unwind_info.empty()) {
+      __deregister_frame(unwind_info.data());
+    }
+    if (data != MAP_FAILED) {
+      munmap(data, size);
+      VM_PROBE2(code_free, data, size);
+      Stats::add(Stat::ExecutablesUnmapped);
+      Stats::add(Stat::CodeBytesUnmapped, size);
+      Tracer::instant("executable.unmap", "bytes", size);
+    }
+  }
+
+  // Makes the code visible to the unwinder, so exceptions, debuggers and
+  // profilers can walk through it. Nothing is looked up until an unwind.
+  void register_unwind_info(std::vector<u8> eh_frame) {
+    unwind_info = std::move(eh_frame);
+    __register_frame(unwind_info.data());
+  }
+
+  void finalize() {
+    if (mprotect(data, size, PROT_READ | PROT_EXEC) != 0) {
+      throw std::runtime_error("Failed to change memory protection");
+    }
+  }
+
+  void *data;
+  size_t size;
+  // Bytes of code at the start of the mapping; the rest of `size` is padding.
+  size_t code_size{};
+  std::vector<u8> unwind_info;
+  // Where each block's code starts, by BasicBlock::index. Code between a
+  // block's offset and its first location is the block entry counter.
+  std::vector<u32> block_offsets;
+  // Sorted by offset, one entry per compiled instruction.
+  std::vector<CodeLocation> locations;
+  // Set when compiled with JitOptions::count_branches.
+  std::unique_ptr<JitCounters> counters;
+
+ private:
+  void mapped() {
+    VM_PROBE2(code_alloc, data, size);
+    Stats::add(Stat::ExecutablesMapped);
+    Stats::add(Stat::CodeBytesMapped, size);
+  }
+};
+
+struct Assembler {
+  // Relocations are only needed while compiling and go in `scratch`.
+  Assembler(CodeBuffer &buf, Arena &scratch) : buf(buf), relocations(scratch) {}
+  CodeBuffer &buf;
+
+  // A rel32 at `site` that must point at the start of block `block`.
+  struct Relocation {
+    u32 site;
+    u32 block;
+  };
+  std::vector<Relocation, ArenaAllocator<Relocation>> relocations;
+
+  enum class Reg {
+    // General purpose registers
+    R0 = 0,  // RAX
+    R1 = 1,  // RCX
+
+    // VM registers
+    RegisterArrayBase = 6,  // RSI
+    LocalArrayBase    = 2,  // RDX
+    VMBase            = 7,  // RDI
+
+    // Stack registers
+    StackPointer = 4,  // RSP
+    FramePointer = 5,  // RBP
+
+    // System V integer argument registers
+    Argument0 = 7,  // RDI
+    Argument1 = 6,  // RSI
+    Argument2 = 2,  // RDX
+    Argument3 = 1,  // RCX
+    Argument4 = 8,  // R8
+    Argument5 = 9,  // R9
+  };
+
+  static constexpr Reg argument_registers[] = {
+      Reg::Argument0, Reg::Argument1, Reg::Argument2,
+      Reg::Argument3, Reg::Argument4, Reg::Argument5,
+  };
+
+  enum class Condition : u8 {
+    AboveOrEqual   = 0x83,
+    Equal          = 0x84,
+    NotEqual       = 0x85,
+    Above          = 0x87,
+    GreaterOrEqual = 0x8d,
+  };
+
+  struct Operand {
+    enum class Type {
+      Reg,
+      Imm64,
+      Mem64BaseAndOffset,
+    };
+
+    Type type;
+    Reg reg;
+    u64 offset_or_immediate;
+
+    static Operand Register(Reg reg) {
+      Operand result{};
+      result.type = Type::Reg;
+      result.reg  = reg;
+      return result;
+    }
+
+    static Operand Imm64(u64 immediate) {
+      Operand result{};
+      result.type                = Type::Imm64;
+      result.offset_or_immediate = immediate;
+      return result;
+    }
+
+    static Operand Mem64BaseAndOffset(Reg base, u64 offset) {
+      Operand result{};
+      result.type                = Type::Mem64BaseAndOffset;
+      result.reg                 = base;
+      result.offset_or_immediate = offset;
+      return result;
+    }
+  };
+
+  void mov(Operand dst, Operand src) {
+    if (dst.type == Operand::Type::Reg && src.type == Operand::Type::Reg) {
+      // MOV reg, reg
+      emit_rex_w(src.reg, dst.reg);
+      emit8(0x89);
+      emit8(0xc0 | (low_bits(src.reg) << 3) | low_bits(dst.reg));
+      return;
+    }
+
+    if (dst.type == Operand::Type::Reg && src.type == Operand::Type::Imm64) {
+      // MOV reg, imm64
+      emit_rex_w(Reg::R0, dst.reg);
+      emit8(0xb8 | low_bits(dst.reg));
+      emit64(src.offset_or_immediate);
+      return;
+    }
+
+    if (dst.type == Operand::Type::Mem64BaseAndOffset && src.type == Operand::Type::Reg) {
+      // MOV qword [base + offset], reg
+      emit_rex_w(src.reg, dst.reg);
+      emit8(0x89);
+      emit8(0x80 | (low_bits(src.reg) << 3) | low_bits(dst.reg));
+      emit32(dst.offset_or_immediate);
+      return;
+    }
+
+    if (dst.type == Operand::Type::Reg && src.type == Operand::Type::Mem64BaseAndOffset) {
+      // MOV reg, qword [base + offset]
+      emit_rex_w(dst.reg, src.reg);
+      emit8(0x8b);
+      emit8(0x80 | (low_bits(dst.reg) << 3) | low_bits(src.reg));
+      emit32(src.offset_or_immediate);
+      return;
+    }
+
+    throw std::runtime_error("Unsupported MOV operation");
+  }
+
+  static u8 low_bits(Reg reg) { return narrow_cast<u8>(reg) & 7; }
+
+  // REX.W, plus REX.R/REX.B when the ModRM reg/rm operand is R8-R15.
+  void emit_rex_w(Reg reg, Reg rm) {
+    emit8(0x48 | ((narrow_cast<u8>(reg) >> 3) << 2) | (narrow_cast<u8>(rm) >> 3));
+  }
+
+  void emit8(u8 byte) { buf.push_back(byte); }
+
+  void emit16(u16 word) { buf.append(word, 2); }
+
+  void emit32(u32 dword) { buf.append(dword, 4); }
+
+  void emit64(u64 qword) { buf.append(qword, 8); }
+
+  void load_immediate64(Reg dst, u64 value) { mov(Operand::Register(dst), Operand::Imm64(value)); }
+
+  void store_vm_register(VM_Register dst, Reg src) {
+    mov(Operand::Mem64BaseAndOffset(Reg::RegisterArrayBase, dst * sizeof(VM_Register)),
+        Operand::Register(src));
+  }
+
+  void load_vm_register(Reg dst, VM_Register src) {
+    mov(Operand::Register(dst),
+        Operand::Mem64BaseAndOffset(Reg::RegisterArrayBase, src * sizeof(VM_Register)));
+  }
+
+  void store_vm_local(VM_Local local, Reg src) {
+    mov(Operand::Mem64BaseAndOffset(Reg::LocalArrayBase, local * sizeof(VM_Local)),
+        Operand::Register(src));
+  }
+
+  void load_vm_local(Reg dst, VM_Local local) {
+    mov(Operand::Register(dst),
+        Operand::Mem64BaseAndOffset(Reg::LocalArrayBase, local * sizeof(VM_Local)));
+  }
+
+  void increment(Reg reg) {
+    emit8(0x48);
+    emit8(0xff);
+    emit8(0xc0 | narrow_cast<u8>(reg));
+  }
+
+  void increment(Operand dst) {
+    if (dst.type != Operand::Type::Mem64BaseAndOffset) {
+      throw std::runtime_error("Unsupported INC operation");
+    }
+    // INC qword [base + offset]
+    emit_rex_w(Reg::R0, dst.reg);
+    emit8(0xff);
+    emit8(0x80 | low_bits(dst.reg));
+    emit32(dst.offset_or_immediate);
+  }
+
+  void test(Reg reg) {
+    // TEST reg, reg
+    emit_rex_w(reg, reg);
+    emit8(0x85);
+    emit8(0xc0 | (low_bits(reg) << 3) | low_bits(reg));
+  }
+
+  void add(Reg dst, Reg src) {
+    // ADD dst, src
+    emit8(0x48);
+    emit8(0x01);
+    emit8(0xc0 | (narrow_cast<u8>(src) << 3) | narrow_cast<u8>(dst));
+  }
+
+  void less_than(Reg dst, Reg src) {
+    // CMP src, dst
+    emit8(0x48);
+    emit8(0x39);
+    emit8(0xc0 | (narrow_cast<u8>(src) << 3) | narrow_cast<u8>(dst));
+
+    // SETL dst
+    emit8(0x0f);
+    emit8(0x9c);
+    emit8(0xc0 | narrow_cast<u8>(dst));
+
+    // MOVZX dst, dst
+    emit8(0x48);
+    emit8(0x0f);
+    emit8(0xb6);
+    emit8(0xc0 | narrow_cast<u8>(dst) << 3 | narrow_cast<u8>(dst));
+  }
+
+  void jump(BasicBlock &target_block) {
+    // jmp target_block (RIP-relative 32-bit offset)
+    emit8(0xe9);
+    relocations.push_back({narrow_cast<u32>(buf.size()), target_block.index});
+    emit32(0xdeadbeef);  // placeholder, will patch later
+  }
+
+  void jump_conditional(Reg cond, BasicBlock &true_block, BasicBlock &false_block) {
+    // if reg != 0, jump to false_block, else jump to true_block
+    emit8(0x48);
+    emit8(0x83);
+    emit8(0xf8);
+    emit8(0x00 | narrow_cast<u8>(cond));
+
+    // jz false_target (RIP-related 32-bit offset)
+    emit8(0x0f);
+    emit8(0x84);
+    relocations.push_back({narrow_cast<u32>(buf.size()), false_block.index});
+    emit32(0xdeadbeef);  // placeholder, will patch later
+
+    // jmp true_target (RIP-related 32-bit offset)
+    jump(true_block);
+  }
+
+  void add_immediate(Reg dst, u32 value) {
+    // ADD dst, imm32
+    emit8(0x48);
+    emit8(0x81);
+    emit8(0xc0 | narrow_cast<u8>(dst));
+    emit32(value);
+  }
+
+  void subtract_immediate(Reg dst, u32 value) {
+    // SUB dst, imm32
+    emit8(0x48);
+    emit8(0x81);
+    emit8(0xe8 | narrow_cast<u8>(dst));
+    emit32(value);
+  }
+
+  void subtract(Reg dst, Operand src) {
+    if (src.type != Operand::Type::Mem64BaseAndOffset) {
+      throw std::runtime_error("Unsupported SUB operation");
+    }
+    // SUB dst, qword [base + offset]
+    emit8(0x48);
+    emit8(0x2b);
+    emit8(0x80 | (narrow_cast<u8>(dst) << 3) | narrow_cast<u8>(src.reg));
+    emit32(src.offset_or_immediate);
+  }
+
+  void compare(Reg lhs, Operand rhs) {
+    if (rhs.type != Operand::Type::Mem64BaseAndOffset) {
+      throw std::runtime_error("Unsupported CMP operation");
+    }
+    // CMP lhs, qword [base + offset]
+    emit8(0x48);
+    emit8(0x3b);
+    emit8(0x80 | (narrow_cast<u8>(lhs) << 3) | narrow_cast<u8>(rhs.reg));
+    emit32(rhs.offset_or_immediate);
+  }
+
+  void push(Reg reg) { emit8(0x50 | narrow_cast<u8>(reg)); }
+
+  void pop(Reg reg) { emit8(0x58 | narrow_cast<u8>(reg)); }
+
+  // RDI, RSI and RDX hold the VM and the VM register bases for the whole
+  // program; they are the only caller-saved registers live across a call.
+  // The frame is 16-byte aligned after the prologue, three pushes and one
+  // padding slot keep it that way.
+  void push_live_registers() {
+    push(Reg::VMBase);
+    push(Reg::RegisterArrayBase);
+    push(Reg::LocalArrayBase);
+    subtract_immediate(Reg::StackPointer, 8);
+  }
+
+  void pop_live_registers() {
+    add_immediate(Reg::StackPointer, 8);
+    pop(Reg::LocalArrayBase);
+    pop(Reg::RegisterArrayBase);
+    pop(Reg::VMBase);
+  }
+
+  void call(const void *function) {
+    load_immediate64(Reg::R0, reinterpret_cast<u64>(function));
+    // CALL R0
+    emit8(0xff);
+    emit8(0xd0 | narrow_cast<u8>(Reg::R0));
+  }
+
+  // Calls `function(VM&, argument)`. The result is in R0.
+  void call_runtime(const void *function, const void *argument) {
+    push_live_registers();
+    mov(Operand::Register(Reg::Argument1), Operand::Imm64(reinterpret_cast<u64>(argument)));
+    call(function);
+    pop_live_registers();
+  }
+
+  // Calls a host function with the given VM registers as arguments, after the
+  // VM itself when `pass_vm` is set. The result is in R0.
+  void call_host(const void *function, bool pass_vm, const std::vector<VM_Register> &arguments) {
+    push_live_registers();
+    // The register array base is about to be overwritten by an argument.
+    mov(Operand::Register(Reg::R0), Operand::Register(Reg::RegisterArrayBase));
+    size_t first = pass_vm ? 1 : 0;
+    for (size_t i = 0; i < arguments.size(); ++i) {
+      mov(Operand::Register(argument_registers[first + i]),
+          Operand::Mem64BaseAndOffset(Reg::R0, arguments[i] * sizeof(VM_Register)));
+    }
+    call(function);
+    pop_live_registers();
+  }
+
+  // Forward jumps inside the code of a single instruction. They return the
+  // offset of the placeholder, which `bind` patches to the current position.
+  size_t jump_forward() {
+    emit8(0xe9);
+    size_t placeholder = buf.size();
+    emit32(0xdeadbeef);
+    return placeholder;
+  }
+
+  size_t jump_forward_if(Condition condition) {
+    emit8(0x0f);
+    emit8(narrow_cast<u8>(condition));
+    size_t placeholder = buf.size();
+    emit32(0xdeadbeef);
+    return placeholder;
+  }
+
+  void bind(size_t placeholder) {
+    buf.patch32(placeholder, narrow_cast<u32>(buf.size() - placeholder - 4));
+  }
+
+  // Jumps back to code already emitted at `target`, for loops.
+  void jump_backward(size_t target) {
+    emit8(0xe9);
+    emit32(narrow_cast<u32>(target - (buf.size() + 4)));
+  }
+
+  void jump_backward_if(Condition condition, size_t target) {
+    emit8(0x0f);
+    emit8(narrow_cast<u8>(condition));
+    emit32(narrow_cast<u32>(target - (buf.size() + 4)));
+  }
+
+  // 32-bit forms, for code working on C++ ints. Writing a 32-bit register
+  // clears its upper half. Memory operands are [base + offset] with a
+  // signed offset; the base must not be RSP or R12.
+
+  // REX.R/REX.B when the ModRM reg/rm operand is R8-R15, and nothing
+  // otherwise.
+  void emit_rex(Reg reg, Reg rm) {
+    u8 rex = narrow_cast<u8>(((narrow_cast<u8>(reg) >> 3) << 2) | (narrow_cast<u8>(rm) >> 3));
+    if (rex) {
+      emit8(0x40 | rex);
+    }
+  }
+
+  void load_immediate32(Reg dst, u32 value) {
+    // MOV r32, imm32
+    emit_rex(Reg::R0, dst);
+    emit8(0xb8 | low_bits(dst));
+    emit32(value);
+  }
+
+  void load32(Reg dst, Reg base, int offset) {
+    // MOV r32, dword [base + offset]
+    emit_rex(dst, base);
+    emit8(0x8b);
+    emit8(0x80 | (low_bits(dst) << 3) | low_bits(base));
+    emit32(narrow_cast<u32>(offset));
+  }
+
+  void store32(Reg base, int offset, Reg src) {
+    // MOV dword [base + offset], r32
+    emit_rex(src, base);
+    emit8(0x89);
+    emit8(0x80 | (low_bits(src) << 3) | low_bits(base));
+    emit32(narrow_cast<u32>(offset));
+  }
+
+  void increment32(Reg base, int offset) {
+    // INC dword [base + offset]
+    emit_rex(Reg::R0, base);
+    emit8(0xff);
+    emit8(0x80 | low_bits(base));
+    emit32(narrow_cast<u32>(offset));
+  }
+
+  void decrement32(Reg reg) {
+    // DEC r32
+    emit_rex(Reg::R0, reg);
+    emit8(0xff);
+    emit8(0xc8 | low_bits(reg));
+  }
+
+  void add32(Reg dst, Reg src) {
+    // ADD dst, src
+    emit_rex(src, dst);
+    emit8(0x01);
+    emit8(0xc0 | (low_bits(src) << 3) | low_bits(dst));
+  }
+
+  // Sets the flags for a signed `lhs < rhs`.
+  void compare32(Reg lhs, Reg rhs) {
+    // CMP lhs, rhs
+    emit_rex(rhs, lhs);
+    emit8(0x39);
+    emit8(0xc0 | (low_bits(rhs) << 3) | low_bits(lhs));
+  }
+
+  // 1 in `dst` if the last compare32 was less, 0 otherwise.
+  void set_less32(Reg dst) {
+    // Without a REX, byte registers 4-7 are AH..BH rather than SPL..DIL.
+    bool rex = narrow_cast<u8>(dst) >= 4;
+
+    // SETL dst8
+    if (rex) {
+      emit8(0x40 | (narrow_cast<u8>(dst) >> 3));
+    }
+    emit8(0x0f);
+    emit8(0x9c);
+    emit8(0xc0 | low_bits(dst));
+
+    // MOVZX dst32, dst8
+    if (rex) {
+      emit8(0x40 | ((narrow_cast<u8>(dst) >> 3) << 2) | (narrow_cast<u8>(dst) >> 3));
+    }
+    emit8(0x0f);
+    emit8(0xb6);
+    emit8(0xc0 | (low_bits(dst) << 3) | low_bits(dst));
+  }
+
+  void push_immediate8(u8 value) {
+    // PUSH imm8, sign-extended to 64 bits
+    emit8(0x6a);
+    emit8(value);
+  }
+
+  // Standard frame, so frame-pointer walkers and the .eh_frame agree. Keep in
+  // sync with the sizes in EhFrameBuilder.
+  void prologue() {
+    push(Reg::FramePointer);
+    mov(Operand::Register(Reg::FramePointer), Operand::Register(Reg::StackPointer));
+  }
+
+  void exit() {
+    pop(Reg::FramePointer);
+    emit8(0xc3);
+  }
+};
+
+struct VM;
+inline HeapObject *vm_allocate_slow(VM &vm, const Allocate &instruction);
+inline void vm_write_barrier(VM &vm, const SetField &instruction);
+inline size_t vm_jit_counters_offset();
+
+struct JitOptions {
+  // Count block entries and conditional branch outcomes into the
+  // Executable's JitCounters.
+  bool count_branches = false;
+};
+
+struct Jit {
+  void compile_load_immediate(LoadImmediate const &instruction) {
+    assembler.load_immediate64(Assembler::Reg::R0, instruction.value);
+    assembler.store_vm_register(VM_Register(0), Assembler::Reg::R0);
+  }
+
+  void compile_load(Load const &instruction) {
+    assembler.load_vm_register(Assembler::Reg::R0, instruction.reg);
+    assembler.store_vm_register(VM_Register(0), Assembler::Reg::R0);
+  }
+
+  void compile_store(Store const &instruction) {
+    assembler.load_vm_register(Assembler::Reg::R0, VM_Register(0));
+    assembler.store_vm_register(instruction.reg, Assembler::Reg::R0);
+  }
+
+  void compile_get_local(GetLocal const &instruction) {
+    assembler.load_vm_local(Assembler::Reg::R0, instruction.local);
+    assembler.store_vm_register(VM_Register(0), Assembler::Reg::R0);
+  }
+
+  void compile_set_local(SetLocal const &instruction) {
+    assembler.load_vm_register(Assembler::Reg::R0, VM_Register(0));
+    assembler.store_vm_local(instruction.local, Assembler::Reg::R0);
+  }
+
+  void compile_increment(Increment const &) {
+    assembler.load_vm_register(Assembler::Reg::R0, VM_Register(0));
+    assembler.increment(Assembler::Reg::R0);
+    assembler.store_vm_register(VM_Register(0), Assembler::Reg::R0);
+  }
+
+  void compile_add(Add const &instruction) {
+    assembler.load_vm_register(Assembler::Reg::R0, instruction.lhs);
+    assembler.load_vm_register(Assembler::Reg::R1, VM_Register(0));
+    assembler.add(Assembler::Reg::R0, Assembler::Reg::R1);
+    assembler.store_vm_register(VM_Register(0), Assembler::Reg::R0);
+  }
+
+  void compile_less_than(LessThan const &instruction) {
+    assembler.load_vm_register(Assembler::Reg::R0, instruction.lhs);
+    assembler.load_vm_register(Assembler::Reg::R1, VM_Register(0));
+    assembler.less_than(Assembler::Reg::R0, Assembler::Reg::R1);
+    assembler.store_vm_register(VM_Register(0), Assembler::Reg::R0);
+  }
+
+  // Relocations only carry the block index, so a block of another Program
+  // must be caught here, before it turns into this Program's block.
+  void check_target(const BasicBlock &block) const {
+    if (block.index >= program->blocks.size() || program->blocks[block.index].get() != &block) {
+      throw std::runtime_error("Jump to a block outside the Program");
+    }
+  }
+
+  void compile_jump(Jump const &instruction) {
+    check_target(instruction.target_block);
+    assembler.jump(instruction.target_block);
+  }
+
+  void compile_jump_conditional(JumpConditional const &instruction) {
+    check_target(instruction.true_block);
+    check_target(instruction.false_block);
+    assembler.load_vm_register(Assembler::Reg::R0, VM_Register(0));
+    if (!counters) {
+      assembler.jump_conditional(Assembler::Reg::R0, instruction.true_block,
+                                 instruction.false_block);
+      return;
+    }
+
+    // Each edge gets its own increment before leaving the block.
+    assembler.test(Assembler::Reg::R0);
+    auto false_edge = assembler.jump_forward_if(Assembler::Condition::Equal);
+    count(counters->taken_counter(current_block));
+    assembler.jump(instruction.true_block);
+    assembler.bind(false_edge);
+    count(counters->not_taken_counter(current_block));
+    assembler.jump(instruction.false_block);
+  }
+
+  // Increments a counter in the array VM::run installed for this thread.
+  // Clobbers R0, which holds nothing between instructions.
+  void count(size_t counter) {
+    assembler.mov(Assembler::Operand::Register(Assembler::Reg::R0),
+                  Assembler::Operand::Mem64BaseAndOffset(Assembler::Reg::VMBase,
+                                                         vm_jit_counters_offset()));
+    assembler.increment(Assembler::Operand::Mem64BaseAndOffset(Assembler::Reg::R0,
+                                                               counter * sizeof(u64)));
+  }
+
+  void compile_exit(Exit const &) {
+    epilogues.push_back(buf.size());
+    assembler.exit();
+  }
+
+  // The heap is the first member of VM, so its fields are addressed off RDI.
+  static Assembler::Operand heap_field(size_t offset) {
+    return Assembler::Operand::Mem64BaseAndOffset(Assembler::Reg::VMBase, offset);
+  }
+
+  // Inline bump allocation in the nursery. When it is full the slow path
+  // collects, using the stack map of this instruction as the safepoint roots.
+  // Nothing is kept in machine registers across instructions, so the VM
+  // registers and locals named by the stack map are the only roots.
+  void compile_allocate(Allocate const &instruction) {
+    u32 size = narrow_cast<u32>(sizeof(HeapObject) + instruction.slot_count * sizeof(VM_Value));
+
+    assembler.mov(Assembler::Operand::Register(Assembler::Reg::R0),
+                  heap_field(offsetof(Heap, nursery_top)));
+    assembler.add_immediate(Assembler::Reg::R0, size);
+    assembler.compare(Assembler::Reg::R0, heap_field(offsetof(Heap, nursery_end)));
+    auto slow_path = assembler.jump_forward_if(Assembler::Condition::Above);
+
+    assembler.mov(heap_field(offsetof(Heap, nursery_top)),
+                  Assembler::Operand::Register(Assembler::Reg::R0));
+    assembler.subtract_immediate(Assembler::Reg::R0, size);
+    assembler.load_immediate64(
+        Assembler::Reg::R1,
+        HeapObject::header_word(instruction.slot_count, instruction.reference_slots));
+    assembler.mov(Assembler::Operand::Mem64BaseAndOffset(Assembler::Reg::R0, 0),
+                  Assembler::Operand::Register(Assembler::Reg::R1));
+    auto done = assembler.jump_forward();
+
+    assembler.bind(slow_path);
+    assembler.call_runtime(reinterpret_cast<const void *>(&vm_allocate_slow), &instruction);
+
+    assembler.bind(done);
+    assembler.store_vm_register(VM_Register(0), Assembler::Reg::R0);
+  }
+
+  void compile_get_field(GetField const &instruction) {
+    assembler.load_vm_register(Assembler::Reg::R0, instruction.object);
+    assembler.mov(Assembler::Operand::Register(Assembler::Reg::R0),
+                  Assembler::Operand::Mem64BaseAndOffset(
+                      Assembler::Reg::R0,
+                      sizeof(HeapObject) + instruction.index * sizeof(VM_Value)));
+    assembler.store_vm_register(VM_Register(0), Assembler::Reg::R0);
+  }
+
+  // Stores a value and only leaves the inline path when the stored value
+  // points into the nursery, the slow path filters out the rest.
+  void compile_set_field(SetField const &instruction) {
+    assembler.load_vm_register(Assembler::Reg::R0, instruction.object);
+    assembler.load_vm_register(Assembler::Reg::R1, VM_Register(0));
+    assembler.mov(Assembler::Operand::Mem64BaseAndOffset(
+                      Assembler::Reg::R0,
+                      sizeof(HeapObject) + instruction.index * sizeof(VM_Value)),
+                  Assembler::Operand::Register(Assembler::Reg::R1));
+    assembler.subtract(Assembler::Reg::R1, heap_field(offsetof(Heap, nursery_begin)));
+    assembler.compare(Assembler::Reg::R1, heap_field(offsetof(Heap, nursery_size)));
+    auto done = assembler.jump_forward_if(Assembler::Condition::AboveOrEqual);
+    assembler.call_runtime(reinterpret_cast<const void *>(&vm_write_barrier), &instruction);
+    assembler.bind(done);
+  }
+
+  // Intrinsics are expanded inline, everything else becomes a direct call.
+  void compile_call_host(CallHost const &instruction) {
+    auto &function = instruction.function;
+    if (function.intrinsic) {
+      function.intrinsic(assembler, instruction.arguments);
+    } else {
+      assembler.call_host(reinterpret_cast<const void *>(function.function), function.takes_vm,
+                          instruction.arguments);
+    }
+    if (function.returns_value) {
+      assembler.store_vm_register(VM_Register(0), Assembler::Reg::R0);
+    }
+  }
+
+  static Executable compile(const Program &program, const JitOptions &options = {}) {
+    // Counted as a failure unless compilation gets to the end.
+    struct CompileScope {
+      u64 start       = Stats::now_ns();
+      u64 trace_start = Tracer::enabled() ? Tracer::now() : 0;
+      bool compiled{};
+      ~CompileScope() {
+        if (!compiled) {
+          Stats::add(Stat::CompileFailures);
+        }
+      }
+    } compile_scope;
+    if (VM_PROBE_ENABLED(compile_start)) {
+      VM_PROBE3(compile_start, program.hash(), program.name.c_str(), program.instruction_count());
+    }
+
+    Jit jit;
+    jit.program = &program;
+    std::unique_ptr<JitCounters> counters;
+    if (options.count_branches) {
+      counters     = std::make_unique<JitCounters>(program.blocks.size());
+      jit.counters = counters.get();
+    }
+
+    // One pass over the Program; jumps are resolved from `block_offsets`
+    // afterwards, so the Program itself is left untouched.
+    std::vector<u32> block_offsets(program.blocks.size());
+    size_t instruction_count = program.instruction_count();
+    jit.locations.reserve(instruction_count);
+    // Most blocks end in a jump or two.
+    jit.assembler.relocations.reserve(program.blocks.size() * 2);
+    // Address space only: pages are backed as code is written into them.
+    jit.buf.reserve(instruction_count * 32);
+
+    jit.assembler.prologue();
+    for (u32 block_index = 0; block_index < program.blocks.size(); ++block_index) {
+      auto &block                = program.blocks[block_index];
+      block_offsets[block_index] = narrow_cast<u32>(jit.buf.size());
+      jit.current_block          = block_index;
+      if (jit.counters) {
+        jit.count(jit.counters->entry_counter(block_index));
+      }
+      for (u32 instruction_index = 0; instruction_index < block->instructions.size();
+           ++instruction_index) {
+        auto &instruction = block->instructions[instruction_index];
+        jit.locations.push_back({narrow_cast<u32>(jit.buf.size()), block_index, instruction_index});
+        switch (instruction->type) {
+          case Instruction::Type::LoadImmediate:
+            jit.compile_load_immediate(*static_cast<LoadImmediate *>(instruction.get()));
+            break;
+          case Instruction::Type::Load:
+            jit.compile_load(*static_cast<Load *>(instruction.get()));
+            break;
+          case Instruction::Type::Store:
+            jit.compile_store(*static_cast<Store *>(instruction.get()));
+            break;
+          case Instruction::Type::SetLocal:
+            jit.compile_set_local(*static_cast<SetLocal *>(instruction.get()));
+            break;
+          case Instruction::Type::GetLocal:
+            jit.compile_get_local(*static_cast<GetLocal *>(instruction.get()));
+            break;
+          case Instruction::Type::Increment:
+            jit.compile_increment(*static_cast<Increment *>(instruction.get()));
+            break;
+          case Instruction::Type::LessThan:
+            jit.compile_less_than(*static_cast<LessThan *>(instruction.get()));
+            break;
+          case Instruction::Type::Add:
+            jit.compile_add(*static_cast<Add *>(instruction.get()));
+            break;
+          case Instruction::Type::Jump:
+            jit.compile_jump(*static_cast<Jump *>(instruction.get()));
+            break;
+          case Instruction::Type::JumpConditional:
+            jit.compile_jump_conditional(*static_cast<JumpConditional *>(instruction.get()));
+            break;
+          case Instruction::Type::Exit:
+            jit.compile_exit(*static_cast<Exit *>(instruction.get()));
+            break;
+          case Instruction::Type::Allocate:
+            jit.compile_allocate(*static_cast<Allocate *>(instruction.get()));
+            break;
+          case Instruction::Type::GetField:
+            jit.compile_get_field(*static_cast<GetField *>(instruction.get()));
+            break;
+          case Instruction::Type::SetField:
+            jit.compile_set_field(*static_cast<SetField *>(instruction.get()));
+            break;
+          case Instruction::Type::CallHost:
+            jit.compile_call_host(*static_cast<CallHost *>(instruction.get()));
+            break;
+          default:
+            throw std::runtime_error("Unknown instruction type");
+        }
+      }
+    }
+
+    // Jumps are rel32.
+    if (jit.buf.size() > INT32_MAX) {
+      throw std::runtime_error("Program too large to compile");
+    }
+    // Every target passed check_target.
+    for (const auto &relocation : jit.assembler.relocations) {
+      jit.buf.patch32(relocation.site, block_offsets[relocation.block] - relocation.site - 4);
+    }
+
+    size_t code_size = jit.buf.size();
+    Executable executable(jit.buf.release());
+    executable.finalize();
+    executable.register_unwind_info(
+        EhFrameBuilder::build(executable.data, code_size, jit.epilogues));
+    executable.code_size     = code_size;
+    executable.block_offsets = std::move(block_offsets);
+    executable.locations     = std::move(jit.locations);
+    executable.counters      = std::move(counters);
+
+    if (PerfJit::instance().enabled()) {
+      announce_to_perf(program, executable, code_size);
+    }
+
+    if (VM_PROBE_ENABLED(compile_end)) {
+      VM_PROBE3(compile_end, program.hash(), executable.data, code_size);
+    }
+    compile_scope.compiled = true;
+    Stats::add(Stat::ProgramsCompiled);
+    Stats::add(Stat::InstructionsCompiled, instruction_count);
+    Stats::add(Stat::CodeBytesEmitted, code_size);
+    Stats::record_compile(Stats::now_ns() - compile_scope.start);
+    if (compile_scope.trace_start) {
+      Tracer::complete("jit.compile", compile_scope.trace_start, "instructions",
+                       instruction_count);
+    }
+    return executable;
+  }
+
+  // Line numbers refer to the Program::dump listing, where every block and
+  // every instruction take one line; save it as `<name>.vm` for annotate.
+  static void announce_to_perf(const Program &program, const Executable &executable,
+                               size_t size) {
+    char fallback[32];
+    std::snprintf(fallback, sizeof(fallback), "program_%p", static_cast<const void *>(&program));
+    std::string name = program.name.empty() ? fallback : program.name;
+
+    std::vector<u32> first_line(program.blocks.size());
+    u32 line = 1;
+    for (size_t i = 0; i < program.blocks.size(); ++i) {
+      first_line[i] = line + 1;
+      line += 1 + narrow_cast<u32>(program.blocks[i]->instructions.size());
+    }
+
+    std::vector<PerfJit::LineEntry> lines;
+    lines.reserve(executable.locations.size());
+    for (const auto &location : executable.locations) {
+      lines.push_back({reinterpret_cast<u64>(executable.data) + location.offset,
+                       first_line[location.block] + location.instruction, location.block});
+    }
+    PerfJit::instance().code_loaded(executable.data, size, name, name + ".vm", lines);
+  }
+
+  CodeBuffer buf;
+  const Program *program{};
+  JitCounters *counters{};
+  u32 current_block{};
+  std::vector<size_t> epilogues;
+  std::vector<CodeLocation> locations;
+  // Compiler temporaries, freed in one go with the Jit.
+  Arena scratch;
+  Assembler assembler{buf, scratch};
+};
+
+// Where this thread is executing guest code, published for the sampling
+// profiler. Only read from signal handlers on the same thread, so relaxed
+// stores are enough.
+struct ExecutionPosition {
+  std::atomic<const Program *> program{};
+  // Set while running JIT code; the pc is then mapped via its locations.
+  std::atomic<const Executable *> executable{};
+  // Set while interpreting with ProfilerHooks (see profiler.h); without
+  // them, samples only know the Program.
+  std::atomic<const BasicBlock *> block{};
+  std::atomic<u32> instruction{};
+
+  // Publishes a new position for the duration of a VM::interpret or VM::jit
+  // call and restores the caller's when it returns (host calls may nest).
+  struct Scope {
+    ExecutionPosition &position;
+    const Program *program;
+    const Executable *executable;
+    const BasicBlock *block;
+    u32 instruction;
+
+    Scope(ExecutionPosition &position, const Program &new_program,
+          const Executable *new_executable)
+        : position(position),
+          program(position.program.load(std::memory_order_relaxed)),
+          executable(position.executable.load(std::memory_order_relaxed)),
+          block(position.block.load(std::memory_order_relaxed)),
+          instruction(position.instruction.load(std::memory_order_relaxed)) {
+      position.executable.store(new_executable, std::memory_order_relaxed);
+      position.block.store(nullptr, std::memory_order_relaxed);
+      position.program.store(&new_program, std::memory_order_relaxed);
+    }
+
+    ~Scope() {
+      position.program.store(program, std::memory_order_relaxed);
+      position.executable.store(executable, std::memory_order_relaxed);
+      position.block.store(block, std::memory_order_relaxed);
+      position.instruction.store(instruction, std::memory_order_relaxed);
+    }
+  };
+};
+
+inline thread_local ExecutionPosition execution_position;
+
+// Observes VM::interpret. These do nothing and compile away; instrumented
+// builds pass their own type with the same members instead.
+struct InterpreterHooks {
+  void begin(const Program &) {}
+  void enter_block(const BasicBlock &) {}
+  void execute(const Instruction &) {}
+  // Before a JumpConditional ending `block` goes to its true (`taken`) or
+  // false block.
+  void branch(const BasicBlock & /*block*/, bool /*taken*/) {}
+};
+
+// Interpreter hooks that record a BranchProfile per Program:
+//
+//   BranchProfiler profiler;
+//   vm.interpret(program, profiler);
+//   program.dump(&profiler.profile(program));
+struct BranchProfiler {
+  std::unordered_map<const Program *, BranchProfile> profiles;
+
+  const BranchProfile &profile(const Program &program) {
+    auto &profile = profiles[&program];
+    profile.resize(std::max(profile.block_count(), program.blocks.size()));
+    return profile;
+  }
+
+  void begin(const Program &program) {
+    current = &profiles[&program];
+    if (current->block_count() < program.blocks.size()) {
+      current->resize(program.blocks.size());
+    }
+  }
+
+  void enter_block(const BasicBlock &block) { current->entries[block.index]++; }
+  void execute(const Instruction &) {}
+
+  void branch(const BasicBlock &block, bool taken) {
+    (taken ? current->taken : current->not_taken)[block.index]++;
+  }
+
+ private:
+  BranchProfile *current{};
+};
+
+struct ProgramImage;
+
+// Counts an interpret call and the instructions it executed once it
+// returns or unwinds, so an exception from a host call loses nothing.
+struct InterpretStats {
+  u64 executed{};
+
+  ~InterpretStats() {
+    Stats::add(Stat::InterpretCalls);
+    Stats::add(Stat::InstructionsInterpreted, executed);
+  }
+};
+
+struct VM {
+  // Must stay the first member, JIT code reaches the nursery through RDI.
+  Heap heap;
+  // This thread's counters of the instrumented Executable being run.
+  u64 *jit_counters{};
+  std::vector<VM_Register> registers;
+  std::vector<VM_Value> locals;
+
+  void dump() const {
+    std::printf("Registers:\n");
+    for (size_t i = 0; i < registers.size(); ++i) {
+      std::printf("  %lu: %lu\n", i, registers[i]);
+    }
+    std::printf("Locals:\n");
+    for (size_t i = 0; i < locals.size(); ++i) {
+      std::printf("  %lu: %lu\n", i, locals[i]);
+    }
+  }
+
+  HeapObject *allocate(const Allocate &instruction) {
+    return allocate(instruction.slot_count, instruction.reference_slots,
+                    instruction.stack_map.registers, instruction.stack_map.locals);
+  }
+
+  // The stack map is given as any two ranges of register and local indices.
+  template <typename Registers, typename Locals>
+  HeapObject *allocate(u32 slot_count, u32 reference_slots, const Registers &map_registers,
+                       const Locals &map_locals) {
+    if (auto *object = heap.allocate(slot_count, reference_slots)) {
+      return object;
+    }
+
+    std::vector<VM_Value *> roots;
+    for (auto reg : map_registers) {
+      roots.push_back(&registers[reg]);
+    }
+    for (auto local : map_locals) {
+      roots.push_back(&locals[local]);
+    }
+    size_t minor    = heap.minor_collections;
+    size_t major    = heap.major_collections;
+    u64 trace_start = Tracer::enabled() ? Tracer::now() : 0;
+    auto *object    = heap.allocate_slow(slot_count, reference_slots, roots);
+    Stats::add(Stat::SlowAllocations);
+    Stats::add(Stat::MinorCollections, heap.minor_collections - minor);
+    Stats::add(Stat::MajorCollections, heap.major_collections - major);
+    if (trace_start) {
+      Tracer::complete("vm.allocate_slow", trace_start, "collections",
+                       heap.minor_collections - minor + heap.major_collections - major);
+    }
+    return object;
+  }
+
+  void set_field(const SetField &instruction) { set_field(instruction.object, instruction.index); }
+
+  void set_field(VM_Register object_register, u32 index) {
+    auto *object = reinterpret_cast<HeapObject *>(registers[object_register]);
+
+    object->slots()[index] = registers[0];
+    heap.write_barrier(object, index, registers[0]);
+  }
+
+  void call_host(const CallHost &instruction) {
+    call_host(instruction.function, instruction.arguments);
+  }
+
+  // `argument_registers` is any range of at most max_arguments indices.
+  template <typename Arguments>
+  void call_host(const HostFunction &function, const Arguments &argument_registers) {
+    VM_Value arguments[HostFunction::max_arguments];
+    size_t count = 0;
+    for (auto reg : argument_registers) {
+      arguments[count++] = registers[reg];
+    }
+    VM_Value result = function.invoke(function.function, *this, arguments);
+    if (function.returns_value) {
+      registers[0] = result;
+    }
+  }
+
+  void interpret(const Program &program) {
+    InterpreterHooks hooks;
+    interpret(program, hooks);
+  }
+
+  template <typename Hooks>
+  void interpret(const Program &program, Hooks &hooks) {
+    ExecutionPosition::Scope scope(execution_position, program, nullptr);
+    // Published once per call; kept in a register meanwhile.
+    InterpretStats stats;
+    u64 &executed   = stats.executed;
+    u64 trace_start = Tracer::enabled() ? Tracer::now() : 0;
+    VM_PROBE2(interpret_entry, &program, program.name.c_str());
+
+    auto *current_block      = program.blocks[0].get();
+    size_t instruction_index = 0;
+    hooks.begin(program);
+    hooks.enter_block(*current_block);
+    for (;;) {
+      if (instruction_index >= current_block->instructions.size()) {
+        break;
+      }
+      auto &instruction = current_block->instructions[instruction_index];
+      hooks.execute(*instruction);
+      executed++;
+      switch (instruction->type) {
+        case Instruction::Type::LoadImmediate:
+          registers[0] = static_cast<LoadImmediate *>(instruction.get())->value;
+          break;
+        case Instruction::Type::Load:
+          registers[0] = registers[static_cast<Load *>(instruction.get())->reg];
+          break;
+        case Instruction::Type::Store:
+          registers[static_cast<Store *>(instruction.get())->reg] = registers[0];
+          break;
+        case Instruction::Type::SetLocal:
+          locals[static_cast<SetLocal *>(instruction.get())->local] = registers[0];
+          break;
+        case Instruction::Type::GetLocal:
+          registers[0] = locals[static_cast<GetLocal *>(instruction.get())->local];
+          break;
+        case Instruction::Type::Increment:
+          registers[0]++;
+          break;
+        case Instruction::Type::LessThan:
+          registers[0] = registers[static_cast<LessThan *>(instruction.get())->lhs] < registers[0];
+          break;
+        case Instruction::Type::Add:
+          registers[0] = registers[static_cast<Add *>(instruction.get())->lhs] + registers[0];
+          break;
+        case Instruction::Type::Jump:
+          current_block     = &static_cast<Jump *>(instruction.get())->target_block;
+          instruction_index = 0;
+          hooks.enter_block(*current_block);
+          continue;
+        case Instruction::Type::JumpConditional:
+          hooks.branch(*current_block, registers[0] != 0);
+          if (registers[0]) {
+            current_block = &static_cast<JumpConditional *>(instruction.get())->true_block;
+          } else {
+            current_block = &static_cast<JumpConditional *>(instruction.get())->false_block;
+          }
+          instruction_index = 0;
+          hooks.enter_block(*current_block);
+          continue;
+        case Instruction::Type::Exit:
+          break;
+        case Instruction::Type::Allocate:
+          registers[0] = reinterpret_cast<VM_Value>(
+              allocate(*static_cast<Allocate *>(instruction.get())));
+          break;
+        case Instruction::Type::GetField: {
+          auto *get_field = static_cast<GetField *>(instruction.get());
+          auto *object    = reinterpret_cast<HeapObject *>(registers[get_field->object]);
+          registers[0]    = object->slots()[get_field->index];
+          break;
+        }
+        case Instruction::Type::SetField:
+          set_field(*static_cast<SetField *>(instruction.get()));
+          break;
+        case Instruction::Type::CallHost:
+          call_host(*static_cast<CallHost *>(instruction.get()));
+          break;
+        default:
+          throw std::runtime_error("Unknown instruction type");
+      }
+      instruction_index++;
+    }
+    if (trace_start) {
+      Tracer::complete("vm.interpret", trace_start, "instructions", executed);
+    }
+    VM_PROBE2(interpret_return, &program, executed);
+  }
+
+  // Runs a mapped image in place; defined in program_image.h.
+  void interpret(const ProgramImage &image);
+
+  void jit(const Program &program) {
+    auto executable = Jit::compile(program);
+    run(program, executable);
+  }
+
+  // Runs code compiled earlier from `program`.
+  void run(const Program &program, const Executable &executable) {
+    // RDI: VM&
+    // RSI: VM_Register* registers
+    // RDX: VM_Local* locals
+    typedef void (*JitFunction)(VM &, VM_Register *registers, VM_Local *locals);
+    auto func = reinterpret_cast<JitFunction>(executable.data);
+    ExecutionPosition::Scope scope(execution_position, program, &executable);
+    // Host calls may run other Programs on this VM, restore the caller's.
+    struct CountersScope {
+      u64 *&current;
+      u64 *caller;
+      ~CountersScope() { current = caller; }
+    } counters_scope{jit_counters, jit_counters};
+    if (executable.counters) {
+      jit_counters = executable.counters->for_this_thread();
+    }
+    Stats::add(Stat::JitRuns);
+    Tracer::Scope trace_scope("vm.run");
+    VM_PROBE2(jit_entry, &program, executable.data);
+    func(*this, registers.data(), locals.data());
+    VM_PROBE1(jit_return, &program);
+  }
+};
+
+inline HeapObject *vm_allocate_slow(VM &vm, const Allocate &instruction) {
+  return vm.allocate(instruction);
+}
+
+inline size_t vm_jit_counters_offset() { return offsetof(VM, jit_counters); }
+
+inline void vm_write_barrier(VM &vm, const SetField &instruction) {
+  auto *object = reinterpret_cast<HeapObject *>(vm.registers[instruction.object]);
+  vm.heap.write_barrier(object, instruction.index, vm.registers[0]);
+}
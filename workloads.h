@@ -0,0 +1,306 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+#include "vm.h"
+
+// The same guest code written once as AST and once as a VM Program, so the
+// three engines can be compared on equal work. Every VM Program leaves its
+// result in local 0; every AST function returns it.
+struct Workload {
+  std::string name;
+  std::vector<std::unique_ptr<Ast::FunctionDeclaration>> functions;
+  std::vector<std::unique_ptr<Program>> programs;
+  // Sum of the results of all programs (or functions), for validation.
+  u64 expected{};
+};
+
+// Emits the statement forms the workloads need, with VM locals as variables
+// and register 1 as scratch.
+struct ProgramWriter {
+  BasicBlock *block;
+
+  void set(VM_Local local, VM_Value value) {
+    block->append<LoadImmediate>(value);
+    block->append<SetLocal>(local);
+  }
+
+  void copy(VM_Local dst, VM_Local src) {
+    block->append<GetLocal>(src);
+    block->append<SetLocal>(dst);
+  }
+
+  void increment(VM_Local local) {
+    block->append<GetLocal>(local);
+    block->append<Increment>();
+    block->append<SetLocal>(local);
+  }
+
+  void add(VM_Local dst, VM_Local lhs, VM_Local rhs) {
+    block->append<GetLocal>(lhs);
+    block->append<Store>(VM_Register(1));
+    block->append<GetLocal>(rhs);
+    block->append<Add>(VM_Register(1));
+    block->append<SetLocal>(dst);
+  }
+
+  // if (lhs < rhs) goto true_block else goto false_block
+  void branch_less_than_literal(VM_Local lhs, VM_Value rhs, BasicBlock &true_block,
+                                BasicBlock &false_block) {
+    block->append<GetLocal>(lhs);
+    block->append<Store>(VM_Register(1));
+    block->append<LoadImmediate>(rhs);
+    block->append<LessThan>(VM_Register(1));
+    block->append<JumpConditional>(true_block, false_block);
+  }
+
+  void jump(BasicBlock &target) { block->append<Jump>(target); }
+
+  void exit() { block->append<Exit>(); }
+};
+
+inline std::unique_ptr<Ast::Variable> ast_var(const char *name) {
+  return std::make_unique<Ast::Variable>(name);
+}
+
+inline std::unique_ptr<Ast::Literal> ast_lit(int value) {
+  return std::make_unique<Ast::Literal>(value);
+}
+
+inline std::unique_ptr<Ast::LessThan> ast_less_than(std::unique_ptr<Ast> lhs,
+                                                    std::unique_ptr<Ast> rhs) {
+  return std::make_unique<Ast::LessThan>(std::move(lhs), std::move(rhs));
+}
+
+inline void ast_declare(Ast::Block &block, const char *name, int value) {
+  block.append<Ast::VariableDeclaration>(name, ValueType::Int, ast_lit(value));
+}
+
+inline std::unique_ptr<Ast::FunctionDeclaration> ast_function(const std::string &name) {
+  return std::make_unique<Ast::FunctionDeclaration>(name, ValueType::Int,
+                                                    std::make_unique<Ast::Block>());
+}
+
+// i = 0; while (i < n) i++; return i;
+inline Workload make_count_loop(int n) {
+  Workload workload;
+  workload.name     = "count_loop";
+  workload.expected = n;
+
+  auto function = ast_function("count_loop");
+  auto &body    = *function->body;
+  ast_declare(body, "i", 0);
+  auto loop = std::make_unique<Ast::Block>();
+  loop->append<Ast::Increment>(ast_var("i"));
+  body.append<Ast::While>(ast_less_than(ast_var("i"), ast_lit(n)), std::move(loop));
+  body.append<Ast::Return>(ast_var("i"));
+  workload.functions.push_back(std::move(function));
+
+  auto program  = std::make_unique<Program>();
+  program->name = "count_loop";
+  auto &entry   = program->make_block();
+  auto &header  = program->make_block();
+  auto &latch   = program->make_block();
+  auto &done    = program->make_block();
+  ProgramWriter{&entry}.set(0, 0);
+  ProgramWriter{&entry}.jump(header);
+  ProgramWriter{&header}.branch_less_than_literal(0, n, latch, done);
+  ProgramWriter{&latch}.increment(0);
+  ProgramWriter{&latch}.jump(header);
+  ProgramWriter{&done}.exit();
+  workload.programs.push_back(std::move(program));
+  return workload;
+}
+
+// Computes fib(30) iteratively, `repetitions` times.
+inline Workload make_fib(int repetitions) {
+  constexpr int steps = 30;
+
+  Workload workload;
+  workload.name     = "fib";
+  workload.expected = 832040;
+
+  auto function = ast_function("fib");
+  auto &body    = *function->body;
+  for (auto *name : {"r", "i", "t1", "t2", "t3"}) {
+    ast_declare(body, name, 0);
+  }
+  auto inner = std::make_unique<Ast::Block>();
+  inner->append<Ast::Assignment>("t3", std::make_unique<Ast::Add>(ast_var("t1"), ast_var("t2")));
+  inner->append<Ast::Assignment>("t1", ast_var("t2"));
+  inner->append<Ast::Assignment>("t2", ast_var("t3"));
+  inner->append<Ast::Increment>(ast_var("i"));
+  auto outer = std::make_unique<Ast::Block>();
+  outer->append<Ast::Assignment>("i", ast_lit(0));
+  outer->append<Ast::Assignment>("t1", ast_lit(0));
+  outer->append<Ast::Assignment>("t2", ast_lit(1));
+  outer->append<Ast::While>(ast_less_than(ast_var("i"), ast_lit(steps)), std::move(inner));
+  outer->append<Ast::Increment>(ast_var("r"));
+  body.append<Ast::While>(ast_less_than(ast_var("r"), ast_lit(repetitions)), std::move(outer));
+  body.append<Ast::Return>(ast_var("t1"));
+  workload.functions.push_back(std::move(function));
+
+  // Locals: 0 = t1 (result), 1 = r, 2 = i, 3 = t2, 4 = t3
+  auto program       = std::make_unique<Program>();
+  program->name      = "fib";
+  auto &entry        = program->make_block();
+  auto &outer_header = program->make_block();
+  auto &outer_body   = program->make_block();
+  auto &inner_header = program->make_block();
+  auto &inner_body   = program->make_block();
+  auto &outer_latch  = program->make_block();
+  auto &done         = program->make_block();
+  ProgramWriter writer{&entry};
+  writer.set(0, 0);
+  writer.set(1, 0);
+  writer.jump(outer_header);
+  ProgramWriter{&outer_header}.branch_less_than_literal(1, repetitions, outer_body, done);
+  writer = {&outer_body};
+  writer.set(2, 0);
+  writer.set(0, 0);
+  writer.set(3, 1);
+  writer.jump(inner_header);
+  ProgramWriter{&inner_header}.branch_less_than_literal(2, steps, inner_body, outer_latch);
+  writer = {&inner_body};
+  writer.add(4, 0, 3);
+  writer.copy(0, 3);
+  writer.copy(3, 4);
+  writer.increment(2);
+  writer.jump(inner_header);
+  writer = {&outer_latch};
+  writer.increment(1);
+  writer.jump(outer_header);
+  ProgramWriter{&done}.exit();
+  workload.programs.push_back(std::move(program));
+  return workload;
+}
+
+// for (i < n) for (j < 100) sum++; return sum;
+inline Workload make_nested_loops(int n) {
+  constexpr int inner_count = 100;
+
+  Workload workload;
+  workload.name     = "nested_loops";
+  workload.expected = u64(n) * inner_count;
+
+  auto function = ast_function("nested_loops");
+  auto &body    = *function->body;
+  for (auto *name : {"sum", "i", "j"}) {
+    ast_declare(body, name, 0);
+  }
+  auto inner = std::make_unique<Ast::Block>();
+  inner->append<Ast::Increment>(ast_var("sum"));
+  inner->append<Ast::Increment>(ast_var("j"));
+  auto outer = std::make_unique<Ast::Block>();
+  outer->append<Ast::Assignment>("j", ast_lit(0));
+  outer->append<Ast::While>(ast_less_than(ast_var("j"), ast_lit(inner_count)), std::move(inner));
+  outer->append<Ast::Increment>(ast_var("i"));
+  body.append<Ast::While>(ast_less_than(ast_var("i"), ast_lit(n)), std::move(outer));
+  body.append<Ast::Return>(ast_var("sum"));
+  workload.functions.push_back(std::move(function));
+
+  // Locals: 0 = sum, 1 = i, 2 = j
+  auto program       = std::make_unique<Program>();
+  program->name      = "nested_loops";
+  auto &entry        = program->make_block();
+  auto &outer_header = program->make_block();
+  auto &outer_body   = program->make_block();
+  auto &inner_header = program->make_block();
+  auto &inner_body   = program->make_block();
+  auto &outer_latch  = program->make_block();
+  auto &done         = program->make_block();
+  ProgramWriter writer{&entry};
+  writer.set(0, 0);
+  writer.set(1, 0);
+  writer.jump(outer_header);
+  ProgramWriter{&outer_header}.branch_less_than_literal(1, n, outer_body, done);
+  writer = {&outer_body};
+  writer.set(2, 0);
+  writer.jump(inner_header);
+  ProgramWriter{&inner_header}.branch_less_than_literal(2, inner_count, inner_body, outer_latch);
+  writer = {&inner_body};
+  writer.increment(0);
+  writer.increment(2);
+  writer.jump(inner_header);
+  writer = {&outer_latch};
+  writer.increment(1);
+  writer.jump(outer_header);
+  ProgramWriter{&done}.exit();
+  workload.programs.push_back(std::move(program));
+  return workload;
+}
+
+// for (i < n) { if (j < 3) { j++; taken++ } else { j = 0 } } return taken;
+inline Workload make_branchy(int n) {
+  Workload workload;
+  workload.name     = "branchy";
+  workload.expected = u64(n) - u64(n) / 4;
+
+  auto function = ast_function("branchy");
+  auto &body    = *function->body;
+  for (auto *name : {"taken", "i", "j"}) {
+    ast_declare(body, name, 0);
+  }
+  auto then_block = std::make_unique<Ast::Block>();
+  then_block->append<Ast::Increment>(ast_var("j"));
+  then_block->append<Ast::Increment>(ast_var("taken"));
+  auto else_block = std::make_unique<Ast::Block>();
+  else_block->append<Ast::Assignment>("j", ast_lit(0));
+  auto loop = std::make_unique<Ast::Block>();
+  loop->append<Ast::IfElse>(ast_less_than(ast_var("j"), ast_lit(3)), std::move(then_block),
+                            std::move(else_block));
+  loop->append<Ast::Increment>(ast_var("i"));
+  body.append<Ast::While>(ast_less_than(ast_var("i"), ast_lit(n)), std::move(loop));
+  body.append<Ast::Return>(ast_var("taken"));
+  workload.functions.push_back(std::move(function));
+
+  // Locals: 0 = taken, 1 = i, 2 = j
+  auto program     = std::make_unique<Program>();
+  program->name    = "branchy";
+  auto &entry      = program->make_block();
+  auto &header     = program->make_block();
+  auto &body_block = program->make_block();
+  auto &then_vm    = program->make_block();
+  auto &else_vm    = program->make_block();
+  auto &latch      = program->make_block();
+  auto &done       = program->make_block();
+  ProgramWriter writer{&entry};
+  writer.set(0, 0);
+  writer.set(1, 0);
+  writer.set(2, 0);
+  writer.jump(header);
+  ProgramWriter{&header}.branch_less_than_literal(1, n, body_block, done);
+  ProgramWriter{&body_block}.branch_less_than_literal(2, 3, then_vm, else_vm);
+  writer = {&then_vm};
+  writer.increment(2);
+  writer.increment(0);
+  writer.jump(latch);
+  writer = {&else_vm};
+  writer.set(2, 0);
+  writer.jump(latch);
+  writer = {&latch};
+  writer.increment(1);
+  writer.jump(header);
+  ProgramWriter{&done}.exit();
+  workload.programs.push_back(std::move(program));
+  return workload;
+}
+
+// `count` independent programs that each count to 10. Dominated by setup
+// and, for the JIT, by compilation.
+inline Workload make_many_small_programs(int count) {
+  constexpr int n = 10;
+
+  Workload workload;
+  workload.name     = "many_small_programs";
+  workload.expected = u64(count) * n;
+  for (int i = 0; i < count; ++i) {
+    auto single = make_count_loop(n);
+    workload.functions.push_back(std::move(single.functions.front()));
+    workload.programs.push_back(std::move(single.programs.front()));
+  }
+  return workload;
+}
@@ -0,0 +1,320 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// Decodes the x86-64 subset the Assembler emits (REX.W integer moves and
+// arithmetic and their 32-bit forms, inc/dec, test, setcc, movzx, push/pop,
+// push imm, call, jmp/jcc rel32, ret) into Intel syntax that llvm-mc and
+// llvm-mca accept. Anything else decodes as a one-byte `.byte`, so a listing
+// never stops at an unknown opcode; check.cpp makes sure the Jit and
+// AstCompiler never produce one.
+struct X86Decoder {
+  struct Instruction {
+    size_t offset;
+    size_t length;
+    std::string text;
+    // Offset of the rel32 target of jmp/jcc, when `has_target`.
+    bool has_target;
+    size_t target;
+  };
+
+  static Instruction decode(const u8 *code, size_t size, size_t offset) {
+    X86Decoder decoder(code, size, offset);
+    Instruction instruction{offset, 0, {}, false, 0};
+    if (!decoder.decode_one(instruction)) {
+      char text[16];
+      std::snprintf(text, sizeof(text), ".byte 0x%02x", code[offset]);
+      return {offset, 1, text, false, 0};
+    }
+    instruction.length = decoder.pos - offset;
+    return instruction;
+  }
+
+  static std::vector<Instruction> decode_all(const u8 *code, size_t size) {
+    std::vector<Instruction> instructions;
+    for (size_t offset = 0; offset < size;) {
+      instructions.push_back(decode(code, size, offset));
+      offset += instructions.back().length;
+    }
+    return instructions;
+  }
+
+  // `high_bytes`: byte registers 4-7 are ah, ch, dh, bh (no REX prefix).
+  static const char *register_name(u8 reg, int bits, bool high_bytes = false) {
+    static const char *const names64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp",
+                                          "rsi", "rdi", "r8",  "r9",  "r10", "r11",
+                                          "r12", "r13", "r14", "r15"};
+    static const char *const names32[] = {"eax",  "ecx",  "edx",  "ebx",  "esp",  "ebp",
+                                          "esi",  "edi",  "r8d",  "r9d",  "r10d", "r11d",
+                                          "r12d", "r13d", "r14d", "r15d"};
+    static const char *const names8[]  = {"al",  "cl",  "dl",   "bl",   "spl",  "bpl",
+                                          "sil", "dil", "r8b",  "r9b",  "r10b", "r11b",
+                                          "r12b", "r13b", "r14b", "r15b"};
+    static const char *const high8[]   = {"ah", "ch", "dh", "bh"};
+    switch (bits) {
+      case 64:
+        return names64[reg & 15];
+      case 32:
+        return names32[reg & 15];
+      default:
+        return high_bytes && reg >= 4 && reg < 8 ? high8[reg - 4] : names8[reg & 15];
+    }
+  }
+
+ private:
+  X86Decoder(const u8 *code, size_t size, size_t offset) : code(code), size(size), pos(offset) {}
+
+  // ModRM operand, already formatted.
+  struct ModRM {
+    u8 reg;
+    std::string rm;
+  };
+
+  bool decode_one(Instruction &instruction) {
+    if (pos >= size) {
+      return false;
+    }
+    if ((code[pos] & 0xf0) == 0x40) {
+      rex = code[pos++];
+    }
+    if (pos >= size) {
+      return false;
+    }
+    int bits = (rex & 8) ? 64 : 32;
+    u8 op    = code[pos++];
+    ModRM modrm;
+    u64 immediate;
+
+    switch (op) {
+      case 0x01:
+      case 0x29:
+      case 0x39:
+      case 0x85:
+      case 0x89: {
+        static const char *const names[] = {"add", "sub", "cmp", "test", "mov"};
+        size_t index = op == 0x01 ? 0 : op == 0x29 ? 1 : op == 0x39 ? 2 : op == 0x85 ? 3 : 4;
+        if (!read_modrm(bits, modrm)) {
+          return false;
+        }
+        instruction.text = std::string(names[index]) + " " + modrm.rm + ", " +
+                           register_name(modrm.reg, bits);
+        return true;
+      }
+      case 0x03:
+      case 0x2b:
+      case 0x3b:
+      case 0x8b: {
+        const char *name = op == 0x03 ? "add" : op == 0x2b ? "sub" : op == 0x3b ? "cmp" : "mov";
+        if (!read_modrm(bits, modrm)) {
+          return false;
+        }
+        instruction.text =
+            std::string(name) + " " + register_name(modrm.reg, bits) + ", " + modrm.rm;
+        return true;
+      }
+      case 0x81:
+      case 0x83: {
+        static const char *const names[] = {"add", "or", "adc", "sbb", "and", "sub", "xor", "cmp"};
+        if (!read_modrm(bits, modrm) || !read_immediate(op == 0x81 ? 4 : 1, immediate)) {
+          return false;
+        }
+        instruction.text =
+            std::string(names[modrm.reg & 7]) + " " + modrm.rm + ", " + signed_hex(immediate);
+        return true;
+      }
+      case 0x68:
+      case 0x6a:
+        // Sign-extended to 64 bits.
+        if (!read_immediate(op == 0x68 ? 4 : 1, immediate)) {
+          return false;
+        }
+        instruction.text = "push " + signed_hex(immediate);
+        return true;
+      case 0xc3:
+        instruction.text = "ret";
+        return true;
+      case 0xe9:
+        return read_branch("jmp", instruction);
+      case 0xff: {
+        // Near calls always take a 64-bit operand.
+        bool is_call = pos < size && ((code[pos] >> 3) & 7) == 2;
+        if (!read_modrm(is_call ? 64 : bits, modrm)) {
+          return false;
+        }
+        switch (modrm.reg & 7) {
+          case 0:
+            instruction.text = "inc " + modrm.rm;
+            return true;
+          case 1:
+            instruction.text = "dec " + modrm.rm;
+            return true;
+          case 2:
+            instruction.text = "call " + modrm.rm;
+            return true;
+        }
+        return false;
+      }
+      case 0x0f:
+        return decode_two_byte(instruction);
+    }
+
+    if (op >= 0x50 && op <= 0x5f) {
+      instruction.text = std::string(op < 0x58 ? "push " : "pop ") +
+                         register_name((op & 7) | ((rex & 1) << 3), 64);
+      return true;
+    }
+    if (op >= 0xb8 && op <= 0xbf) {
+      if (!read_immediate(bits / 8, immediate)) {
+        return false;
+      }
+      char text[64];
+      std::snprintf(text, sizeof(text), "%s %s, 0x%lx", bits == 64 ? "movabs" : "mov",
+                    register_name((op & 7) | ((rex & 1) << 3), bits), immediate);
+      instruction.text = text;
+      return true;
+    }
+    return false;
+  }
+
+  bool decode_two_byte(Instruction &instruction) {
+    static const char *const conditions[] = {"o",  "no", "b",  "ae", "e",  "ne", "be", "a",
+                                             "s",  "ns", "p",  "np", "l",  "ge", "le", "g"};
+    if (pos >= size) {
+      return false;
+    }
+    u8 op = code[pos++];
+    ModRM modrm;
+    if (op >= 0x80 && op <= 0x8f) {
+      return read_branch((std::string("j") + conditions[op & 15]).c_str(), instruction);
+    }
+    if (op >= 0x90 && op <= 0x9f) {
+      if (!read_modrm(8, modrm)) {
+        return false;
+      }
+      instruction.text = std::string("set") + conditions[op & 15] + " " + modrm.rm;
+      return true;
+    }
+    if (op == 0xb6) {
+      int bits = (rex & 8) ? 64 : 32;
+      if (!read_modrm(8, modrm)) {
+        return false;
+      }
+      instruction.text = std::string("movzx ") + register_name(modrm.reg, bits) + ", " + modrm.rm;
+      return true;
+    }
+    return false;
+  }
+
+  // Reads ModRM (and SIB and displacement); `bits` sizes a register rm or
+  // the memory operand.
+  bool read_modrm(int bits, ModRM &modrm) {
+    if (pos >= size) {
+      return false;
+    }
+    u8 byte   = code[pos++];
+    u8 mod    = byte >> 6;
+    modrm.reg = ((byte >> 3) & 7) | ((rex & 4) << 1);
+    u8 rm     = (byte & 7) | ((rex & 1) << 3);
+    if (mod == 3) {
+      modrm.rm = register_name(rm, bits, !rex);
+      return true;
+    }
+
+    std::string base;
+    if ((byte & 7) == 4) {
+      // SIB; only a base with no index is emitted.
+      if (pos >= size) {
+        return false;
+      }
+      u8 sib   = code[pos++];
+      u8 index = ((sib >> 3) & 7) | ((rex & 2) << 2);
+      u8 reg   = (sib & 7) | ((rex & 1) << 3);
+      if (mod == 0 && (sib & 7) == 5) {
+        base = "";
+      } else {
+        base = register_name(reg, 64);
+      }
+      if (index != 4) {
+        char scaled[32];
+        std::snprintf(scaled, sizeof(scaled), "%s%s*%d", base.empty() ? "" : " + ",
+                      register_name(index, 64), 1 << (sib >> 6));
+        base += scaled;
+      }
+      if (mod == 0 && (sib & 7) == 5) {
+        mod = 2;  // disp32 follows
+      }
+    } else if (mod == 0 && (byte & 7) == 5) {
+      base = "rip";
+      mod  = 2;
+    } else {
+      base = register_name(rm, 64);
+    }
+
+    u64 displacement = 0;
+    if (mod == 1 && !read_immediate(1, displacement)) {
+      return false;
+    }
+    if (mod == 2 && !read_immediate(4, displacement)) {
+      return false;
+    }
+
+    const char *size_name = bits == 64 ? "qword" : bits == 32 ? "dword" : "byte";
+    modrm.rm              = std::string(size_name) + " ptr [" + base;
+    if (displacement) {
+      auto value = static_cast<int64_t>(displacement);
+      char text[32];
+      std::snprintf(text, sizeof(text), "%s%s0x%lx", base.empty() ? "" : " ",
+                    value < 0 ? "- " : base.empty() ? "" : "+ ",
+                    static_cast<u64>(value < 0 ? -value : value));
+      modrm.rm += text;
+    }
+    modrm.rm += "]";
+    return true;
+  }
+
+  // Little-endian immediate of 1, 4 or 8 bytes, sign-extended to 64 bits.
+  bool read_immediate(size_t bytes, u64 &value) {
+    if (pos + bytes > size) {
+      return false;
+    }
+    value = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+      value |= u64(code[pos + i]) << (8 * i);
+    }
+    if (bytes < 8 && (value >> (8 * bytes - 1)) & 1) {
+      value |= ~u64(0) << (8 * bytes);
+    }
+    pos += bytes;
+    return true;
+  }
+
+  bool read_branch(const char *name, Instruction &instruction) {
+    u64 displacement;
+    if (!read_immediate(4, displacement)) {
+      return false;
+    }
+    instruction.has_target = true;
+    instruction.target     = pos + displacement;
+    char text[48];
+    std::snprintf(text, sizeof(text), "%s 0x%lx", name, instruction.target);
+    instruction.text = text;
+    return true;
+  }
+
+  static std::string signed_hex(u64 value) {
+    auto number = static_cast<int64_t>(value);
+    char text[32];
+    std::snprintf(text, sizeof(text), number < 0 ? "-0x%lx" : "0x%lx",
+                  static_cast<u64>(number < 0 ? -number : number));
+    return text;
+  }
+
+  const u8 *code;
+  size_t size;
+  size_t pos;
+  u8 rex{};
+};